@@ -35,6 +35,12 @@
 #include "accelerators/bvh.h"
 #include "probes.h"
 #include "paramset.h"
+#include "intersection.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PBRT_BVH_HAS_SSE2
+#include <emmintrin.h>
+#endif
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -148,6 +154,58 @@ static inline bool IntersectP(const BBox &bounds, const Ray &ray,
 }
 
 
+#ifdef PBRT_BVH_HAS_SSE2
+// Rays traced together through the BVH, one per SIMD lane
+static const int BVH_PACKET_SIZE = 4;
+
+struct BVHRayPacket {
+    __m128 o[3], invDir[3];
+    // All ones in the lanes whose ray direction is negative along the axis
+    __m128 dirIsNeg[3];
+    __m128 mint, maxt;
+};
+
+
+static inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+
+// Bit mask of the lanes whose ray intersects 'bounds'. Every lane follows
+// the steps of the single ray test above, so both agree exactly.
+static inline int IntersectP(const BBox &bounds, const BVHRayPacket &packet) {
+    // Check for ray intersection against $x$ and $y$ slabs
+    __m128 lo = _mm_set1_ps(bounds.pMin.x), hi = _mm_set1_ps(bounds.pMax.x);
+    __m128 tmin = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[0], hi, lo),
+                                        packet.o[0]), packet.invDir[0]);
+    __m128 tmax = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[0], lo, hi),
+                                        packet.o[0]), packet.invDir[0]);
+    lo = _mm_set1_ps(bounds.pMin.y); hi = _mm_set1_ps(bounds.pMax.y);
+    __m128 tymin = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[1], hi, lo),
+                                         packet.o[1]), packet.invDir[1]);
+    __m128 tymax = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[1], lo, hi),
+                                         packet.o[1]), packet.invDir[1]);
+    __m128 miss = _mm_or_ps(_mm_cmpgt_ps(tmin, tymax), _mm_cmpgt_ps(tymin, tmax));
+    tmin = Select(_mm_cmpgt_ps(tymin, tmin), tymin, tmin);
+    tmax = Select(_mm_cmplt_ps(tymax, tmax), tymax, tmax);
+
+    // Check for ray intersection against $z$ slab
+    lo = _mm_set1_ps(bounds.pMin.z); hi = _mm_set1_ps(bounds.pMax.z);
+    __m128 tzmin = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[2], hi, lo),
+                                         packet.o[2]), packet.invDir[2]);
+    __m128 tzmax = _mm_mul_ps(_mm_sub_ps(Select(packet.dirIsNeg[2], lo, hi),
+                                         packet.o[2]), packet.invDir[2]);
+    miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmpgt_ps(tmin, tzmax),
+                                     _mm_cmpgt_ps(tzmin, tmax)));
+    tmin = Select(_mm_cmpgt_ps(tzmin, tmin), tzmin, tmin);
+    tmax = Select(_mm_cmplt_ps(tzmax, tmax), tzmax, tmax);
+    __m128 hit = _mm_and_ps(_mm_cmplt_ps(tmin, packet.maxt),
+                            _mm_cmpgt_ps(tmax, packet.mint));
+    return _mm_movemask_ps(_mm_andnot_ps(miss, hit));
+}
+#endif // PBRT_BVH_HAS_SSE2
+
+
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(const vector<Reference<Primitive> > &p,
@@ -503,6 +561,102 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
 }
 
 
+void BVHAccel::IntersectBatch(const RayDifferential *rays,
+        Intersection *isects, bool *hits, int count) const {
+#ifdef PBRT_BVH_HAS_SSE2
+    for (int start = 0; start < count; start += BVH_PACKET_SIZE)
+        IntersectPacket(rays + start, isects + start, hits + start,
+                        min(BVH_PACKET_SIZE, count - start));
+#else
+    Aggregate::IntersectBatch(rays, isects, hits, count);
+#endif // PBRT_BVH_HAS_SSE2
+}
+
+
+void BVHAccel::IntersectPacket(const RayDifferential *rays,
+        Intersection *isects, bool *hits, int count) const {
+    for (int i = 0; i < count; ++i)
+        hits[i] = false;
+    if (!nodes) return;
+#ifdef PBRT_BVH_HAS_SSE2
+    // Load the rays in the lanes of the packet, the unused lanes repeat the
+    // last ray and are masked out
+    BVHRayPacket packet;
+    float lane[4][BVH_PACKET_SIZE];
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int i = 0; i < BVH_PACKET_SIZE; ++i) {
+            const Ray &ray = rays[min(i, count - 1)];
+            lane[0][i] = ray.o[axis];
+            lane[1][i] = 1.f / ray.d[axis];
+        }
+        packet.o[axis] = _mm_loadu_ps(lane[0]);
+        packet.invDir[axis] = _mm_loadu_ps(lane[1]);
+        packet.dirIsNeg[axis] = _mm_cmplt_ps(packet.invDir[axis], _mm_setzero_ps());
+    }
+    for (int i = 0; i < BVH_PACKET_SIZE; ++i) {
+        lane[2][i] = rays[min(i, count - 1)].mint;
+        lane[3][i] = rays[min(i, count - 1)].maxt;
+    }
+    packet.mint = _mm_loadu_ps(lane[2]);
+    packet.maxt = _mm_loadu_ps(lane[3]);
+
+    // The children are visited in the order of the first ray, which the
+    // coherent rays of a packet mostly share
+    Vector invDir(1.f / rays[0].d.x, 1.f / rays[0].d.y, 1.f / rays[0].d.z);
+    uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+    // Follow the packet through BVH nodes. Each node is only tested for the
+    // rays that reached its parent, given by the 'active' lanes.
+    struct { uint32_t nodeNum; int active; } todo[64];
+    uint32_t todoOffset = 0, nodeNum = 0;
+    int active = (1 << count) - 1;
+    while (true) {
+        const LinearBVHNode *node = &nodes[nodeNum];
+        int mask = active & ::IntersectP(node->bounds, packet);
+        if (mask) {
+            if (node->nPrimitives > 0) {
+                // Intersect each ray of the packet with the leaf primitives
+                bool hitLeaf = false;
+                for (int r = 0; r < count; ++r) {
+                    if (!(mask & (1 << r))) continue;
+                    for (uint32_t i = 0; i < node->nPrimitives; ++i)
+                        if (primitives[node->primitivesOffset+i]->Intersect(rays[r], &isects[r]))
+                            hits[r] = hitLeaf = true;
+                }
+                // The hits shortened the rays
+                if (hitLeaf) {
+                    for (int i = 0; i < BVH_PACKET_SIZE; ++i)
+                        lane[3][i] = rays[min(i, count - 1)].maxt;
+                    packet.maxt = _mm_loadu_ps(lane[3]);
+                }
+            }
+            else {
+                // Put far BVH node on _todo_ stack, advance to near node
+                todo[todoOffset].active = mask;
+                if (dirIsNeg[node->axis]) {
+                   todo[todoOffset++].nodeNum = nodeNum + 1;
+                   nodeNum = node->secondChildOffset;
+                }
+                else {
+                   todo[todoOffset++].nodeNum = node->secondChildOffset;
+                   nodeNum = nodeNum + 1;
+                }
+                active = mask;
+                continue;
+            }
+        }
+        if (todoOffset == 0) break;
+        --todoOffset;
+        nodeNum = todo[todoOffset].nodeNum;
+        active = todo[todoOffset].active;
+    }
+#else
+    for (int i = 0; i < count; ++i)
+        hits[i] = Intersect(rays[i], &isects[i]);
+#endif // PBRT_BVH_HAS_SSE2
+}
+
+
 BVHAccel *CreateBVHAccelerator(const vector<Reference<Primitive> > &prims,
         const ParamSet &ps) {
     string splitMethod = ps.FindOneString("splitmethod", "sah");
@@ -56,12 +56,20 @@ public:
     ~BVHAccel();
     bool Intersect(const Ray &ray, Intersection *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Traces the rays as SIMD packets, see IntersectPacket()
+    void IntersectBatch(const RayDifferential *rays, Intersection *isects,
+                        bool *hits, int count) const;
 private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(MemoryArena &buildArena,
         vector<BVHPrimitiveInfo> &buildData, uint32_t start, uint32_t end,
         uint32_t *totalNodes, vector<Reference<Primitive> > &orderedPrims);
     uint32_t flattenBVHTree(BVHBuildNode *node, uint32_t *offset);
+    // Intersect() of up to four rays, traversing the BVH once for all of
+    // them: each node bounds is tested against the rays that reached it at
+    // once, the leaf primitives are still intersected ray by ray
+    void IntersectPacket(const RayDifferential *rays, Intersection *isects,
+                         bool *hits, int count) const;
 
     // BVHAccel Private Data
     uint32_t maxPrimsInNode;
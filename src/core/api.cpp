@@ -686,6 +686,8 @@ Film *MakeFilm(const string &name,
         film = CreateDualFilm(paramSet, filter);
     else
         Warning("Film \"%s\" unknown.", name.c_str());
+    if (film && PbrtOptions.nTiles > 0 && name != "dual")
+        Severe("Distributed rendering needs the \"dual\" film.");
     paramSet.ReportUnused();
     return film;
 }
@@ -1267,6 +1269,21 @@ Renderer *RenderOptions::MakeRenderer() const {
             Warning("Renderer type \"%s\" unknown.  Using \"sampler\".",
                     RendererName.c_str());
         bool visIds = RendererParams.FindOneBool("visualizeobjectids", false);
+        bool packets = RendererParams.FindOneBool("packettracing", false);
+        float timeBudget = 0.f, staleness = 0.f, checkpointInterval = 0.f;
+        string checkpointFile;
+        if (RendererName == "twostages") {
+            timeBudget = RendererParams.FindOneFloat("timebudget", 0.f);
+            staleness = RendererParams.FindOneFloat("staleness", 0.f);
+            checkpointFile = RendererParams.FindOneString("checkpoint", "");
+            checkpointInterval = RendererParams.FindOneFloat("checkpointinterval", 0.f);
+            // Each tile of a distributed render has its own checkpoint
+            if (checkpointFile != "" && PbrtOptions.nTiles > 0) {
+                char suffix[32];
+                snprintf(suffix, sizeof(suffix), ".tile%d", PbrtOptions.tile);
+                checkpointFile += suffix;
+            }
+        }
         RendererParams.ReportUnused();
         Sampler *sampler = MakeSampler(SamplerName, SamplerParams, camera->film, camera);
         if (!sampler) Severe("Unable to create sampler.");
@@ -1279,10 +1296,11 @@ Renderer *RenderOptions::MakeRenderer() const {
         if (!volumeIntegrator) Severe("Unable to create volume integrator.");
         if (RendererName != "twostages")
             renderer = new SamplerRenderer(sampler, camera, surfaceIntegrator,
-                volumeIntegrator, visIds);
+                volumeIntegrator, visIds, packets);
         else
             renderer = new TwoStagesSamplerRenderer(sampler, camera,
-                surfaceIntegrator, volumeIntegrator, visIds);
+                surfaceIntegrator, volumeIntegrator, visIds, timeBudget,
+                staleness, checkpointFile, checkpointInterval, packets);
         // Warn if no light sources are defined
         if (lights.size() == 0)
             Warning("No light sources defined in scene; "
@@ -33,9 +33,13 @@
 #include "fileutil.h"
 #include <cstdlib>
 #include <climits>
-#ifndef PBRT_IS_WINDOWS
+#ifdef PBRT_IS_WINDOWS
+#include <windows.h>
+#include <io.h>
+#else
 #include <libgen.h>
 #include <string.h>
+#include <unistd.h>
 #endif
 
 static string searchDirectory;
@@ -139,4 +143,23 @@ void SetSearchDirectory(const string &dirname) {
 }
 
 
-
+bool CommitFile(FILE *f, const string &tmpFilename, const string &filename) {
+    bool ok = (fflush(f) == 0);
+#ifdef PBRT_IS_WINDOWS
+    ok = ok && (_commit(_fileno(f)) == 0);
+#else
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        remove(tmpFilename.c_str());
+        return false;
+    }
+#ifdef PBRT_IS_WINDOWS
+    // rename() fails on Windows when the destination exists
+    return MoveFileExA(tmpFilename.c_str(), filename.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(tmpFilename.c_str(), filename.c_str()) == 0;
+#endif
+}
@@ -36,6 +36,7 @@
 #ifndef PBRT_CORE_FILEUTIL_H
 #define PBRT_CORE_FILEUTIL_H
 
+#include <stdio.h>
 #include <string>
 using std::string;
 
@@ -47,5 +48,10 @@ string ResolveFilename(const string &filename);
 string DirectoryContaining(const string &filename);
 void SetSearchDirectory(const string &dirname);
 
+// Flush 'f', which was opened on 'tmpFilename', to disk, close it and rename
+// it to 'filename', replacing any existing file in one step so that readers
+// see either the old or the new contents.
+bool CommitFile(FILE *f, const string &tmpFilename, const string &filename);
+
 #endif // PBRT_CORE_FILEUTIL_H
 
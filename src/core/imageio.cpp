@@ -390,15 +390,16 @@ static RGBSpectrum *ReadImagePFM(const string &filename, int *xres, int *yres) {
         for (unsigned int i = 0; i < nFloats; ++i)
             data[i] *= fabsf(scale);
 
-    // create RGBs...
+    // create RGBs, flipping the rows stored bottom to top
     rgb = new RGBSpectrum[width*height];
-    if (nChannels == 1) {
-        for (int i = 0; i < width * height; ++i)
-            rgb[i] = data[i];
-    }
-    else {
-        for (int i = 0; i < width * height; ++i)
-            rgb[i] = RGBSpectrum::FromRGB(&data[3*i]);
+    for (int y = 0; y < height; ++y) {
+        const float *row = data + (height - 1 - y) * width * nChannels;
+        for (int x = 0; x < width; ++x) {
+            if (nChannels == 1)
+                rgb[y*width+x] = row[x];
+            else
+                rgb[y*width+x] = RGBSpectrum::FromRGB(&row[3*x]);
+        }
     }
 
     delete[] data;
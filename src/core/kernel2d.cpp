@@ -7,8 +7,15 @@
  */
 
 
+#include "stdafx.h"
 #include "kernel2d.h"
 #include "rng.h"
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PBRT_KERNEL2D_HAS_SSE2
+#include <emmintrin.h>
+#endif
 
 
 Kernel2D::Kernel2D(const Filter* filter, KernelNorm norm, int resSub) {
@@ -38,162 +45,255 @@ Kernel2D::Kernel2D(const Filter* filter, KernelNorm norm, int resSub) {
 }
 
 
-void Kernel2D::ApplySep1C(int xPixelCount, int yPixelCount,
-    const vector<float>& in, vector<float>& tmp, vector<float>& out,
-    KernelSkip skip) const {
+// Kernel2D Row Kernels
+static void AxpyRow(int n, float w, const float *src, float *dst) {
+    int i = 0;
+#ifdef PBRT_KERNEL2D_HAS_SSE2
+    __m128 vw = _mm_set1_ps(w);
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(vw, _mm_loadu_ps(src + i)));
+        _mm_storeu_ps(dst + i, d);
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] += w * src[i];
+}
 
-    int nPix = xPixelCount * yPixelCount;
 
-    // Horizontal filtering
-    float kxPad = 1.f;
-    if (_k.empty())
-        copy(in.begin(), in.end(), tmp.begin());
-    else {
-        int xTaps = _k.size();
-        int xPad = xTaps/2;
-        kxPad = _k[xPad];
-#pragma omp parallel for num_threads(PbrtOptions.nCores)
-        for (int pix = 0; pix < nPix; pix++) {
-            int y = pix / xPixelCount, x = pix - y * xPixelCount;
-            tmp[pix] = 0.f;
-            // Restrict the window
-            float tmin = max(0, xPad-x), tmax = min(xTaps, xPixelCount+xPad-x);
-            // Do the filtering
-            float sum = 0.f;
-            for (int tap = tmin; tap < tmax; tap++) {
-                int spix = pix+tap-xPad;
-                tmp[pix] += _k[tap] * in[spix];
-                sum += _k[tap];
-            }
-            tmp[pix] *= _kNorm/sum;
+static void ScaleRow(int n, float s, float *dst) {
+    int i = 0;
+#ifdef PBRT_KERNEL2D_HAS_SSE2
+    __m128 vs = _mm_set1_ps(s);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(vs, _mm_loadu_ps(dst + i)));
+#endif
+    for (; i < n; i++)
+        dst[i] *= s;
+}
 
-            // decrease contribution of center pixel to, at most, th%, and reweight the rest
-            if (_k2.empty() && skip == KERNEL_SKIP_CENTER) {
-                float th = 0.01f; // small residual contribution to tip the balance if needed
-                float cwt = kxPad, diff = max(0.f, cwt-th);
-                float scale = _kNorm / (_kNorm - diff);
-                tmp[pix] = (tmp[pix]-diff*in[pix]) * scale;
 
-            }
+// One step of the vertical running sum: add the 'add' row and remove the
+// 'sub' row, either of which can be missing, then store the scaled sums
+static void ColumnStep(int x0, int x1, double *colSum, const float *add,
+        const float *sub, double scale, float *dst) {
+    int x = x0;
+#ifdef PBRT_KERNEL2D_HAS_SSE2
+    if (add && sub) {
+        __m128d vs = _mm_set1_pd(scale);
+        for (; x + 4 <= x1; x += 4) {
+            __m128 a = _mm_loadu_ps(add + x), b = _mm_loadu_ps(sub + x);
+            __m128d lo = _mm_loadu_pd(colSum + x), hi = _mm_loadu_pd(colSum + x + 2);
+            lo = _mm_add_pd(lo, _mm_cvtps_pd(a));
+            hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(a, a)));
+            lo = _mm_sub_pd(lo, _mm_cvtps_pd(b));
+            hi = _mm_sub_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(b, b)));
+            _mm_storeu_pd(colSum + x, lo);
+            _mm_storeu_pd(colSum + x + 2, hi);
+            __m128 r = _mm_movelh_ps(_mm_cvtpd_ps(_mm_mul_pd(lo, vs)),
+                                     _mm_cvtpd_ps(_mm_mul_pd(hi, vs)));
+            _mm_storeu_ps(dst + x, r);
         }
     }
+#endif
+    for (; x < x1; x++) {
+        if (add) colSum[x] += add[x];
+        if (sub) colSum[x] -= sub[x];
+        dst[x] = (float)(colSum[x] * scale);
+    }
+}
 
-    // Vertical filtering
-    if (_k2.empty())
-        copy(tmp.begin(), tmp.end(), out.begin());
-    else {
-        int yTaps = _k2.size();
-        int yPad = yTaps/2;
-#pragma omp parallel for num_threads(PbrtOptions.nCores)
-        for (int pix = 0; pix < nPix; pix++) {
-            int y = pix / xPixelCount;
-            out[pix] = 0.f;
-            // Restrict the window
-            float tmin = max(0, yPad-y), tmax = min(yTaps, yPixelCount+yPad-y);
-            // Do the filtering
-            float sum = 0.f;
-            for (int tap = tmin; tap < tmax; tap++) {
-                int spix = pix + (tap-yPad) * xPixelCount;
-                out[pix] += _k2[tap] * tmp[spix];
-                sum += _k2[tap];
-            }
-            out[pix] *= _k2Norm/sum;
 
-            // decrease contribution of center pixel to, at most, th%, and reweight the rest
-            if (skip == KERNEL_SKIP_CENTER) {
-                float norm = _kNorm * _k2Norm;
-                float th = 0.01f; // small residual contribution to tip the balance if needed
-                float cwt = kxPad * _k2[yPad], diff = max(0.f, cwt-th);
-                float scale = norm / (norm - diff);
-                out[pix] = (out[pix]-diff*in[pix]) * scale;
+static inline double BoxScale(BoxNorm norm, int r, int lo, int hi) {
+    if (norm == BOX_NORM_FULL) return 1. / (2*r+1);
+    if (norm == BOX_NORM_CLIPPED) return 1. / (hi - lo + 1);
+    return 1.;
+}
 
+
+void BoxSumRows(const float *src, float *dst, int width, int nChannels,
+        int nRows, int r, int x0, int x1, BoxNorm norm) {
+    // The first window starts at 'xLo', values left of it are never removed
+    int xLo = max(0, x0 - r);
+    for (int y = 0; y < nRows; y++) {
+        const float *s = src + y * width * nChannels;
+        float *d = dst + y * width * nChannels;
+        for (int c = 0; c < nChannels; c++) {
+            double acc = 0.;
+            for (int x = xLo; x < min(x0 + r, width); x++)
+                acc += s[nChannels*x+c];
+            for (int x = x0; x < x1; x++) {
+                if (x + r < width) acc += s[nChannels*(x+r)+c];
+                if (x - r - 1 >= xLo) acc -= s[nChannels*(x-r-1)+c];
+                double scale = BoxScale(norm, r, max(0, x-r), min(width-1, x+r));
+                d[nChannels*x+c] = (float)(acc * scale);
             }
         }
     }
 }
 
 
-void Kernel2D::ApplySep3C(int xPixelCount, int yPixelCount,
+void BoxSumColumns(const float *src, int srcY0, float *dst, int y0, int y1,
+        int rowLength, int height, int r, int x0, int x1, BoxNorm norm,
+        double *colSum) {
+    int yLo = max(0, y0 - r);
+    for (int x = x0; x < x1; x++)
+        colSum[x] = 0.;
+    for (int y = yLo; y < min(y0 + r, height); y++) {
+        const float *s = src + (y - srcY0) * rowLength;
+        for (int x = x0; x < x1; x++)
+            colSum[x] += s[x];
+    }
+    for (int y = y0; y < y1; y++) {
+        const float *add = (y + r < height) ? src + (y + r - srcY0) * rowLength : NULL;
+        const float *sub = (y - r - 1 >= yLo) ? src + (y - r - 1 - srcY0) * rowLength : NULL;
+        double scale = BoxScale(norm, r, max(0, y-r), min(height-1, y+r));
+        ColumnStep(x0, x1, colSum, add, sub, scale, dst + (y - y0) * rowLength);
+    }
+}
+
+
+// Kernel2DTask Declarations
+class Kernel2DTask : public Task {
+public:
+    Kernel2DTask(const Kernel2D *k, bool h, int nc, int w, int ht,
+        const float *i, float *t, float *o, KernelSkip sk, int y0, int y1)
+        : kernel(k), horizontal(h), nChannels(nc), xPixelCount(w),
+          yPixelCount(ht), in(i), tmp(t), out(o), skip(sk), yStart(y0),
+          yEnd(y1) { }
+    void Run() {
+        if (horizontal)
+            kernel->ApplySepRowsH(nChannels, xPixelCount, yPixelCount, in,
+                tmp, skip, yStart, yEnd);
+        else
+            kernel->ApplySepRowsV(nChannels, xPixelCount, yPixelCount, in,
+                tmp, out, skip, yStart, yEnd);
+    }
+private:
+    const Kernel2D *kernel;
+    bool horizontal;
+    int nChannels, xPixelCount, yPixelCount;
+    const float *in;
+    float *tmp, *out;
+    KernelSkip skip;
+    int yStart, yEnd;
+};
+
+
+void Kernel2D::ApplySep(int nChannels, int xPixelCount, int yPixelCount,
     const vector<float>& in, vector<float>& tmp, vector<float>& out,
     KernelSkip skip) const {
 
-    int nPix = xPixelCount * yPixelCount;
+    // Both passes are split in row bands, the vertical one can only start
+    // once all the rows it reads are done
+    int nBands = max(1, min(4 * NumSystemCores(), yPixelCount));
+    int bandRows = (yPixelCount + nBands - 1) / nBands;
+    for (int pass = 0; pass < 2; pass++) {
+        vector<Task *> tasks;
+        for (int y = 0; y < yPixelCount; y += bandRows)
+            tasks.push_back(new Kernel2DTask(this, pass == 0, nChannels,
+                xPixelCount, yPixelCount, &in[0], &tmp[0], &out[0], skip,
+                y, min(y + bandRows, yPixelCount)));
+        EnqueueTasks(tasks);
+        WaitForAllTasks();
+        for (uint32_t i = 0; i < tasks.size(); i++)
+            delete tasks[i];
+    }
+}
+
+
+void Kernel2D::ApplySepRowsH(int nChannels, int xPixelCount, int yPixelCount,
+    const float *in, float *tmp, KernelSkip skip, int yStart, int yEnd) const {
+
+    int rowLength = nChannels * xPixelCount;
+    const float *inRows = in + yStart * rowLength;
+    float *tmpRows = tmp + yStart * rowLength;
+    int nRows = yEnd - yStart;
 
     // Horizontal filtering
     float kxPad = 1.f;
-    if (_k.empty())
-        copy(in.begin(), in.end(), tmp.begin());
-    else {
-        int xTaps = _k.size();
-        int xPad = xTaps/2;
-        kxPad = _k[xPad];
-#pragma omp parallel for num_threads(PbrtOptions.nCores)
-        for (int pix = 0; pix < nPix; pix++) {
-            int y = pix / xPixelCount, x = pix - y * xPixelCount;
-            tmp[3*pix+0] = tmp[3*pix+1] = tmp[3*pix+2] = 0.f;
-            // Restrict the window
-            float tmin = max(0, xPad-x), tmax = min(xTaps, xPixelCount+xPad-x);
-            // Do the filtering
-            float sum = 0.f;
-            for (int tap = tmin; tap < tmax; tap++) {
-                int spix = pix+tap-xPad;
-                tmp[3*pix+0] += _k[tap] * in[3*spix+0];
-                tmp[3*pix+1] += _k[tap] * in[3*spix+1];
-                tmp[3*pix+2] += _k[tap] * in[3*spix+2];
-                sum += _k[tap];
-            }
-            tmp[3*pix+0] *= _kNorm/sum;
-            tmp[3*pix+1] *= _kNorm/sum;
-            tmp[3*pix+2] *= _kNorm/sum;
-
-            // decrease contribution of center pixel to, at most, th%, and reweight the rest
-            if (_k2.empty() && skip == KERNEL_SKIP_CENTER) {
-                float th = 0.01f; // small residual contribution to tip the balance if needed
-                float cwt = kxPad, diff = max(0.f, cwt-th);
-                float scale = _kNorm / (_kNorm - diff);
-                tmp[3*pix+0] = (tmp[3*pix+0]-diff*in[3*pix+0]) * scale;
-                tmp[3*pix+1] = (tmp[3*pix+1]-diff*in[3*pix+1]) * scale;
-                tmp[3*pix+2] = (tmp[3*pix+2]-diff*in[3*pix+2]) * scale;
-            }
+    if (_k.empty()) {
+        memcpy(tmpRows, inRows, nRows * rowLength * sizeof(float));
+        return;
+    }
+    int xTaps = _k.size();
+    int xPad = xTaps/2;
+    kxPad = _k[xPad];
+
+    // Each tap adds a shifted copy of the row, restricted to the pixels
+    // whose window holds the tap. The window is renormalized at the edges.
+    vector<float> xScale(xPixelCount);
+    for (int x = 0; x < xPixelCount; x++) {
+        int tmin = max(0, xPad-x), tmax = min(xTaps, xPixelCount+xPad-x);
+        float sum = 0.f;
+        for (int tap = tmin; tap < tmax; tap++)
+            sum += _k[tap];
+        xScale[x] = _kNorm/sum;
+    }
+    for (int y = 0; y < nRows; y++) {
+        const float *src = inRows + y * rowLength;
+        float *dst = tmpRows + y * rowLength;
+        memset(dst, 0, rowLength * sizeof(float));
+        for (int tap = 0; tap < xTaps; tap++) {
+            int shift = tap - xPad;
+            int x0 = max(0, -shift), x1 = min(xPixelCount, xPixelCount - shift);
+            if (x0 < x1)
+                AxpyRow(nChannels * (x1 - x0), _k[tap],
+                    src + nChannels * (x0 + shift), dst + nChannels * x0);
+        }
+        for (int x = 0; x < xPad && x < xPixelCount; x++)
+            ScaleRow(nChannels, xScale[x], dst + nChannels * x);
+        for (int x = max(xPad, xPixelCount - xPad); x < xPixelCount; x++)
+            ScaleRow(nChannels, xScale[x], dst + nChannels * x);
+
+        // decrease contribution of center pixel to, at most, th%, and reweight the rest
+        if (_k2.empty() && skip == KERNEL_SKIP_CENTER) {
+            float th = 0.01f; // small residual contribution to tip the balance if needed
+            float cwt = kxPad, diff = max(0.f, cwt-th);
+            float scale = _kNorm / (_kNorm - diff);
+            for (int i = 0; i < rowLength; i++)
+                dst[i] = (dst[i]-diff*src[i]) * scale;
         }
     }
+}
 
-    // Vertical filtering
-    if (_k2.empty())
-        copy(tmp.begin(), tmp.end(), out.begin());
-    else {
-        int yTaps = _k2.size();
-        int yPad = yTaps/2;
-#pragma omp parallel for num_threads(PbrtOptions.nCores)
-        for (int pix = 0; pix < nPix; pix++) {
-            int y = pix / xPixelCount;
-            out[3*pix+0] = out[3*pix+1] = out[3*pix+2] = 0.f;
-            // Restrict the window
-            float tmin = max(0, yPad-y), tmax = min(yTaps, yPixelCount+yPad-y);
-            // Do the filtering
-            float sum = 0.f;
-            for (int tap = tmin; tap < tmax; tap++) {
-                int spix = pix + (tap-yPad) * xPixelCount;
-                out[3*pix+0] += _k2[tap] * tmp[3*spix+0];
-                out[3*pix+1] += _k2[tap] * tmp[3*spix+1];
-                out[3*pix+2] += _k2[tap] * tmp[3*spix+2];
-                sum += _k2[tap];
-            }
-            out[3*pix+0] *= _k2Norm/sum;
-            out[3*pix+1] *= _k2Norm/sum;
-            out[3*pix+2] *= _k2Norm/sum;
 
-            // decrease contribution of center pixel to, at most, th%, and reweight the rest
-            if (skip == KERNEL_SKIP_CENTER) {
-                float norm = _kNorm * _k2Norm;
-                float th = 0.01f; // small residual contribution to tip the balance if needed
-                float cwt = kxPad * _k2[yPad], diff = max(0.f, cwt-th);
-                float scale = norm / (norm - diff);
-                out[3*pix+0] = (out[3*pix+0]-diff*in[3*pix+0]) * scale;
-                out[3*pix+1] = (out[3*pix+1]-diff*in[3*pix+1]) * scale;
-                out[3*pix+2] = (out[3*pix+2]-diff*in[3*pix+2]) * scale;
+void Kernel2D::ApplySepRowsV(int nChannels, int xPixelCount, int yPixelCount,
+    const float *in, const float *tmp, float *out, KernelSkip skip,
+    int yStart, int yEnd) const {
 
-            }
+    int rowLength = nChannels * xPixelCount;
+
+    // Vertical filtering
+    if (_k2.empty()) {
+        memcpy(out + yStart * rowLength, tmp + yStart * rowLength,
+            (yEnd - yStart) * rowLength * sizeof(float));
+        return;
+    }
+    int yTaps = _k2.size();
+    int yPad = yTaps/2;
+    float kxPad = _k.empty() ? 1.f : _k[_k.size()/2];
+    for (int y = yStart; y < yEnd; y++) {
+        float *dst = out + y * rowLength;
+        memset(dst, 0, rowLength * sizeof(float));
+        // Restrict the window
+        int tmin = max(0, yPad-y), tmax = min(yTaps, yPixelCount+yPad-y);
+        // Do the filtering
+        float sum = 0.f;
+        for (int tap = tmin; tap < tmax; tap++) {
+            AxpyRow(rowLength, _k2[tap], tmp + (y + tap - yPad) * rowLength, dst);
+            sum += _k2[tap];
+        }
+        ScaleRow(rowLength, _k2Norm/sum, dst);
+
+        // decrease contribution of center pixel to, at most, th%, and reweight the rest
+        if (skip == KERNEL_SKIP_CENTER) {
+            float norm = _kNorm * _k2Norm;
+            float th = 0.01f; // small residual contribution to tip the balance if needed
+            float cwt = kxPad * _k2[yPad], diff = max(0.f, cwt-th);
+            float scale = norm / (norm - diff);
+            const float *src = in + y * rowLength;
+            for (int i = 0; i < rowLength; i++)
+                dst[i] = (dst[i]-diff*src[i]) * scale;
         }
     }
 }
@@ -34,7 +34,34 @@ enum KernelSkip {
 };
 
 
+// Normalization of the box sums below
+enum BoxNorm {
+    BOX_NORM_NONE,      // plain sums
+    BOX_NORM_FULL,      // divided by the full box width 2*r+1
+    BOX_NORM_CLIPPED    // divided by the number of values summed, which is
+                        // lower at the image edges
+};
+
+
+// Running box sums of radius 'r' along 'nRows' rows of 'width' pixels with
+// 'nChannels' interleaved channels, clipped to the row. Only the pixels
+// [x0, x1) of 'dst' are written. The sums run in double precision, so the
+// result doesn't depend on where they start.
+void BoxSumRows(const float *src, float *dst, int width, int nChannels,
+    int nRows, int r, int x0, int x1, BoxNorm norm);
+
+// Running box sums of radius 'r' across the rows of an image 'height' rows
+// high, with 'rowLength' floats per row, clipped to the image. 'src' holds
+// the rows from 'srcY0' on, and the output rows [y0, y1) are written from
+// 'dst' on; only the floats [x0, x1) of each row are processed. 'colSum' is
+// scratch space for 'rowLength' doubles.
+void BoxSumColumns(const float *src, int srcY0, float *dst, int y0, int y1,
+    int rowLength, int height, int r, int x0, int x1, BoxNorm norm,
+    double *colSum);
+
+
 class Kernel2D {
+    friend class Kernel2DTask;
 public:
     // Methods
     Kernel2D() {}
@@ -44,12 +71,8 @@ public:
         vector<float> &tmp, vector<float> &out,
         KernelSkip skip = KERNEL_SKIP_NONE) const {
         int nPix = xPixelCount * yPixelCount, nChannels = out.size() / nPix;
-        if (_isSeparable) {
-            if (nChannels == 1)
-                ApplySep1C(xPixelCount, yPixelCount, in, tmp, out, skip);
-            else
-                ApplySep3C(xPixelCount, yPixelCount, in, tmp, out, skip);
-        }
+        if (_isSeparable)
+            ApplySep(nChannels, xPixelCount, yPixelCount, in, tmp, out, skip);
         else {
             if (nChannels == 1)
                 ApplyNonSep1C(xPixelCount, yPixelCount, in, tmp, out, skip);
@@ -106,9 +129,11 @@ protected:
     bool _isSeparable;
 
     // Methods
-    // Pixel resolution
-    void ApplySep1C(int xPixelCount, int yPixelCount, const vector<float>& in, vector<float>& tmp, vector<float>& out, KernelSkip skip) const;
-    void ApplySep3C(int xPixelCount, int yPixelCount, const vector<float>& in, vector<float>& tmp, vector<float>& out, KernelSkip skip) const;
+    // Pixel resolution. The separable kernels run in row bands on the task
+    // system, one pass per direction.
+    void ApplySep(int nChannels, int xPixelCount, int yPixelCount, const vector<float>& in, vector<float>& tmp, vector<float>& out, KernelSkip skip) const;
+    void ApplySepRowsH(int nChannels, int xPixelCount, int yPixelCount, const float *in, float *tmp, KernelSkip skip, int yStart, int yEnd) const;
+    void ApplySepRowsV(int nChannels, int xPixelCount, int yPixelCount, const float *in, const float *tmp, float *out, KernelSkip skip, int yStart, int yEnd) const;
     void ApplyNonSep1C(int xPixelCount, int yPixelCount, const vector<float>& in, vector<float>& tmp, vector<float>& out, KernelSkip skip) const;
     void ApplyNonSep3C(int xPixelCount, int yPixelCount, const vector<float>& in, vector<float>& tmp, vector<float>& out, KernelSkip skip) const;
     // Subpixel resolution with implicit downsampling
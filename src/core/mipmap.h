@@ -40,6 +40,7 @@
 #include "pbrt.h"
 #include "spectrum.h"
 #include "texture.h"
+#include "parallel.h"
 
 // MIPMap Declarations
 typedef enum {
@@ -85,9 +86,9 @@ private:
         }
         return wt;
     }
-    float clamp(float v) { return Clamp(v, 0.f, INFINITY); }
-    RGBSpectrum clamp(const RGBSpectrum &v) { return v.Clamp(0.f, INFINITY); }
-    SampledSpectrum clamp(const SampledSpectrum &v) { return v.Clamp(0.f, INFINITY); }
+    float clamp(float v) const { return Clamp(v, 0.f, INFINITY); }
+    RGBSpectrum clamp(const RGBSpectrum &v) const { return v.Clamp(0.f, INFINITY); }
+    SampledSpectrum clamp(const SampledSpectrum &v) const { return v.Clamp(0.f, INFINITY); }
     T triangle(uint32_t level, float s, float t) const;
     T EWA(uint32_t level, float s, float t, float ds0, float dt0, float ds1, float dt1) const;
 
@@ -99,6 +100,9 @@ private:
         int firstTexel;
         float weight[4];
     };
+    // Row loops of the constructor
+    struct ResampleRow;
+    struct FilterRow;
     BlockedArray<T> **pyramid;
     uint32_t width, height, nLevels;
 #define WEIGHT_LUT_SIZE 128
@@ -108,6 +112,57 @@ private:
 
 
 // MIPMap Method Definitions
+template <typename T>
+struct MIPMap<T>::ResampleRow {
+    // Resamples row _t_ of _dst_ from _src_, along $s$ if _sDir_ or $t$
+    // otherwise. _src_ is _srcRes_ texels wide in that direction, and the
+    // rows of both images are _sres_ texels long.
+    ResampleRow(const MIPMap *m, const ResampleWeight *w, bool dir,
+                const T *in, T *out, uint32_t inRes, uint32_t rowRes)
+        : mip(m), weights(w), sDir(dir), src(in), dst(out), srcRes(inRes),
+          sres(rowRes) { }
+    void operator()(int t) const {
+        for (uint32_t s = 0; s < sres; ++s) {
+            const ResampleWeight &wt = weights[sDir ? s : t];
+            T texel = 0.;
+            for (int j = 0; j < 4; ++j) {
+                int orig = wt.firstTexel + j;
+                if (mip->wrapMode == TEXTURE_REPEAT)
+                    orig = Mod(orig, srcRes);
+                else if (mip->wrapMode == TEXTURE_CLAMP)
+                    orig = Clamp(orig, 0, srcRes-1);
+                if (orig >= 0 && orig < (int)srcRes)
+                    texel += wt.weight[j] *
+                        (sDir ? src[t*srcRes + orig] : src[orig*sres + s]);
+            }
+            dst[t*sres + s] = sDir ? texel : mip->clamp(texel);
+        }
+    }
+    const MIPMap *mip;
+    const ResampleWeight *weights;
+    bool sDir;
+    const T *src;
+    T *dst;
+    uint32_t srcRes, sres;
+};
+
+
+template <typename T>
+struct MIPMap<T>::FilterRow {
+    // Filters row _t_ of level _i_ from four texels of the finer level
+    FilterRow(const MIPMap *m, uint32_t l) : mip(m), i(l) { }
+    void operator()(int t) const {
+        BlockedArray<T> &level = *mip->pyramid[i];
+        for (uint32_t s = 0; s < level.uSize(); ++s)
+            level(s, t) = .25f *
+               (mip->Texel(i-1, 2*s, 2*t)   + mip->Texel(i-1, 2*s+1, 2*t) +
+                mip->Texel(i-1, 2*s, 2*t+1) + mip->Texel(i-1, 2*s+1, 2*t+1));
+    }
+    const MIPMap *mip;
+    uint32_t i;
+};
+
+
 template <typename T>
 MIPMap<T>::MIPMap(uint32_t sres, uint32_t tres, const T *img, bool doTri,
                   float maxAniso, ImageWrap wm) {
@@ -124,43 +179,16 @@ MIPMap<T>::MIPMap(uint32_t sres, uint32_t tres, const T *img, bool doTri,
         resampledImage = new T[sPow2 * tPow2];
 
         // Apply _sWeights_ to zoom in $s$ direction
-        for (uint32_t t = 0; t < tres; ++t) {
-            for (uint32_t s = 0; s < sPow2; ++s) {
-                // Compute texel $(s,t)$ in $s$-zoomed image
-                resampledImage[t*sPow2+s] = 0.;
-                for (int j = 0; j < 4; ++j) {
-                    int origS = sWeights[s].firstTexel + j;
-                    if (wrapMode == TEXTURE_REPEAT)
-                        origS = Mod(origS, sres);
-                    else if (wrapMode == TEXTURE_CLAMP)
-                        origS = Clamp(origS, 0, sres-1);
-                    if (origS >= 0 && origS < (int)sres)
-                        resampledImage[t*sPow2+s] += sWeights[s].weight[j] *
-                                                     img[t*sres + origS];
-                }
-            }
-        }
+        T *zoomedS = new T[sPow2 * tres];
+        ParallelFor(tres, ResampleRow(this, sWeights, true, img, zoomedS,
+                                      sres, sPow2), 16);
         delete[] sWeights;
 
         // Resample image in $t$ direction
         ResampleWeight *tWeights = resampleWeights(tres, tPow2);
-        T *workData = new T[tPow2];
-        for (uint32_t s = 0; s < sPow2; ++s) {
-            for (uint32_t t = 0; t < tPow2; ++t) {
-                workData[t] = 0.;
-                for (uint32_t j = 0; j < 4; ++j) {
-                    int offset = tWeights[t].firstTexel + j;
-                    if (wrapMode == TEXTURE_REPEAT) offset = Mod(offset, tres);
-                    else if (wrapMode == TEXTURE_CLAMP) offset = Clamp(offset, 0, tres-1);
-                    if (offset >= 0 && offset < (int)tres)
-                        workData[t] += tWeights[t].weight[j] *
-                            resampledImage[offset*sPow2 + s];
-                }
-            }
-            for (uint32_t t = 0; t < tPow2; ++t)
-                resampledImage[t*sPow2 + s] = clamp(workData[t]);
-        }
-        delete[] workData;
+        ParallelFor(tPow2, ResampleRow(this, tWeights, false, zoomedS,
+                                       resampledImage, tres, sPow2), 16);
+        delete[] zoomedS;
         delete[] tWeights;
         img = resampledImage;
         sres = sPow2;
@@ -181,11 +209,7 @@ MIPMap<T>::MIPMap(uint32_t sres, uint32_t tres, const T *img, bool doTri,
         pyramid[i] = new BlockedArray<T>(sRes, tRes);
 
         // Filter four texels from finer level of pyramid
-        for (uint32_t t = 0; t < tRes; ++t)
-            for (uint32_t s = 0; s < sRes; ++s)
-                (*pyramid[i])(s, t) = .25f *
-                   (Texel(i-1, 2*s, 2*t)   + Texel(i-1, 2*s+1, 2*t) +
-                    Texel(i-1, 2*s, 2*t+1) + Texel(i-1, 2*s+1, 2*t+1));
+        ParallelFor(tRes, FilterRow(this, i), 16);
     }
     if (resampledImage) delete[] resampledImage;
     // Initialize EWA filter weights if needed
@@ -0,0 +1,333 @@
+/*
+ * File:   nlmkernel.cpp
+ *
+ * CPU backend of the NlmeansKernel interface. It follows the kernel sequence
+ * of core/nlmkernel.cu, but runs every offset of the search window over a
+ * band of rows inside a single Task, so that the intermediate images stay in
+ * the cache. The loops run along contiguous rows so that the compiler can
+ * vectorize them, and the box filters are the running sums of kernel2d.h.
+ */
+
+#include "stdafx.h"
+
+#ifndef PBRT_HAS_CUDA_NLM
+
+#include "nlmkernel.h"
+#include "kernel2d.h"
+#include "parallel.h"
+
+// Same rounding of small weights as the CUDA backend
+static const float WGT_THRESHOLD = 0.05f;
+
+// One symmetric NL-means filtering: the weights are computed on 'guide' and
+// used to filter up to two images.
+struct NlmeansPass {
+    int width, height;
+    int wndRad, ptcRad;
+    const float *guide, *guideVar;
+    int nGuideChannels;
+    float vScale, k2;
+    int nSources;
+    const float *src[2];
+    int nSrcChannels[2];
+    float *out[2];
+};
+
+
+static inline int ClampMirror(int pos, int posMax) {
+    int p = (pos < 0) ? -pos : (pos >= posMax) ? 2*posMax - pos - 2 : pos;
+    // Only matters for images smaller than the search window
+    return Clamp(p, 0, posMax - 1);
+}
+
+
+// Symmetric distances of rows [y0, y1) to their neighbors at +(dx,dy) and
+// -(dx,dy), see distance() in nlmkernel.cu
+static void Distance(const NlmeansPass &pass, int dx, int dy, int y0, int y1,
+        const int *xN1, const int *xN2, float *tgt1, float *tgt2, float *tgtS) {
+    int width = pass.width, nc = pass.nGuideChannels;
+    const float *src = pass.guide, *var = pass.guideVar;
+    float scale = pass.vScale, k2 = pass.k2;
+    for (int y = y0; y < y1; ++y) {
+        int rowN1 = ClampMirror(y + dy, pass.height) * width;
+        int rowN2 = ClampMirror(y - dy, pass.height) * width;
+        float *t1 = tgt1 + (y - y0) * width;
+        float *t2 = tgt2 + (y - y0) * width;
+        float *tS = tgtS + (y - y0) * width;
+        for (int x = 0; x < width; ++x) {
+            int indexC = y * width + x;
+            int indexN1 = rowN1 + xN1[x], indexN2 = rowN2 + xN2[x];
+            float s1 = 0.f, s2 = 0.f, sS = 0.f;
+            for (int c = 0; c < nc; ++c) {
+                int idxC = nc * indexC + c;
+                int idxN1 = nc * indexN1 + c;
+                int idxN2 = nc * indexN2 + c;
+                float varN1 = min(var[idxC], var[idxN1]);
+                float varN2 = min(var[idxC], var[idxN2]);
+                float d = src[idxC] - src[idxN1];
+                s1 += (d * d - scale * (var[idxC] + varN1)) /
+                      (1e-10f + k2 * (var[idxC] + var[idxN1]));
+                d = src[idxC] - src[idxN2];
+                s2 += (d * d - scale * (var[idxC] + varN2)) /
+                      (1e-10f + k2 * (var[idxC] + var[idxN2]));
+                d = src[idxC] - (src[idxN1] + src[idxN2]) / 2.f;
+                sS += (d * d - scale * (var[idxC] + (varN1 + varN2) / 4.f)) /
+                      (1e-10f + k2 * (var[idxC] + (var[idxN1] + var[idxN2]) / 4.f));
+            }
+            t1[x] = s1 / nc;
+            t2[x] = s2 / nc;
+            tS[x] = sS / nc;
+        }
+    }
+}
+
+
+// Horizontal box filter of 'nRows' rows, normalized by the full box width
+// like conv_box_h()
+static inline void BoxH(const float *src, float *dst, int width, int nRows, int r) {
+    BoxSumRows(src, dst, width, 1, nRows, r, 0, width, BOX_NORM_FULL);
+}
+
+
+// Vertical box filter producing rows [ty0, ty1) from 'src', which holds the
+// rows starting at 'sy0', normalized by the clipped box height like
+// conv_box_v()
+static inline void BoxV(const float *src, int sy0, float *dst, int ty0, int ty1,
+        int width, int height, int r, double *colSum) {
+    BoxSumColumns(src, sy0, dst, ty0, ty1, width, height, r, 0, width,
+        BOX_NORM_CLIPPED, colSum);
+}
+
+
+static void FilterRows(const NlmeansPass &pass, int yStart, int yEnd) {
+    int width = pass.width, height = pass.height, r = pass.ptcRad;
+
+    // The weights are box filtered, and so are the distances they are
+    // computed from, hence two patch radii of apron on each side
+    int wy0 = max(0, yStart - r), wy1 = min(height, yEnd + r);
+    int dy0 = max(0, wy0 - r), dy1 = min(height, wy1 + r);
+    int nD = (dy1 - dy0) * width, nW = (wy1 - wy0) * width;
+    int nB = (yEnd - yStart) * width;
+
+    vector<float> d2avg1(nD), d2avg2(nD), d2avgS(nD), tmp(nD);
+    vector<float> bd1(nW), bd2(nW), bdS(nW), wgt1(nW), wgt2(nW);
+    vector<float> bw1(nB), bw2(nB), area(nB, 0.f);
+    vector<float> acc[2];
+    for (int s = 0; s < pass.nSources; ++s)
+        acc[s].assign(nB * pass.nSrcChannels[s], 0.f);
+    vector<int> xN1(width), xN2(width);
+    vector<double> colSum(width);
+
+    for (int dy = -pass.wndRad; dy <= 0; ++dy) {
+        int dx_max = (dy == 0) ? -1 : +pass.wndRad;
+        for (int dx = -pass.wndRad; dx <= dx_max; ++dx) {
+            for (int x = 0; x < width; ++x) {
+                xN1[x] = ClampMirror(x + dx, width);
+                xN2[x] = ClampMirror(x - dx, width);
+            }
+
+            // The relative inter-pixel mean squared distance
+            Distance(pass, dx, dy, dy0, dy1, &xN1[0], &xN2[0],
+                     &d2avg1[0], &d2avg2[0], &d2avgS[0]);
+            BoxH(&d2avg1[0], &tmp[0], width, dy1 - dy0, r);
+            BoxV(&tmp[0], dy0, &bd1[0], wy0, wy1, width, height, r, &colSum[0]);
+            BoxH(&d2avg2[0], &tmp[0], width, dy1 - dy0, r);
+            BoxV(&tmp[0], dy0, &bd2[0], wy0, wy1, width, height, r, &colSum[0]);
+            BoxH(&d2avgS[0], &tmp[0], width, dy1 - dy0, r);
+            BoxV(&tmp[0], dy0, &bdS[0], wy0, wy1, width, height, r, &colSum[0]);
+
+            // Compute the weights, blending towards the symmetric weight
+            // where it is larger than the sum of the one-sided ones
+            for (int i = 0; i < nW; ++i) {
+                float w1 = expf(-max(0.f, bd1[i]));
+                float w2 = expf(-max(0.f, bd2[i]));
+                float wS = expf(-max(0.f, bdS[i]));
+                float wA = w1 + w2;
+                float t = min(1.f, max(0.f, wS / wA - 1));
+                wgt1[i] = t * wS + (1 - t) * w1;
+                wgt2[i] = t * wS + (1 - t) * w2;
+            }
+            BoxH(&wgt1[0], &tmp[0], width, wy1 - wy0, r);
+            BoxV(&tmp[0], wy0, &bw1[0], yStart, yEnd, width, height, r, &colSum[0]);
+            BoxH(&wgt2[0], &tmp[0], width, wy1 - wy0, r);
+            BoxV(&tmp[0], wy0, &bw2[0], yStart, yEnd, width, height, r, &colSum[0]);
+
+            // Ensure we only have reliable weights
+            for (int i = 0; i < nB; ++i) {
+                if (bw1[i] < WGT_THRESHOLD) bw1[i] = 0.f;
+                if (bw2[i] < WGT_THRESHOLD) bw2[i] = 0.f;
+                area[i] += bw1[i];
+                area[i] += bw2[i];
+            }
+
+            // Accumulate the weighted neighbors
+            for (int s = 0; s < pass.nSources; ++s) {
+                int nc = pass.nSrcChannels[s];
+                const float *src = pass.src[s];
+                for (int y = yStart; y < yEnd; ++y) {
+                    int rowN1 = ClampMirror(y + dy, height) * width;
+                    int rowN2 = ClampMirror(y - dy, height) * width;
+                    int rowB = (y - yStart) * width;
+                    for (int x = 0; x < width; ++x) {
+                        int idxN1 = nc * (rowN1 + xN1[x]);
+                        int idxN2 = nc * (rowN2 + xN2[x]);
+                        float *a = &acc[s][nc * (rowB + x)];
+                        for (int c = 0; c < nc; ++c) {
+                            a[c] += bw1[rowB + x] * src[idxN1 + c];
+                            a[c] += bw2[rowB + x] * src[idxN2 + c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Add the contribution of the center pixel, whose weight is one, and
+    // normalize
+    for (int s = 0; s < pass.nSources; ++s) {
+        int nc = pass.nSrcChannels[s];
+        const float *src = pass.src[s] + nc * yStart * width;
+        float *out = pass.out[s] + nc * yStart * width;
+        for (int i = 0; i < nB; ++i)
+            for (int c = 0; c < nc; ++c)
+                out[nc*i+c] = (acc[s][nc*i+c] + src[nc*i+c]) / (area[i] + 1.f);
+    }
+}
+
+
+// NlmeansKernelTask Declarations
+class NlmeansKernelTask : public Task {
+public:
+    NlmeansKernelTask(const NlmeansPass *p, int y0, int y1)
+        : pass(p), yStart(y0), yEnd(y1) { }
+    void Run() {
+        FilterRows(*pass, yStart, yEnd);
+    }
+private:
+    const NlmeansPass *pass;
+    int yStart, yEnd;
+};
+
+
+static void RunPass(const NlmeansPass &pass) {
+    // Each band recomputes two patch radii of apron on both sides, so keep
+    // the bands well above that height
+    int minRows = max(16, 8 * pass.ptcRad);
+    int nBands = max(1, min(4 * NumSystemCores(), pass.height / minRows));
+    int bandRows = (pass.height + nBands - 1) / nBands;
+
+    vector<Task *> tasks;
+    for (int y = 0; y < pass.height; y += bandRows)
+        tasks.push_back(new NlmeansKernelTask(&pass, y, min(y + bandRows, pass.height)));
+    EnqueueTasks(tasks);
+    WaitForAllTasks();
+    for (uint32_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+}
+
+
+void NlmeansKernel::Init(int wnd_rad, int ptc_rad, float k, int xPixelCount, int yPixelCount) {
+    // Params
+    _wnd_rad = wnd_rad;
+    _ptc_rad = ptc_rad;
+    _k = k;
+
+    // Image dims
+    _xPixelCount = xPixelCount;
+    _yPixelCount = yPixelCount;
+
+    int nPix = _xPixelCount * _yPixelCount;
+    _avgOut.resize(3 * nPix);
+    _sppOut.resize(1 * nPix);
+}
+
+
+void NlmeansKernel::Apply(NlmeansData dataType,
+    const ImageBuffer &spp,
+    const ImageBuffer &avg1, const ImageBuffer &var1, ImageBuffer &avgVar1,
+    const ImageBuffer &avg2, const ImageBuffer &var2, ImageBuffer &avgVar2,
+    ImageBuffer &avgOut1, ImageBuffer &sppOut1,
+    ImageBuffer &avgOut2, ImageBuffer &sppOut2)
+{
+    int nPix = _xPixelCount * _yPixelCount;
+    ImageBuffer avgVar(3 * nPix);
+
+#ifdef LD_SAMPLING
+    // Compute the variance of the variance and the buffer variance
+    ImageBuffer varVar(3 * nPix);
+    for (int i = 0; i < 3 * nPix; ++i) {
+        varVar[i] = sqr(var1[i] - var2[i]) / 2.f;
+        avgVar[i] = sqr(avg1[i] - avg2[i]) / 2.f;
+    }
+
+    // Get the filtered buffer mean variance
+    ApplyIntVar(3, &avgVar[0], &var1[0], &varVar[0], 1, 4.f);
+    for (int i = 0; i < 3 * nPix; ++i)
+        avgVar[i] = min(_avgOut[i], max(avgVar1[i], avgVar2[i]));
+#else
+    // The filtered buffer variance is overwritten by the sample variance
+    // before it is used, don't compute it
+    avgVar = avgVar2;
+#endif
+
+    // Filter first buffer
+    ApplyInt(&avg1[0], &spp[0], &avg2[0], &avgVar[0],
+        dataType, _wnd_rad, _k, 1.f);
+    avgOut1 = _avgOut;
+    sppOut1 = _sppOut;
+
+    // Filter second buffer
+#ifndef LD_SAMPLING
+    avgVar = avgVar1;
+#endif
+    ApplyInt(&avg2[0], &spp[0], &avg1[0], &avgVar[0],
+        dataType, _wnd_rad, _k, 1.f);
+    avgOut2 = _avgOut;
+    sppOut2 = _sppOut;
+}
+
+
+void NlmeansKernel::ApplyIntVar(int nChannels, const float *avg1,
+    const float *avg2, const float *avgVar2, int rad, float vScale) {
+    NlmeansPass pass;
+    pass.width = _xPixelCount;
+    pass.height = _yPixelCount;
+    pass.wndRad = rad;
+    pass.ptcRad = _ptc_rad;
+    pass.guide = avg2;
+    pass.guideVar = avgVar2;
+    pass.nGuideChannels = nChannels;
+    pass.vScale = vScale;
+    pass.k2 = sqr(_k);
+    pass.nSources = 1;
+    pass.src[0] = avg1;
+    pass.nSrcChannels[0] = nChannels;
+    pass.out[0] = &_avgOut[0];
+    RunPass(pass);
+}
+
+
+void NlmeansKernel::ApplyInt(const float *avg1, const float *spp,
+    const float *avg2, const float *avgVar,
+    NlmeansData dataType, int wnd_rad, float gamma, float vScale) {
+    NlmeansPass pass;
+    pass.width = _xPixelCount;
+    pass.height = _yPixelCount;
+    pass.wndRad = (dataType == NLM_DATA_FINAL) ? wnd_rad : 7;
+    pass.ptcRad = _ptc_rad;
+    pass.guide = avg2;
+    pass.guideVar = avgVar;
+    pass.nGuideChannels = 3;
+    pass.vScale = vScale * ((dataType == NLM_DATA_FINAL) ? 1.f : .5f);
+    pass.k2 = sqr(gamma);
+    pass.nSources = 2;
+    pass.src[0] = spp;
+    pass.nSrcChannels[0] = 1;
+    pass.out[0] = &_sppOut[0];
+    pass.src[1] = avg1;
+    pass.nSrcChannels[1] = 3;
+    pass.out[1] = &_avgOut[0];
+    RunPass(pass);
+}
+
+#endif // PBRT_HAS_CUDA_NLM
@@ -0,0 +1,62 @@
+/*
+ * File:   nlmkernel.h
+ * Author: rousselle
+ *
+ * Created on March 19, 2012, 2:46 PM
+ */
+
+#ifndef NLMKERNEL_H
+#define	NLMKERNEL_H
+
+#include "pbrt.h"
+
+// Images exchanged with the kernel are flat float arrays with interleaved
+// channels: three channels for colors and variances, one for sample counts.
+typedef vector<float> ImageBuffer;
+
+// Intermediate filtering (used to drive the sampling) uses a smaller search
+// window and a lower variance cancellation than the final filtering.
+enum NlmeansData {
+    NLM_DATA_FINAL,
+    NLM_DATA_INTER
+};
+
+inline
+float sqr(float v) { return v*v; }
+
+// Symmetric NL-means kernel, cross-filtering two half buffers. There are two
+// backends implementing this interface: core/nlmkernel.cu (CUDA) and
+// core/nlmkernel.cpp (multithreaded CPU, the default). Define
+// PBRT_HAS_CUDA_NLM when building the CUDA backend instead.
+class NlmeansKernel {
+public:
+    NlmeansKernel() { _wnd_rad = _ptc_rad = 0; _k = 0.f; _xPixelCount = _yPixelCount = 0; }
+
+    void Init(int wnd_rad, int ptc_rad, float k, int xPixelCount, int yPixelCount);
+
+    void Apply(NlmeansData dataType,
+        const ImageBuffer &spp,
+        const ImageBuffer &avg1, const ImageBuffer &var1, ImageBuffer &avgVar1,
+        const ImageBuffer &avg2, const ImageBuffer &var2, ImageBuffer &avgVar2,
+        ImageBuffer &avgOut1, ImageBuffer &sppOut1,
+        ImageBuffer &avgOut2, ImageBuffer &sppOut2);
+
+private:
+    // Filter 'avg1' (nChannels) with weights computed on 'avg2'
+    void ApplyIntVar(int nChannels, const float *avg1, const float *avg2,
+        const float *avgVar2, int rad, float vScale);
+    // Filter 'avg1' and 'spp' with weights computed on 'avg2'
+    void ApplyInt(const float *avg1, const float *spp, const float *avg2,
+        const float *avgVar, NlmeansData dataType, int wnd_rad, float gamma,
+        float vScale);
+
+    int _wnd_rad, _ptc_rad;
+    float _k;
+    int _xPixelCount, _yPixelCount;
+
+    // Outputs of ApplyInt/ApplyIntVar for the CPU backend, the CUDA backend
+    // keeps them on the device
+    ImageBuffer _avgOut, _sppOut;
+};
+
+#endif	/* NLMKERNEL_H */
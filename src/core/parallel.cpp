@@ -34,6 +34,7 @@
 #include "stdafx.h"
 #include "parallel.h"
 #include "memory.h"
+#include "timer.h"
 #ifdef PBRT_USE_GRAND_CENTRAL_DISPATCH
 #include <dispatch/dispatch.h>
 #endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
@@ -58,12 +59,50 @@ static pthread_t *threads;
 static dispatch_queue_t gcdQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
 static dispatch_group_t gcdGroup = dispatch_group_create();
 #else
-static Mutex *taskQueueMutex = Mutex::Create();
-static std::vector<Task *> taskQueue;
+// Each worker thread owns a deque of tasks. It runs the newest task of its
+// own deque first, and once that is empty it steals the oldest task of
+// another worker's deque. The deque locks are only contended by thieves and
+// by EnqueueTasks(), there is no lock shared by all the workers.
+struct WorkerQueue {
+    WorkerQueue() {
+        mutex = Mutex::Create();
+        head = 0;
+        size = 0;
+        nRun = nStolen = 0;
+        stealSeed = 0;
+    }
+    ~WorkerQueue() { Mutex::Destroy(mutex); }
+    Mutex *mutex;
+    // Queued tasks are tasks[head, tasks.size()), 'size' is their count,
+    // also read without the lock to skip empty deques
+    vector<Task *> tasks;
+    uint32_t head;
+    AtomicInt32 size;
+
+    // Only used by the owner thread
+    uint32_t nRun, nStolen;
+    uint32_t stealSeed;
+    Timer busyTimer;
+    // Keep the queues of different workers on different cache lines
+    char pad[PBRT_L1_CACHE_LINE_SIZE];
+};
+
+
+static WorkerQueue *workerQueues;
+static int nWorkers;
+// Thread-local worker index plus one, so that other threads read 0
+#if defined(PBRT_IS_WINDOWS)
+static DWORD workerIndexKey = TLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t workerIndexKey;
+static bool workerIndexKeyCreated = false;
+#endif
+static volatile bool tasksShutdown;
+static Timer *tasksTimer;
 #endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
 #ifndef PBRT_USE_GRAND_CENTRAL_DISPATCH
 static Semaphore *workerSemaphore;
-static uint32_t numUnfinishedTasks;
+static AtomicInt32 numUnfinishedTasks;
 static ConditionVariable *tasksRunningCondition;
 #endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
 #ifndef PBRT_USE_GRAND_CENTRAL_DISPATCH
@@ -725,9 +764,29 @@ void TasksInit() {
 #ifdef PBRT_USE_GRAND_CENTRAL_DISPATCH
     return;
 #else // PBRT_USE_GRAND_CENTRAL_DISPATCH
-    static const int nThreads = NumSystemCores();
-    workerSemaphore = new Semaphore;
-    tasksRunningCondition = new ConditionVariable;
+    int nThreads = nWorkers = NumSystemCores();
+    workerQueues = new WorkerQueue[nThreads];
+    for (int i = 0; i < nThreads; ++i)
+        workerQueues[i].stealSeed = 2654435761u * (i + 1);
+    tasksShutdown = false;
+#if !defined(PBRT_IS_WINDOWS)
+    if (!workerIndexKeyCreated) {
+        int err = pthread_key_create(&workerIndexKey, NULL);
+        if (err != 0)
+            Severe("Error from pthread_key_create: %s", strerror(err));
+        workerIndexKeyCreated = true;
+    }
+#else
+    if (workerIndexKey == TLS_OUT_OF_INDEXES &&
+        (workerIndexKey = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+        Severe("Error from TlsAlloc");
+#endif // PBRT_IS_WINDOWS
+    tasksTimer = new Timer;
+    tasksTimer->Start();
+    if (!workerSemaphore) {
+        workerSemaphore = new Semaphore;
+        tasksRunningCondition = new ConditionVariable;
+    }
 #if !defined(PBRT_IS_WINDOWS)
     threads = new pthread_t[nThreads];
     for (int i = 0; i < nThreads; ++i) {
@@ -753,15 +812,15 @@ void TasksCleanup() {
 #ifdef PBRT_USE_GRAND_CENTRAL_DISPATCH
     return;
 #else // // PBRT_USE_GRAND_CENTRAL_DISPATCH
-    if (!taskQueueMutex || !workerSemaphore)
+    if (!workerQueues || !workerSemaphore)
         return;
-    { MutexLock lock(*taskQueueMutex);
-    Assert(taskQueue.size() == 0);
-    }
+    int nThreads = nWorkers;
+    for (int i = 0; i < nThreads; ++i)
+        Assert(workerQueues[i].size == 0);
 
-    static const int nThreads = NumSystemCores();
-    if (workerSemaphore != NULL)
-        workerSemaphore->Post(nThreads);
+    // Workers only exit once they find no task and see the flag
+    tasksShutdown = true;
+    workerSemaphore->Post(nThreads);
 
     if (threads != NULL) {
 #if !defined(PBRT_IS_WINDOWS)
@@ -779,6 +838,19 @@ void TasksCleanup() {
         delete[] threads;
         threads = NULL;
     }
+
+    // Per-worker utilization, over the lifetime of the threads
+    double wallTime = tasksTimer->Time();
+    for (int i = 0; i < nThreads; ++i) {
+        WorkerQueue &queue = workerQueues[i];
+        Info("Task worker %d: %u tasks (%u stolen), busy %.1f%% of %.2fs", i,
+             queue.nRun, queue.nStolen,
+             100. * queue.busyTimer.Time() / max(wallTime, 1e-6), wallTime);
+    }
+    delete[] workerQueues;
+    workerQueues = NULL;
+    delete tasksTimer;
+    tasksTimer = NULL;
 #endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
 }
 
@@ -810,45 +882,107 @@ void EnqueueTasks(const vector<Task *> &tasks) {
     if (!threads)
         TasksInit();
 
-    { MutexLock lock(*taskQueueMutex);
-    for (unsigned int i = 0; i < tasks.size(); ++i)
-        taskQueue.push_back(tasks[i]);
+    if (tasks.size() == 0)
+        return;
+    AtomicAdd(&numUnfinishedTasks, (int32_t)tasks.size());
+
+    // Deal the tasks to the workers, in order, so that the last queued tasks
+    // are still the first ones run
+    for (int w = 0; w < nWorkers; ++w) {
+        WorkerQueue &queue = workerQueues[w];
+        MutexLock lock(*queue.mutex);
+        uint32_t nQueued = 0;
+        for (uint32_t i = w; i < tasks.size(); i += nWorkers, ++nQueued)
+            queue.tasks.push_back(tasks[i]);
+        AtomicAdd(&queue.size, (int32_t)nQueued);
     }
-    tasksRunningCondition->Lock();
-    numUnfinishedTasks += tasks.size();
-    tasksRunningCondition->Unlock();
 
-    workerSemaphore->Post(tasks.size());
+    // Workers that are busy find the new tasks once they are done, only
+    // wake up as many as there are tasks
+    workerSemaphore->Post(min((int)tasks.size(), nWorkers));
 #endif
 }
 
 
 #ifndef PBRT_USE_GRAND_CENTRAL_DISPATCH
+static Task *PopTask(WorkerQueue &queue, bool newest) {
+    if (queue.size == 0)
+        return NULL;
+    MutexLock lock(*queue.mutex);
+    if (queue.head == queue.tasks.size())
+        return NULL;
+    Task *task;
+    if (newest) {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+    }
+    else
+        task = queue.tasks[queue.head++];
+    if (queue.head == queue.tasks.size()) {
+        queue.tasks.clear();
+        queue.head = 0;
+    }
+    AtomicAdd(&queue.size, -1);
+    return task;
+}
+
+
+static Task *FindTask(int worker) {
+    WorkerQueue &queue = workerQueues[worker];
+    Task *task = PopTask(queue, true);
+    if (task || nWorkers == 1)
+        return task;
+
+    // Steal from the other workers, starting from a random one so that the
+    // thieves spread over the victims
+    queue.stealSeed ^= queue.stealSeed << 13;
+    queue.stealSeed ^= queue.stealSeed >> 17;
+    queue.stealSeed ^= queue.stealSeed << 5;
+    int first = queue.stealSeed % (nWorkers - 1);
+    for (int i = 0; i < nWorkers - 1; ++i) {
+        int victim = (worker + 1 + (first + i) % (nWorkers - 1)) % nWorkers;
+        if ((task = PopTask(workerQueues[victim], false)) != NULL) {
+            ++queue.nStolen;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+
 #if defined(PBRT_IS_WINDOWS)
 static DWORD WINAPI taskEntry(LPVOID arg) {
 #else
 static void *taskEntry(void *arg) {
+#endif
+    int worker = (int)reinterpret_cast<intptr_t>(arg);
+    WorkerQueue &queue = workerQueues[worker];
+#if defined(PBRT_IS_WINDOWS)
+    TlsSetValue(workerIndexKey, reinterpret_cast<LPVOID>(intptr_t(worker + 1)));
+#else
+    pthread_setspecific(workerIndexKey, reinterpret_cast<void *>(intptr_t(worker + 1)));
 #endif
     while (true) {
-        workerSemaphore->Wait();
-        // Try to get task from task queue
-        Task *myTask = NULL;
-        { MutexLock lock(*taskQueueMutex);
-        if (taskQueue.size() == 0)
-            break;
-        myTask = taskQueue.back();
-        taskQueue.pop_back();
+        Task *myTask = FindTask(worker);
+        if (!myTask) {
+            if (tasksShutdown)
+                break;
+            workerSemaphore->Wait();
+            continue;
         }
 
         // Do work for _myTask_
         PBRT_STARTED_TASK(myTask);
+        queue.busyTimer.Start();
         myTask->Run();
+        queue.busyTimer.Stop();
         PBRT_FINISHED_TASK(myTask);
-        tasksRunningCondition->Lock();
-        int unfinished = --numUnfinishedTasks;
-        if (unfinished == 0)
+        ++queue.nRun;
+        if (AtomicAdd(&numUnfinishedTasks, -1) == 0) {
+            tasksRunningCondition->Lock();
             tasksRunningCondition->Signal();
-        tasksRunningCondition->Unlock();
+            tasksRunningCondition->Unlock();
+        }
     }
     // Cleanup from task thread and exit
 #if !defined(PBRT_IS_WINDOWS)
@@ -875,6 +1009,50 @@ void WaitForAllTasks() {
 }
 
 
+int ParallelChunkSize(int count, int minChunk) {
+    if (PbrtOptions.nCores == 1)
+        return max(count, 1);
+    // A few chunks per core, so that the work stealing evens out the
+    // uneven ones
+    int nChunks = 8 * NumSystemCores();
+    return max(max(minChunk, 1), (count + nChunks - 1) / nChunks);
+}
+
+
+void RunTasks(vector<Task *> &tasks) {
+    EnqueueTasks(tasks);
+    WaitForAllTasks();
+    for (uint32_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+    tasks.clear();
+}
+
+
+int NumTaskWorkers() {
+    return (PbrtOptions.nCores == 1) ? 1 : NumSystemCores();
+}
+
+
+int TaskWorkerIndex() {
+    // Tasks run on the calling thread
+    if (PbrtOptions.nCores == 1)
+        return 0;
+#ifdef PBRT_USE_GRAND_CENTRAL_DISPATCH
+    return -1;
+#else
+#if defined(PBRT_IS_WINDOWS)
+    if (workerIndexKey == TLS_OUT_OF_INDEXES)
+        return -1;
+    return (int)reinterpret_cast<intptr_t>(TlsGetValue(workerIndexKey)) - 1;
+#else
+    if (!workerIndexKeyCreated)
+        return -1;
+    return (int)reinterpret_cast<intptr_t>(pthread_getspecific(workerIndexKey)) - 1;
+#endif // PBRT_IS_WINDOWS
+#endif // PBRT_USE_GRAND_CENTRAL_DISPATCH
+}
+
+
 int NumSystemCores() {
     if (PbrtOptions.nCores > 0) return PbrtOptions.nCores;
 #if defined(PBRT_IS_WINDOWS)
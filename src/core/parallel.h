@@ -343,4 +343,151 @@ void EnqueueTasks(const vector<Task *> &tasks);
 void WaitForAllTasks();
 int NumSystemCores();
 
+// Runs the tasks to completion, then deletes them
+void RunTasks(vector<Task *> &tasks);
+
+// Tasks run on task worker TaskWorkerIndex(), in [0, NumTaskWorkers()). It
+// is -1 outside the workers, and with Grand Central Dispatch, which has no
+// threads of its own.
+int NumTaskWorkers();
+int TaskWorkerIndex();
+
+// One T per task worker, created by the worker on first use. A worker runs
+// one task at a time, so its tasks use it without locking, and it outlives
+// them to be reused by the worker's next tasks.
+template <typename T> class WorkerLocal {
+public:
+    WorkerLocal() : slots(NumTaskWorkers(), (T *)NULL) { }
+    ~WorkerLocal() {
+        for (uint32_t i = 0; i < slots.size(); ++i)
+            delete slots[i];
+    }
+    // The instance of the calling task's worker, NULL outside the workers
+    T *Get() {
+        int worker = TaskWorkerIndex();
+        if (worker < 0 || worker >= (int)slots.size())
+            return NULL;
+        if (!slots[worker])
+            slots[worker] = new T;
+        return slots[worker];
+    }
+private:
+    WorkerLocal(const WorkerLocal &);
+    WorkerLocal &operator=(const WorkerLocal &);
+    vector<T *> slots;
+};
+
+// Parallel loops over [0, count), run as Tasks of consecutive iterations.
+// 'func' is any function object, its calls must be independent. The chunks
+// are sized so that each core gets a few of them, with at least 'minChunk'
+// iterations each to amortize the task overhead. Like WaitForAllTasks(),
+// they can't be called from a Task.
+int ParallelChunkSize(int count, int minChunk);
+
+template <typename Func> class ParallelForTask : public Task {
+public:
+    ParallelForTask(const Func &f, int s, int e) : func(f), start(s), end(e) { }
+    void Run() {
+        for (int i = start; i < end; ++i)
+            func(i);
+    }
+private:
+    const Func &func;
+    int start, end;
+};
+
+
+// Calls func(i) for every i in [0, count)
+template <typename Func>
+void ParallelFor(int count, const Func &func, int minChunk = 1) {
+    int chunk = ParallelChunkSize(count, minChunk);
+    if (chunk >= count) {
+        for (int i = 0; i < count; ++i)
+            func(i);
+        return;
+    }
+    vector<Task *> tasks;
+    for (int i = 0; i < count; i += chunk)
+        tasks.push_back(new ParallelForTask<Func>(func, i, min(i + chunk, count)));
+    RunTasks(tasks);
+}
+
+
+template <typename Func> class ParallelFor2DTask : public Task {
+public:
+    ParallelFor2DTask(const Func &f, int x0, int x1, int y0, int y1)
+        : func(f), xStart(x0), xEnd(x1), yStart(y0), yEnd(y1) { }
+    void Run() {
+        for (int y = yStart; y < yEnd; ++y)
+            for (int x = xStart; x < xEnd; ++x)
+                func(x, y);
+    }
+private:
+    const Func &func;
+    int xStart, xEnd, yStart, yEnd;
+};
+
+
+// Calls func(x, y) for every x in [0, nx) and y in [0, ny), in square
+// tiles of at least 'minChunk' calls
+template <typename Func>
+void ParallelFor2D(int nx, int ny, const Func &func, int minChunk = 1) {
+    int chunk = ParallelChunkSize(nx * ny, minChunk);
+    if (chunk >= nx * ny) {
+        for (int y = 0; y < ny; ++y)
+            for (int x = 0; x < nx; ++x)
+                func(x, y);
+        return;
+    }
+    int tileSize = max(1, Ceil2Int(sqrtf(float(chunk))));
+    vector<Task *> tasks;
+    for (int y = 0; y < ny; y += tileSize)
+        for (int x = 0; x < nx; x += tileSize)
+            tasks.push_back(new ParallelFor2DTask<Func>(func, x,
+                min(x + tileSize, nx), y, min(y + tileSize, ny)));
+    RunTasks(tasks);
+}
+
+
+template <typename T, typename Func> class ParallelReduceTask : public Task {
+public:
+    ParallelReduceTask(const Func &f, const T &identity, int s, int e)
+        : result(identity), func(f), start(s), end(e) { }
+    void Run() {
+        for (int i = start; i < end; ++i)
+            func(i, result);
+    }
+    T result;
+private:
+    const Func &func;
+    int start, end;
+};
+
+
+// Accumulates every i in [0, count) with func(i, acc) into one 'acc' per
+// chunk, starting from 'identity', and returns the chunk results merged in
+// order with combine(a, b). For a given core count, the result doesn't
+// depend on the scheduling.
+template <typename T, typename Func, typename Combine>
+T ParallelReduce(int count, const T &identity, const Func &func,
+                 const Combine &combine, int minChunk = 1) {
+    int chunk = ParallelChunkSize(count, minChunk);
+    vector<Task *> tasks;
+    for (int i = 0; i < count; i += chunk)
+        tasks.push_back(new ParallelReduceTask<T, Func>(func, identity, i,
+            min(i + chunk, count)));
+    if (tasks.size() == 1)
+        tasks[0]->Run();
+    else {
+        EnqueueTasks(tasks);
+        WaitForAllTasks();
+    }
+    T result = identity;
+    for (uint32_t i = 0; i < tasks.size(); ++i) {
+        result = combine(result, ((ParallelReduceTask<T, Func> *)tasks[i])->result);
+        delete tasks[i];
+    }
+    return result;
+}
+
 #endif // PBRT_CORE_PARALLEL_H
@@ -125,13 +125,20 @@ class ParamSet;
 template <typename T> struct ParamSetItem;
 struct Options {
     Options() { nCores = 0;
-                quickRender = quiet = openWindow = verbose = false;
-                imageFile = ""; }
+                quickRender = quiet = openWindow = verbose = resume = false;
+                imageFile = ""; tile = nTiles = 0; tileFile = ""; }
     int nCores;
     bool quickRender;
     bool quiet, verbose;
     bool openWindow;
+    // Continue the render from its checkpoint, if the renderer has one
+    bool resume;
     string imageFile;
+    // Worker of a distributed render: render tile 'tile' of 'nTiles' and
+    // write its raw buffers to 'tileFile' instead of the image, see
+    // MergeDualTiles(). 'nTiles' is 0 otherwise.
+    int tile, nTiles;
+    string tileFile;
 };
 
 
@@ -45,6 +45,13 @@ bool Primitive::CanIntersect() const {
 }
 
 
+void Primitive::IntersectBatch(const RayDifferential *rays,
+        Intersection *isects, bool *hits, int count) const {
+    for (int i = 0; i < count; ++i)
+        hits[i] = Intersect(rays[i], &isects[i]);
+}
+
+
 
 void Primitive::Refine(vector<Reference<Primitive> > &refined) const {
     Severe("Unimplemented Primitive::Refine() method called!");
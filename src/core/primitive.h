@@ -51,6 +51,10 @@ public:
     virtual bool CanIntersect() const;
     virtual bool Intersect(const Ray &r, Intersection *in) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Intersect() of 'count' rays, 'hits' receives its results. Aggregates
+    // may trace coherent rays together instead of one by one.
+    virtual void IntersectBatch(const RayDifferential *rays,
+        Intersection *isects, bool *hits, int count) const;
     virtual void Refine(vector<Reference<Primitive> > &refined) const;
     void FullyRefine(vector<Reference<Primitive> > &refined) const;
     virtual const AreaLight *GetAreaLight() const = 0;
@@ -33,9 +33,73 @@
 // core/renderer.cpp*
 #include "stdafx.h"
 #include "renderer.h"
+#include "sampler.h"
+#include "spectrum.h"
+#include "intersection.h"
 
 // Renderer Method Definitions
 Renderer::~Renderer() {
 }
 
 
+Spectrum Renderer::LiIntersected(const Scene *scene,
+        const RayDifferential &ray, bool hit, const Intersection &isect,
+        const Sample *sample, RNG &rng, MemoryArena &arena, Spectrum *T) const {
+    return Li(scene, ray, sample, rng, arena, NULL, T);
+}
+
+
+
+// RenderTaskScratch Method Definitions
+RenderTaskScratch::RenderTaskScratch() {
+    samples = NULL;
+    rays = NULL;
+    Ls = Ts = NULL;
+    isects = NULL;
+    rayWeights = NULL;
+    hits = NULL;
+    capacity = 0;
+    layout = NULL;
+}
+
+
+RenderTaskScratch::~RenderTaskScratch() {
+    Free();
+}
+
+
+void RenderTaskScratch::Reserve(const Sample *sample, int count) {
+    if (sample == layout && count <= capacity)
+        return;
+    Free();
+    samples = sample->Duplicate(count);
+    rays = new RayDifferential[count];
+    Ls = new Spectrum[count];
+    Ts = new Spectrum[count];
+    isects = new Intersection[count];
+    rayWeights = new float[count];
+    hits = new bool[count];
+    capacity = count;
+    layout = sample;
+}
+
+
+void RenderTaskScratch::Free() {
+    delete[] samples;
+    delete[] rays;
+    delete[] Ls;
+    delete[] Ts;
+    delete[] isects;
+    delete[] rayWeights;
+    delete[] hits;
+    samples = NULL;
+    rays = NULL;
+    Ls = Ts = NULL;
+    isects = NULL;
+    rayWeights = NULL;
+    hits = NULL;
+    capacity = 0;
+    layout = NULL;
+}
+
+
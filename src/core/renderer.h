@@ -38,6 +38,7 @@
 
 // core/renderer.h*
 #include "pbrt.h"
+#include "memory.h"
 
 // Renderer Declarations
 class Renderer {
@@ -51,6 +52,41 @@ public:
     virtual Spectrum Transmittance(const Scene *scene,
         const RayDifferential &ray, const Sample *sample,
         RNG &rng, MemoryArena &arena) const = 0;
+    // Li() of a ray already intersected with the scene, 'isect' holds its
+    // intersection if 'hit'. Renderers that trace their camera rays in
+    // batches override it, the default intersects the ray again.
+    virtual Spectrum LiIntersected(const Scene *scene,
+        const RayDifferential &ray, bool hit, const Intersection &isect,
+        const Sample *sample, RNG &rng, MemoryArena &arena,
+        Spectrum *T = NULL) const;
+};
+
+
+// Per-sample arrays and memory arena of the image sampling tasks. The
+// renderers keep one per task worker (see WorkerLocal), so that the tasks
+// of a render reuse them instead of allocating their own.
+class RenderTaskScratch {
+public:
+    RenderTaskScratch();
+    ~RenderTaskScratch();
+    // Make room for 'count' samples laid out like 'sample'
+    void Reserve(const Sample *sample, int count);
+
+    MemoryArena arena;
+    Sample *samples;
+    RayDifferential *rays;
+    Spectrum *Ls, *Ts;
+    Intersection *isects;
+    // Camera ray weights and first hits of batched tracing
+    float *rayWeights;
+    bool *hits;
+private:
+    RenderTaskScratch(const RenderTaskScratch &);
+    RenderTaskScratch &operator=(const RenderTaskScratch &);
+    void Free();
+    int capacity;
+    // Sample the current samples were duplicated from
+    const Sample *layout;
 };
 
 
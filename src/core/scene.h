@@ -53,6 +53,10 @@ public:
         PBRT_FINISHED_RAY_INTERSECTION(const_cast<Ray *>(&ray), isect, int(hit));
         return hit;
     }
+    void IntersectBatch(const RayDifferential *rays, Intersection *isects,
+                        bool *hits, int count) const {
+        aggregate->IntersectBatch(rays, isects, hits, count);
+    }
     bool IntersectP(const Ray &ray) const {
         PBRT_STARTED_RAY_INTERSECTIONP(const_cast<Ray *>(&ray));
         bool hit = aggregate->IntersectP(ray);
@@ -15,14 +15,17 @@
 #include "image.h"
 #include <limits>
 #include <vector>
+#include <algorithm>
 #include <paramSet.h>
 #include <string.h>
 
 
 // DualFilm Method Definitions
 DualFilm::DualFilm(int xres, int yres, Filter *filt, const float crop[4],
-    const string &fn, bool openWindow, int wnd_rad, float k, int ptc_rad)
-    : Film(xres, yres) {
+    const string &fn, bool openWindow, int wnd_rad, float k, int ptc_rad,
+    NLMeanEngine engine, NLMSimdLevel simd, DualFilmDenoiser denoiser,
+    bool useTiles, const string &dumpFn, PixelStorage storage)
+    : Film(xres, yres), useTiles(useTiles), dumpFilename(dumpFn) {
     filter = filt;
     memcpy(cropWindow, crop, 4 * sizeof(float));
     filename = fn;
@@ -36,8 +39,15 @@ DualFilm::DualFilm(int xres, int yres, Filter *filt, const float crop[4],
     /*int nPix = xPixelCount * yPixelCount;
     pixelsA.resize(nPix);   
 	pixelsB.resize(nPix);*/
-	pixelsA = new BlockedArray<Pixel>(xPixelCount, yPixelCount);
-	pixelsB = new BlockedArray<Pixel>(xPixelCount, yPixelCount);
+	pixelsA = new PixelBuffer(xPixelCount, yPixelCount, storage);
+	pixelsB = new PixelBuffer(xPixelCount, yPixelCount, storage);
+    dirtyA = new DirtyTiles(xPixelCount, yPixelCount);
+    dirtyB = new DirtyTiles(xPixelCount, yPixelCount);
+    mergeMutex[0] = Mutex::Create();
+    mergeMutex[1] = Mutex::Create();
+    Info("DualFilm buffers use %.1f MB (%s storage)",
+        (pixelsA->Bytes() + pixelsB->Bytes()) / (1024.f * 1024.f),
+        storage == PIXEL_STORAGE_HALF ? "half" : "float");
 
     // Precompute filter weight table
 #define FILTER_TABLE_SIZE 16
@@ -58,7 +68,30 @@ DualFilm::DualFilm(int xres, int yres, Filter *filt, const float crop[4],
         Warning("Support for opening image display window not available in this build.");
     }
 	
-	NLmean = new NLMeanFilter(wnd_rad, ptc_rad, k, 0.45f);
+	NLmean = new NLMeanFilter(wnd_rad, ptc_rad, k, 0.45f, engine, simd);
+    NLmean->Reserve(xPixelCount, yPixelCount);
+    if (engine == NLM_ENGINE_BOX)
+        Info("NL-means box engine using %s row kernels", NLMSimdName(simd));
+
+    nlmKernel = NULL;
+    if (denoiser == DENOISER_NLM_CPU) {
+        nlmKernel = new NlmeansKernel;
+        nlmKernel->Init(wnd_rad, ptc_rad, k, xPixelCount, yPixelCount);
+    }
+
+    // The film is the whole frame until SetTileOutput() is called
+    int extent[4] = { xPixelStart, xPixelStart + xPixelCount,
+                      yPixelStart, yPixelStart + yPixelCount };
+    tileInfo.xResolution = xResolution;
+    tileInfo.yResolution = yResolution;
+    memcpy(tileInfo.frame, extent, sizeof(extent));
+    memcpy(tileInfo.owned, extent, sizeof(extent));
+    memcpy(tileInfo.rendered, extent, sizeof(extent));
+    tileInfo.wnd_rad = wnd_rad;
+    tileInfo.ptc_rad = ptc_rad;
+    tileInfo.k = k;
+    tileInfo.engine = engine;
+    tileInfo.denoiser = denoiser;
 
     //// Allocate subpixel film image storage
     //subPixelRes = 4;
@@ -72,6 +105,37 @@ DualFilm::DualFilm(int xres, int yres, Filter *filt, const float crop[4],
 
 
 void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, TargetBuffer target) {
+    PixelBuffer *pixels = (target == BUFFER_A) ? pixelsA : pixelsB;
+    DirtyTiles *dirty = (target == BUFFER_A) ? dirtyA : dirtyB;
+    if (pixels->storage == PIXEL_STORAGE_FLOAT) {
+        Accumulate(sample, L, pixels, xPixelStart, yPixelStart, true, dirty);
+        return;
+    }
+
+    // Half buffers are only updated by merges, so the sample goes through a
+    // float tile around its pixel. This is the slow path of samples leaving
+    // the render tasks' tiles.
+    int bx = Clamp(Floor2Int(sample.imageX), xPixelStart, xPixelStart + xPixelCount - 1);
+    int by = Clamp(Floor2Int(sample.imageY), yPixelStart, yPixelStart + yPixelCount - 1);
+    DualFilmTile *tile = CreateTile(bx, bx + 1, by, by + 1, target);
+    if (Accumulate(sample, L, &tile->pixels, tile->xStart, tile->yStart, false,
+                   NULL, tile->touched))
+        MergeTile(tile);
+    delete tile;
+}
+
+
+void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, DualFilmTile *tile) {
+    // Samples whose footprint leaves the tile go straight to the film
+    if (!Accumulate(sample, L, &tile->pixels, tile->xStart, tile->yStart, false,
+                    NULL, tile->touched))
+        AddSample(sample, L, tile->target);
+}
+
+
+bool DualFilm::Accumulate(const CameraSample &sample, const Spectrum &L,
+        PixelBuffer *pixels, int xStart, int yStart, bool syncNeeded,
+        DirtyTiles *dirty, int *touched) {
     // Compute sample's raster extent
     float dimageX = sample.imageX - 0.5f;
     float dimageY = sample.imageY - 0.5f;
@@ -86,7 +150,31 @@ void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, TargetBu
     if ((x1-x0) < 0 || (y1-y0) < 0)
     {
         PBRT_SAMPLE_OUTSIDE_IMAGE_EXTENT(const_cast<CameraSample *>(&sample));
-        return;
+        return true;
+    }
+
+    // The pixel receiving the box statistics, if any
+    int bx = Floor2Int(sample.imageX);
+    int by = Floor2Int(sample.imageY);
+    bool hasBox = !(bx < xPixelStart || by < yPixelStart ||
+                    bx >= xPixelStart + xPixelCount || by >= yPixelStart + yPixelCount);
+
+    // Check that the whole footprint lies inside 'pixels'
+    int xEnd = xStart + pixels->xPixelCount, yEnd = yStart + pixels->yPixelCount;
+    if (x0 < xStart || x1 >= xEnd || y0 < yStart || y1 >= yEnd)
+        return false;
+    if (hasBox && (bx < xStart || bx >= xEnd || by < yStart || by >= yEnd))
+        return false;
+    int mx0 = x0, mx1 = x1, my0 = y0, my1 = y1;
+    if (hasBox) {
+        mx0 = min(mx0, bx); mx1 = max(mx1, bx);
+        my0 = min(my0, by); my1 = max(my1, by);
+    }
+    if (dirty)
+        dirty->Mark(mx0 - xStart, my0 - yStart, mx1 - xStart, my1 - yStart);
+    if (touched) {
+        touched[0] = min(touched[0], mx0); touched[1] = max(touched[1], mx1);
+        touched[2] = min(touched[2], my0); touched[3] = max(touched[3], my1);
     }
 
     // Loop over filter support and add sample to pixel arrays
@@ -109,13 +197,8 @@ void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, TargetBu
         ify[y-y0] = min(Floor2Int(fy), FILTER_TABLE_SIZE-1);
     }
 
-    // Select the right target buffer
-    //vector<NlmeansPixel> &pixels = (target == BUFFER_A) ? pixelsA : pixelsB;
-    BlockedArray<Pixel> *pixels = (target == BUFFER_A) ?pixelsA : pixelsB;
-
-
-    // Always use AtomicAdd since adaptive sampling might be using large kernels
-    bool syncNeeded = true; // (filter->xWidth > 0.5f || filter->yWidth > 0.5f);
+    // The film buffers always need AtomicAdd since adaptive sampling might be
+    // using large kernels, private tiles don't
     for (int y = y0; y <= y1; ++y) {
         for (int x = x0; x <= x1; ++x) {
             // Evaluate filter value at $(x,y)$ pixel
@@ -126,40 +209,48 @@ void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, TargetBu
             /*int pix = xPixelCount * (y - yPixelStart) + x - xPixelStart;
             NlmeansPixel &pixel = pixels[pix];*/
 			
-			Pixel &pixel = (*pixels)(x - xPixelStart, y - yPixelStart);
+			int pix = pixels->Index(x - xStart, y - yStart);
 			
             if (!syncNeeded) {
-                pixel.Lxyz[0] += filterWt * xyz[0];
-                pixel.Lxyz[1] += filterWt * xyz[1];
-                pixel.Lxyz[2] += filterWt * xyz[2];
-                pixel.weightSum += filterWt;
+                pixels->Lxyz[0][pix] += filterWt * xyz[0];
+                pixels->Lxyz[1][pix] += filterWt * xyz[1];
+                pixels->Lxyz[2][pix] += filterWt * xyz[2];
+                pixels->weightSum[pix] += filterWt;
             }
             else {
-                // Safely update _Lrgb_ and _weightSum_ even with concurrency
-                AtomicAdd(&pixel.Lxyz[0], filterWt * xyz[0]);
-                AtomicAdd(&pixel.Lxyz[1], filterWt * xyz[1]);
-                AtomicAdd(&pixel.Lxyz[2], filterWt * xyz[2]);
-                AtomicAdd(&pixel.weightSum, filterWt);
+                // Safely update _Lxyz_ and _weightSum_ even with concurrency
+                AtomicAdd(&pixels->Lxyz[0][pix], filterWt * xyz[0]);
+                AtomicAdd(&pixels->Lxyz[1][pix], filterWt * xyz[1]);
+                AtomicAdd(&pixels->Lxyz[2][pix], filterWt * xyz[2]);
+                AtomicAdd(&pixels->weightSum[pix], filterWt);
             }
         }
     }
     
     //// We're done is, this sample is outside the film buffer
-    int x = Floor2Int(sample.imageX);
-    int y = Floor2Int(sample.imageY);
-    if (x < 0 || y < 0 || x >= xPixelCount || y >= yPixelCount)
-        return;
+    if (!hasBox)
+        return true;
     
     // Store variance information
-    //int pix = xPixelCount * (y - yPixelStart) + x - xPixelStart;
-    Pixel &pixel = (*pixels)(x - xPixelStart, y - yPixelStart);
-    AtomicAdd(&pixel._LrgbSumBox[0], rgb[0]);
-    AtomicAdd(&pixel._LrgbSumBox[1], rgb[1]);
-    AtomicAdd(&pixel._LrgbSumBox[2], rgb[2]);
-    AtomicAdd(&pixel._LrgbSumSqrBox[0], rgb[0]*rgb[0]);
-    AtomicAdd(&pixel._LrgbSumSqrBox[1], rgb[1]*rgb[1]);
-    AtomicAdd(&pixel._LrgbSumSqrBox[2], rgb[2]*rgb[2]);
-    AtomicAdd((AtomicInt32*)&pixel._nSamplesBox, (int32_t)1);
+    int pix = pixels->Index(bx - xStart, by - yStart);
+    if (!syncNeeded) {
+        pixels->LrgbSumBox[0][pix] += rgb[0];
+        pixels->LrgbSumBox[1][pix] += rgb[1];
+        pixels->LrgbSumBox[2][pix] += rgb[2];
+        pixels->LrgbSumSqrBox[0][pix] += rgb[0]*rgb[0];
+        pixels->LrgbSumSqrBox[1][pix] += rgb[1]*rgb[1];
+        pixels->LrgbSumSqrBox[2][pix] += rgb[2]*rgb[2];
+        pixels->nSamplesBox[pix] += 1;
+    }
+    else {
+        AtomicAdd(&pixels->LrgbSumBox[0][pix], rgb[0]);
+        AtomicAdd(&pixels->LrgbSumBox[1][pix], rgb[1]);
+        AtomicAdd(&pixels->LrgbSumBox[2][pix], rgb[2]);
+        AtomicAdd(&pixels->LrgbSumSqrBox[0][pix], rgb[0]*rgb[0]);
+        AtomicAdd(&pixels->LrgbSumSqrBox[1][pix], rgb[1]*rgb[1]);
+        AtomicAdd(&pixels->LrgbSumSqrBox[2][pix], rgb[2]*rgb[2]);
+        AtomicAdd((AtomicInt32*)&pixels->nSamplesBox[pix], (int32_t)1);
+    }
     
     //// Store on sub-pixel grid
     //x = Floor2Int(subPixelRes * sample.imageX);
@@ -170,6 +261,84 @@ void DualFilm::AddSample(const CameraSample &sample, const Spectrum &L, TargetBu
     //AtomicAdd(&subpix._LrgbSumBox[1], rgb[1]);
     //AtomicAdd(&subpix._LrgbSumBox[2], rgb[2]);
     //AtomicAdd(&subpix._nSamplesBox, 1);
+    return true;
+}
+
+
+DualFilmTile *DualFilm::CreateTile(int xstart, int xend, int ystart, int yend,
+        TargetBuffer target) const {
+    if (!useTiles)
+        return NULL;
+    // Grow the task's pixel extent by the filter radius, within the film
+    int xApron = Ceil2Int(filter->xWidth), yApron = Ceil2Int(filter->yWidth);
+    int x0 = max(xstart - xApron, xPixelStart);
+    int x1 = min(xend + xApron, xPixelStart + xPixelCount);
+    int y0 = max(ystart - yApron, yPixelStart);
+    int y1 = min(yend + yApron, yPixelStart + yPixelCount);
+    if (x1 <= x0 || y1 <= y0)
+        return NULL;
+    return new DualFilmTile(x0, y0, x1 - x0, y1 - y0, target);
+}
+
+
+void DualFilm::MergeTile(const DualFilmTile *tile) {
+    // Neighboring tiles overlap over their aprons, so the merge still needs
+    // atomics, but only once per pixel
+    PixelBuffer *pixels = (tile->target == BUFFER_A) ? pixelsA : pixelsB;
+    DirtyTiles *dirty = (tile->target == BUFFER_A) ? dirtyA : dirtyB;
+    const PixelBuffer &src = tile->pixels;
+    // Only the pixels the samples reached are merged and marked, so that
+    // the refresh filter skips the parts of the frame left untouched
+    int x0 = tile->touched[0] - tile->xStart, x1 = tile->touched[1] - tile->xStart;
+    int y0 = tile->touched[2] - tile->yStart, y1 = tile->touched[3] - tile->yStart;
+    if (x1 < x0 || y1 < y0)
+        return;
+    dirty->Mark(tile->touched[0] - xPixelStart, tile->touched[2] - yPixelStart,
+        tile->touched[1] - xPixelStart, tile->touched[3] - yPixelStart);
+    if (pixels->storage == PIXEL_STORAGE_HALF) {
+        // The tile's float sums are rounded once, when they are merged
+        MutexLock lock(*mergeMutex[tile->target == BUFFER_A ? 0 : 1]);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                int sp = src.Index(x, y);
+                int pix = pixels->Index(tile->xStart + x - xPixelStart,
+                                        tile->yStart + y - yPixelStart);
+                if (src.weightSum[sp] != 0.f || src.Lxyz[0][sp] != 0.f ||
+                    src.Lxyz[1][sp] != 0.f || src.Lxyz[2][sp] != 0.f) {
+                    float xyz[3] = { src.Lxyz[0][sp], src.Lxyz[1][sp], src.Lxyz[2][sp] };
+                    pixels->AddFiltered(pix, xyz, src.weightSum[sp]);
+                }
+                if (src.nSamplesBox[sp] != 0) {
+                    float sum[3] = { src.LrgbSumBox[0][sp], src.LrgbSumBox[1][sp],
+                                     src.LrgbSumBox[2][sp] };
+                    float sumSqr[3] = { src.LrgbSumSqrBox[0][sp], src.LrgbSumSqrBox[1][sp],
+                                        src.LrgbSumSqrBox[2][sp] };
+                    pixels->AddBox(pix, src.nSamplesBox[sp], sum, sumSqr);
+                }
+            }
+        }
+        return;
+    }
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            int sp = src.Index(x, y);
+            int pix = pixels->Index(tile->xStart + x - xPixelStart,
+                                    tile->yStart + y - yPixelStart);
+            if (src.weightSum[sp] != 0.f || src.Lxyz[0][sp] != 0.f ||
+                src.Lxyz[1][sp] != 0.f || src.Lxyz[2][sp] != 0.f) {
+                for (int c = 0; c < 3; ++c)
+                    AtomicAdd(&pixels->Lxyz[c][pix], src.Lxyz[c][sp]);
+                AtomicAdd(&pixels->weightSum[pix], src.weightSum[sp]);
+            }
+            if (src.nSamplesBox[sp] != 0) {
+                for (int c = 0; c < 3; ++c) {
+                    AtomicAdd(&pixels->LrgbSumBox[c][pix], src.LrgbSumBox[c][sp]);
+                    AtomicAdd(&pixels->LrgbSumSqrBox[c][pix], src.LrgbSumSqrBox[c][sp]);
+                }
+                AtomicAdd((AtomicInt32*)&pixels->nSamplesBox[pix], (int32_t)src.nSamplesBox[sp]);
+            }
+        }
+    }
 }
 
 
@@ -195,70 +364,372 @@ void DualFilm::GetPixelExtent(int *xstart, int *xend,
 }
 
 
-void DualFilm::WriteImage(float splatScale) {
-    // Dump the noisy data by combining the two buffers
-    /*ImageBuffer rgb(3 * xPixelCount * yPixelCount);
-    ImageBuffer rgbA(3 * xPixelCount * yPixelCount);
-    ImageBuffer rgbB(3 * xPixelCount * yPixelCount);*/
-	
-	int nPix = xPixelCount * yPixelCount;
-    
-	float *rgbA = new float[3*nPix];
-	float *rgbB = new float[3*nPix];
-    float *rgb = new float[3*nPix];
-    int offset = 0;
-
-    for (int y = 0, pix = 0; y < yPixelCount; ++y) {
-        for (int x = 0; x < xPixelCount; ++x, ++pix) {
-            // Convert pixel XYZ color to RGB
-            XYZToRGB((*pixelsA)(x, y).Lxyz, &rgbA[3*offset]);
-
-            // Normalize pixel with weight sum
-            Pixel &pixelA = (*pixelsA)(x, y);
-            float wgtSumA = pixelA.weightSum;
-            if (wgtSumA != 0.f) {
-                    float invWt = 1.f / wgtSumA;
-                    rgbA[3*offset  ] = max(0.f, rgbA[3*offset  ] * invWt);
-                    rgbA[3*offset+1] = max(0.f, rgbA[3*offset+1] * invWt);
-                    rgbA[3*offset+2] = max(0.f, rgbA[3*offset+2] * invWt);
-            }
-			
-			XYZToRGB((*pixelsB)(x, y).Lxyz, &rgbB[3*offset]);
-
-            // Normalize pixel with weight sum
-            Pixel &pixelB = (*pixelsB)(x, y);
-            float wgtSumB = pixelB.weightSum;
-            if (wgtSumB != 0.f) {
-                    float invWt = 1.f / wgtSumB;
-                    rgbB[3*offset  ] = max(0.f, rgbB[3*offset  ] * invWt);
-                    rgbB[3*offset+1] = max(0.f, rgbB[3*offset+1] * invWt);
-                    rgbB[3*offset+2] = max(0.f, rgbB[ 3*offset+2] * invWt);
-            }
-            
-            // Sum both buffers
-            float wgtSum = wgtSumA + wgtSumB;
-            if (wgtSumA != 0.f) {
-                    rgb[3*offset  ] = (wgtSumA * rgbA[3*offset  ] + wgtSumB * rgbB[3*offset  ]) / wgtSum;
-                    rgb[3*offset+1] = (wgtSumA * rgbA[3*offset+1] + wgtSumB * rgbB[3*offset+1]) / wgtSum;
-                    rgb[3*offset+2] = (wgtSumA * rgbA[3*offset+2] + wgtSumB * rgbB[3*offset+2]) / wgtSum;
+// Converts the filtered XYZ sums of a pixel to its RGB mean
+struct ResolvePixel {
+    ResolvePixel(PixelBuffer *p) : pixels(p) { }
+    void operator()(int pix) const {
+        // Convert pixel XYZ color to RGB
+        float xyz[3] = { pixels->Lxyz[0][pix], pixels->Lxyz[1][pix], pixels->Lxyz[2][pix] };
+        float rgb[3];
+        XYZToRGB(xyz, rgb);
+
+        // Normalize pixel with weight sum
+        float wgtSum = pixels->weightSum[pix];
+        if (wgtSum != 0.f) {
+            float invWt = 1.f / wgtSum;
+            rgb[0] = max(0.f, rgb[0] * invWt);
+            rgb[1] = max(0.f, rgb[1] * invWt);
+            rgb[2] = max(0.f, rgb[2] * invWt);
+        }
+        pixels->Lrgb[0][pix] = rgb[0];
+        pixels->Lrgb[1][pix] = rgb[1];
+        pixels->Lrgb[2][pix] = rgb[2];
+    }
+    PixelBuffer *pixels;
+};
+
+
+void DualFilm::ResolvePixels() const {
+    if (pixelsA->storage == PIXEL_STORAGE_HALF)
+        return;
+    int nPix = xPixelCount * yPixelCount;
+    ParallelFor(nPix, ResolvePixel(pixelsA), 4096);
+    ParallelFor(nPix, ResolvePixel(pixelsB), 4096);
+}
+
+
+void DualFilm::BeginPixelErrors(vector<Task *> &tasks) const {
+    // The symmetric kernel can't be split, it runs right away
+    if (nlmKernel) {
+        Denoise(NLM_DATA_INTER);
+        return;
+    }
+    ResolvePixels();
+    NLmean->BeginFiltering(pixelsA, pixelsB, xPixelCount, yPixelCount,
+        dirtyA, dirtyB, tasks);
+    // Samples added from now on are left for the next denoising
+    dirtyA->Clear();
+    dirtyB->Clear();
+}
+
+
+void DualFilm::EndPixelErrors(vector<Task *> &tasks) const {
+    if (!nlmKernel)
+        NLmean->EndFiltering(tasks);
+}
+
+
+float *DualFilm::Denoise(NlmeansData dataType) const {
+    ResolvePixels();
+    if (!nlmKernel) {
+        // Only the tiles that received samples since the last call, and their
+        // neighbors, are filtered again
+        float *rgb = NLmean->NLFiltering(pixelsA, pixelsB, xPixelCount, yPixelCount,
+            dirtyA, dirtyB);
+        dirtyA->Clear();
+        dirtyB->Clear();
+        return rgb;
+    }
+    return NlmKernelDenoise(nlmKernel, NLmean, pixelsA, pixelsB, dataType);
+}
+
+
+// Flattens a row of the buffers for the symmetric kernel
+struct FlattenRow {
+    FlattenRow(const PixelBuffer *a, const PixelBuffer *b, float *count,
+        float *avg1, float *var1, float *avg2, float *var2)
+        : pixelsA(a), pixelsB(b), spp(count) {
+        avg[0] = avg1; var[0] = var1;
+        avg[1] = avg2; var[1] = var2;
+    }
+    void operator()(int y) const {
+        int xPixelCount = pixelsA->xPixelCount;
+        float *scratch = ALLOCA(float, 3 * xPixelCount);
+        const int *nA = pixelsA->SamplesRow(y), *nB = pixelsB->SamplesRow(y);
+        for (int x = 0; x < xPixelCount; ++x)
+            spp[y*xPixelCount + x] = nA[x] + nB[x];
+        for (int b = 0; b < 2; ++b) {
+            const PixelBuffer *pixels = (b == 0) ? pixelsA : pixelsB;
+            const int *nRow = pixels->SamplesRow(y);
+            for (int c = 0; c < 3; ++c) {
+                const float *rgb = pixels->LrgbRow(c, y, &scratch[0]);
+                const float *sum = pixels->SumRow(c, y, &scratch[xPixelCount]);
+                const float *sumSqr = pixels->SumSqrRow(c, y, &scratch[2*xPixelCount]);
+                for (int x = 0; x < xPixelCount; ++x) {
+                    int pix = y*xPixelCount + x, n = nRow[x];
+                    avg[b][3*pix+c] = rgb[x];
+                    if (n > 1)
+                        var[b][3*pix+c] = max(0.f, sumSqr[x] -
+                            sum[x] * (sum[x] / n)) / (n * (n - 1));
+                    else
+                        var[b][3*pix+c] = 0.f;
+                }
             }
         }
     }
+    const PixelBuffer *pixelsA, *pixelsB;
+    float *spp, *avg[2], *var[2];
+};
+
+
+float *NlmKernelDenoise(NlmeansKernel *kernel, NLMeanFilter *nlmean,
+    PixelBuffer *pixelsA, PixelBuffer *pixelsB, NlmeansData dataType) {
+    // Flatten the buffers for the kernel: the pixel values, and the variance
+    // of each pixel mean
+    int xPixelCount = pixelsA->xPixelCount, yPixelCount = pixelsA->yPixelCount;
+    int nPix = xPixelCount * yPixelCount;
+    ImageBuffer spp(nPix), avg1(3*nPix), var1(3*nPix), avg2(3*nPix), var2(3*nPix);
+    ParallelFor(yPixelCount, FlattenRow(pixelsA, pixelsB, &spp[0],
+        &avg1[0], &var1[0], &avg2[0], &var2[0]));
+    ImageBuffer avgVar1 = var1, avgVar2 = var2;
+    ImageBuffer avgOut1, sppOut1, avgOut2, sppOut2;
+    kernel->Apply(dataType, spp, avg1, var1, avgVar1, avg2, var2, avgVar2,
+        avgOut1, sppOut1, avgOut2, sppOut2);
+
+    // The pixel errors and the combined image are computed as with the
+    // NLMeanFilter
+    return nlmean->Combine(pixelsA, pixelsB, xPixelCount, yPixelCount,
+        &avgOut1[0], &avgOut2[0]);
+}
 
-	
-	rgb = NLmean->NLFiltering(pixelsA, pixelsB, xPixelCount, yPixelCount);
 
+// A tile file starts with a magic string, a version number and the
+// DualTileInfo fields, followed by the film's output filename (length and
+// characters) and the planes of both buffers of the rendered pixels, see
+// PixelBuffer::Write()
+static const char DUAL_TILE_MAGIC[8] = { 'P', 'B', 'R', 'T', 'T', 'I', 'L', 'E' };
+static const int32_t DUAL_TILE_VERSION = 1;
+
+static bool WriteDualTile(const string &tileFile, const DualTileInfo &info,
+        const string &imageFile, const PixelBuffer *pixelsA,
+        const PixelBuffer *pixelsB) {
+    FILE *f = fopen(tileFile.c_str(), "wb");
+    if (!f) {
+        Error("Unable to open \"%s\" to write the tile", tileFile.c_str());
+        return false;
+    }
+    int32_t header[20] = { DUAL_TILE_VERSION, info.xResolution, info.yResolution,
+        info.frame[0], info.frame[1], info.frame[2], info.frame[3],
+        info.owned[0], info.owned[1], info.owned[2], info.owned[3],
+        info.rendered[0], info.rendered[1], info.rendered[2], info.rendered[3],
+        info.wnd_rad, info.ptc_rad, info.engine, info.denoiser,
+        int32_t(imageFile.size()) };
+    bool ok = fwrite(DUAL_TILE_MAGIC, 1, 8, f) == 8 &&
+              fwrite(header, sizeof(int32_t), 20, f) == 20 &&
+              fwrite(&info.k, sizeof(float), 1, f) == 1 &&
+              fwrite(imageFile.c_str(), 1, imageFile.size(), f) == imageFile.size() &&
+              pixelsA->Write(f) && pixelsB->Write(f);
+    if (fclose(f) != 0) ok = false;
+    if (!ok)
+        Error("Error writing the tile to \"%s\"", tileFile.c_str());
+    return ok;
+}
+
+
+// Read a tile file, the buffers have float storage
+static bool ReadDualTile(const string &tileFile, DualTileInfo *info,
+        string *imageFile, PixelBuffer **pixelsA, PixelBuffer **pixelsB) {
+    *pixelsA = *pixelsB = NULL;
+    FILE *f = fopen(tileFile.c_str(), "rb");
+    if (!f) {
+        Error("Unable to open tile \"%s\"", tileFile.c_str());
+        return false;
+    }
+    char magic[8];
+    int32_t header[20];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, DUAL_TILE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(int32_t), 20, f) != 20 ||
+        header[0] != DUAL_TILE_VERSION || fread(&info->k, sizeof(float), 1, f) != 1 ||
+        header[12] <= header[11] || header[14] <= header[13] ||
+        header[19] < 0 || header[19] > 4096) {
+        Error("\"%s\" isn't a tile of a distributed render", tileFile.c_str());
+        fclose(f);
+        return false;
+    }
+    info->xResolution = header[1];
+    info->yResolution = header[2];
+    for (int i = 0; i < 4; ++i) {
+        info->frame[i] = header[3 + i];
+        info->owned[i] = header[7 + i];
+        info->rendered[i] = header[11 + i];
+    }
+    info->wnd_rad = header[15];
+    info->ptc_rad = header[16];
+    info->engine = NLMeanEngine(header[17]);
+    info->denoiser = DualFilmDenoiser(header[18]);
+    vector<char> name(header[19] + 1, '\0');
+    int xres = info->rendered[1] - info->rendered[0];
+    int yres = info->rendered[3] - info->rendered[2];
+    PixelBuffer *a = new PixelBuffer(xres, yres);
+    PixelBuffer *b = new PixelBuffer(xres, yres);
+    bool ok = fread(&name[0], 1, header[19], f) == size_t(header[19]) &&
+              a->Read(f) && b->Read(f);
+    fclose(f);
+    if (!ok) {
+        Error("Error reading the tile \"%s\"", tileFile.c_str());
+        delete a;
+        delete b;
+        return false;
+    }
+    *imageFile = &name[0];
+    *pixelsA = a;
+    *pixelsB = b;
+    return true;
+}
+
+
+void DualFilm::WriteImage(float splatScale) {
+    // Workers of a distributed render leave the denoising to the merge
+    if (tileFilename != "") {
+        ResolvePixels();
+        WriteDualTile(tileFilename, tileInfo, filename, pixelsA, pixelsB);
+        return;
+    }
+
+    // Filter out noise from the two buffers and store the result
+    float *rgb = Denoise(NLM_DATA_FINAL);
 
     ::WriteImage(filename, &rgb[0], NULL, xPixelCount, yPixelCount, xPixelCount, yPixelCount, 0, 0);
+    if (dumpFilename != "")
+        WriteDualBuffers(dumpFilename, pixelsA, pixelsB);
+    NLmean->ReportMemory();
+}
 
 
-	
-    // Filter out noise from data and store the result
-    /*
-	if (!NLmean->IsReady())
-			_denoiser->UpdatePixelData(pixelsA, pixelsB, subPixelsA, subPixelsB, NLM_DATA_FINAL);
-	*/
-    
+bool DualFilm::WriteCheckpoint(FILE *f) const {
+    return pixelsA->Write(f) && pixelsB->Write(f);
+}
+
+
+bool DualFilm::ReadCheckpoint(FILE *f) {
+    if (!pixelsA->Read(f) || !pixelsB->Read(f))
+        return false;
+    // Nothing filtered so far matches the restored buffers
+    dirtyA->MarkAll();
+    dirtyB->MarkAll();
+    return true;
+}
+
+
+void DualFilm::SetTileOutput(const string &tileFile, const int frame[4],
+        const int owned[4]) {
+    tileFilename = tileFile;
+    memcpy(tileInfo.frame, frame, 4 * sizeof(int));
+    memcpy(tileInfo.owned, owned, 4 * sizeof(int));
+}
+
+
+void DualTileExtent(const int frame[4], int num, int count, int extent[4]) {
+    // Determine how many tiles to use in each dimension, _nx_ and _ny_
+    int dx = frame[1] - frame[0], dy = frame[3] - frame[2];
+    int nx = count, ny = 1;
+    while ((nx & 0x1) == 0 && 2 * dx * ny < dy * nx) {
+        nx >>= 1;
+        ny <<= 1;
+    }
+    int xo = num % nx, yo = num / nx;
+    extent[0] = frame[0] + dx * xo / nx;
+    extent[1] = frame[0] + dx * (xo + 1) / nx;
+    extent[2] = frame[2] + dy * yo / ny;
+    extent[3] = frame[2] + dy * (yo + 1) / ny;
+}
+
+
+static void CopyPixel(PixelBuffer *dst, int dpix, const PixelBuffer *src, int spix) {
+    for (int c = 0; c < 3; ++c) {
+        dst->Lxyz[c][dpix] = src->Lxyz[c][spix];
+        dst->Lrgb[c][dpix] = src->Lrgb[c][spix];
+        dst->LrgbSumBox[c][dpix] = src->LrgbSumBox[c][spix];
+        dst->LrgbSumSqrBox[c][dpix] = src->LrgbSumSqrBox[c][spix];
+    }
+    dst->weightSum[dpix] = src->weightSum[spix];
+    dst->nSamplesBox[dpix] = src->nSamplesBox[spix];
+}
+
+
+bool MergeDualTiles(const vector<string> &tileFiles, const string &filename) {
+    if (tileFiles.empty()) {
+        Error("No tiles to merge");
+        return false;
+    }
+    DualTileInfo frameInfo;
+    string imageFile;
+    PixelBuffer *frameA = NULL, *frameB = NULL;
+    vector<int> owner;
+    bool ok = true;
+    for (uint32_t t = 0; t < tileFiles.size() && ok; ++t) {
+        DualTileInfo info;
+        string tileImageFile;
+        PixelBuffer *tileA, *tileB;
+        if (!ReadDualTile(tileFiles[t], &info, &tileImageFile, &tileA, &tileB)) {
+            ok = false;
+            break;
+        }
+        if (t == 0) {
+            frameInfo = info;
+            imageFile = tileImageFile;
+            int xres = info.frame[1] - info.frame[0], yres = info.frame[3] - info.frame[2];
+            frameA = new PixelBuffer(xres, yres);
+            frameB = new PixelBuffer(xres, yres);
+            owner.resize(xres * yres, -1);
+        }
+        else if (memcmp(info.frame, frameInfo.frame, sizeof(info.frame)) != 0) {
+            Error("Tile \"%s\" isn't part of the frame of \"%s\"",
+                tileFiles[t].c_str(), tileFiles[0].c_str());
+            ok = false;
+        }
+
+        // Keep the pixels owned by the tile, the apron belongs to other tiles
+        for (int y = info.owned[2]; y < info.owned[3] && ok; ++y) {
+            for (int x = info.owned[0]; x < info.owned[1]; ++x) {
+                if (x < info.rendered[0] || x >= info.rendered[1] ||
+                    y < info.rendered[2] || y >= info.rendered[3] ||
+                    x < info.frame[0] || x >= info.frame[1] ||
+                    y < info.frame[2] || y >= info.frame[3]) {
+                    Error("Tile \"%s\" is corrupted", tileFiles[t].c_str());
+                    ok = false;
+                    break;
+                }
+                int pix = frameA->Index(x - info.frame[0], y - info.frame[2]);
+                if (owner[pix] >= 0) {
+                    Error("Tiles \"%s\" and \"%s\" overlap", tileFiles[owner[pix]].c_str(),
+                        tileFiles[t].c_str());
+                    ok = false;
+                    break;
+                }
+                owner[pix] = t;
+                int spix = tileA->Index(x - info.rendered[0], y - info.rendered[2]);
+                CopyPixel(frameA, pix, tileA, spix);
+                CopyPixel(frameB, pix, tileB, spix);
+            }
+        }
+        delete tileA;
+        delete tileB;
+    }
+    if (ok && std::find(owner.begin(), owner.end(), -1) != owner.end()) {
+        Error("The tiles don't cover the whole frame");
+        ok = false;
+    }
+
+    if (ok) {
+        // Same denoising as DualFilm::WriteImage()
+        int xres = frameA->xPixelCount, yres = frameA->yPixelCount;
+        NLMeanFilter nlmean(frameInfo.wnd_rad, frameInfo.ptc_rad, frameInfo.k,
+            0.45f, frameInfo.engine, NLMSimdSupported());
+        float *rgb;
+        if (frameInfo.denoiser == DENOISER_NLM_CPU) {
+            NlmeansKernel kernel;
+            kernel.Init(frameInfo.wnd_rad, frameInfo.ptc_rad, frameInfo.k, xres, yres);
+            rgb = NlmKernelDenoise(&kernel, &nlmean, frameA, frameB, NLM_DATA_FINAL);
+        }
+        else
+            rgb = nlmean.NLFiltering(frameA, frameB, xres, yres);
+        ::WriteImage(filename != "" ? filename : imageFile, rgb, NULL,
+            xres, yres, xres, yres, 0, 0);
+    }
+    delete frameA;
+    delete frameB;
+    return ok;
 }
 
 
@@ -303,8 +774,71 @@ DualFilm *CreateDualFilm(const ParamSet &params, Filter *filter) {
     // Patchsize
     int ptc_rad = params.FindOneInt("ptc_rad", 3);
 
-    return new DualFilm(xres, yres, filter, crop, filename, openwin, wnd_rad,
-        k, ptc_rad);
+    // Patch distance implementation, "box" or the "brute" reference
+    NLMeanEngine engine = NLMeanEngineFromString(params.FindOneString("nlmengine", "box"));
+
+    // Row kernels of the box engine, "auto", "scalar", "sse2" or "avx2"
+    NLMSimdLevel simd = NLMSimdFromString(params.FindOneString("nlmsimd", "auto"));
+
+    // Denoiser, the "nlmean" filter or the "nlm-cpu" symmetric kernel
+    string denoiserName = params.FindOneString("denoiser", "nlmean");
+    DualFilmDenoiser denoiser = DENOISER_NLMEAN;
+    if (denoiserName == "nlm-cpu")
+        denoiser = DENOISER_NLM_CPU;
+    else if (denoiserName != "nlmean")
+        Warning("Denoiser \"%s\" unknown. Using \"nlmean\".", denoiserName.c_str());
+
+    // Accumulate the samples of each render task in a private tile
+    bool useTiles = params.FindOneBool("tilebuffers", true);
+
+    // Also write the final A/B buffers, for tools/nlmbench
+    string dumpFilename = params.FindOneString("dumpbuffers", "");
+
+    // Store the buffers as fp16, see PixelStorage. The merges of the private
+    // tiles do the rounding, so tiles are always used then.
+    PixelStorage storage = PIXEL_STORAGE_FLOAT;
+    if (params.FindOneBool("halfbuffers", false)) {
+#ifdef PBRT_HAS_OPENEXR
+        storage = PIXEL_STORAGE_HALF;
+        if (!useTiles) {
+            Warning("\"halfbuffers\" needs \"tilebuffers\", enabling them.");
+            useTiles = true;
+        }
+#else
+        Warning("\"halfbuffers\" needs OpenEXR's half type, which isn't "
+                "available in this build. Using float buffers.");
+#endif
+    }
+
+    // Worker of a distributed render, the frame is the crop window
+    int frame[4], owned[4];
+    if (PbrtOptions.nTiles > 0) {
+        frame[0] = Ceil2Int(xres * crop[0]);
+        frame[1] = frame[0] + max(1, Ceil2Int(xres * crop[1]) - frame[0]);
+        frame[2] = Ceil2Int(yres * crop[2]);
+        frame[3] = frame[2] + max(1, Ceil2Int(yres * crop[3]) - frame[2]);
+        DualTileExtent(frame, PbrtOptions.tile, PbrtOptions.nTiles, owned);
+        if (owned[1] <= owned[0] || owned[3] <= owned[2])
+            Severe("Tile %d of %d is empty, use fewer tiles", PbrtOptions.tile,
+                PbrtOptions.nTiles);
+
+        // The apron holds the NL-means windows of the owned pixels. The crop
+        // window is offset by half a pixel so that DualFilm's rounding gives
+        // back the exact pixel extent.
+        int apron = wnd_rad + ptc_rad;
+        int x0 = max(frame[0], owned[0] - apron), x1 = min(frame[1], owned[1] + apron);
+        int y0 = max(frame[2], owned[2] - apron), y1 = min(frame[3], owned[3] + apron);
+        crop[0] = Clamp((x0 - .5f) / xres, 0.f, 1.f);
+        crop[1] = Clamp((x1 - .5f) / xres, 0.f, 1.f);
+        crop[2] = Clamp((y0 - .5f) / yres, 0.f, 1.f);
+        crop[3] = Clamp((y1 - .5f) / yres, 0.f, 1.f);
+    }
+
+    DualFilm *film = new DualFilm(xres, yres, filter, crop, filename, openwin,
+        wnd_rad, k, ptc_rad, engine, simd, denoiser, useTiles, dumpFilename, storage);
+    if (PbrtOptions.nTiles > 0)
+        film->SetTileOutput(PbrtOptions.tileFile, frame, owned);
+    return film;
 }
 
 
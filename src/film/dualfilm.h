@@ -16,6 +16,7 @@
 #include "paramset.h"
 /*#include "../denoisers/nlmdenoiser.h"*/
 #include "filters/NLmean.h"
+#include "nlmkernel.h"
 
 
 enum TargetBuffer {
@@ -23,15 +24,72 @@ enum TargetBuffer {
     BUFFER_B
 };
 
+// Filter applied to the two buffers. DENOISER_NLMEAN is the NLMeanFilter,
+// DENOISER_NLM_CPU is the symmetric NlmeansKernel pipeline of
+// core/nlmkernel.cu, run on the CPU.
+enum DualFilmDenoiser {
+    DENOISER_NLMEAN,
+    DENOISER_NLM_CPU
+};
+
+// Private accumulation buffer of one render task. It covers the task's pixels
+// plus the filter apron, so that the samples can be accumulated without
+// atomics and merged into the target buffer once, when the task is done.
+struct DualFilmTile {
+    DualFilmTile(int x0, int y0, int xres, int yres, TargetBuffer t)
+        : pixels(xres, yres), xStart(x0), yStart(y0), target(t) {
+        touched[0] = x0 + xres; touched[1] = x0 - 1;
+        touched[2] = y0 + yres; touched[3] = y0 - 1;
+    }
+    PixelBuffer pixels;
+    // Raster position of the tile's first pixel
+    int xStart, yStart;
+    // Raster extent {x0, x1, y0, y1}, ends included, of the pixels the
+    // samples reached. Only that part is merged and marked dirty.
+    int touched[4];
+    TargetBuffer target;
+};
+
+// Tile of a frame split across processes. Each worker renders the pixels it
+// owns plus an apron, so that the NL-means windows of its pixels see real
+// data when it drives its sampling, and writes its raw A/B buffers.
+// MergeDualTiles() then keeps the owned pixels of every tile and denoises
+// the whole frame at once, so no sample is counted twice and the filter has
+// no seams. Extents are {x0, x1, y0, y1} in raster space, ends excluded.
+struct DualTileInfo {
+    // Film resolution, the frame (crop window) extent, the pixels owned by
+    // the tile and the pixels it renders
+    int xResolution, yResolution;
+    int frame[4], owned[4], rendered[4];
+    // Denoiser of the film, run by MergeDualTiles()
+    int wnd_rad, ptc_rad;
+    float k;
+    NLMeanEngine engine;
+    DualFilmDenoiser denoiser;
+};
+
 // DualFilm Declarations
 class DualFilm : public Film {
 public:
     // ImageFilm Public Methods
     DualFilm(int xres, int yres, Filter *filt, const float crop[4],
-		const string &fn, bool openWindow, int wnd_rad, float k, int ptc_rad);
+		const string &fn, bool openWindow, int wnd_rad, float k, int ptc_rad,
+        NLMeanEngine engine = NLM_ENGINE_BOX,
+        NLMSimdLevel simd = NLMSimdSupported(),
+        DualFilmDenoiser denoiser = DENOISER_NLMEAN, bool useTiles = true,
+        const string &dumpFn = "",
+        PixelStorage storage = PIXEL_STORAGE_FLOAT);
     ~DualFilm() {
         delete filter;
         delete[] filterTable;
+        delete nlmKernel;
+        delete NLmean;
+        delete pixelsA;
+        delete pixelsB;
+        delete dirtyA;
+        delete dirtyB;
+        Mutex::Destroy(mergeMutex[0]);
+        Mutex::Destroy(mergeMutex[1]);
         //delete _denoiser;
     }
 
@@ -45,15 +103,36 @@ public:
     }
     void AddSample(const CameraSample &sample, const Spectrum &L, TargetBuffer target);
 
-    void GetSamplingMaps(int spp, int nSamples, float *samplingMapA, float *samplingMapB) const
-    {
+    // Tile accumulation, see DualFilmTile. CreateTile() returns NULL if the
+    // film doesn't use tiles.
+    DualFilmTile *CreateTile(int xstart, int xend, int ystart, int yend,
+        TargetBuffer target) const;
+    void AddSample(const CameraSample &sample, const Spectrum &L, DualFilmTile *tile);
+    void MergeTile(const DualFilmTile *tile);
+
+    // Denoise the buffers with the intermediate settings, which updates the
+    // pixel errors used by GetError() and GetSamplingMaps()
+    void UpdatePixelErrors() const {
         //_denoiser->UpdatePixelData(pixelsA, pixelsB, subPixelsA, subPixelsB, NLM_DATA_INTER);
-		    NLmean->NLFiltering(pixelsA, pixelsB, GetXPixelCount(), GetYPixelCount() );
+		    Denoise(NLM_DATA_INTER);
+    }
 
+    // UpdatePixelErrors() split so that the filtering can overlap rendering:
+    // BeginPixelErrors() snapshots the buffers and returns the filtering
+    // tasks, which may run along with tasks adding samples. EndPixelErrors()
+    // must be called once they are done.
+    void BeginPixelErrors(vector<Task *> &tasks) const;
+    void EndPixelErrors(vector<Task *> &tasks) const;
+
+    void GetSamplingMaps(int spp, int nSamples, float *samplingMapA, float *samplingMapB) const
+    {
         //_denoiser->GetSamplingMaps(spp, nSamples, samplingMapA, samplingMapB);
 		    NLmean->GetSamplingMaps(spp, nSamples, samplingMapA, samplingMapB);
     }
 
+    // Percentile of the pixel relative errors estimated by the last denoising
+    float GetError(float percentile) const { return NLmean->GetError(percentile); }
+
     void GetSampleExtent(int *xstart, int *xend, int *ystart, int *yend) const;
     void GetPixelExtent(int *xstart, int *xend, int *ystart, int *yend) const;
     void WriteImage(float splatScale);
@@ -62,6 +141,16 @@ public:
     int GetXPixelCount() const { return xPixelCount; }
     int GetYPixelCount() const { return yPixelCount; }
 
+    // Save or restore both buffers, for the checkpoints of the two-stage
+    // renderer. No samples may be added meanwhile.
+    bool WriteCheckpoint(FILE *f) const;
+    bool ReadCheckpoint(FILE *f);
+
+    // Make the film a tile of a distributed render, see DualTileInfo: the
+    // film covers the rendered pixels, and WriteImage() writes the raw
+    // buffers to 'tileFile'
+    void SetTileOutput(const string &tileFile, const int frame[4], const int owned[4]);
+
     void Finalize() const {
         //_denoiser->UpdatePixelData(pixelsA, pixelsB, subPixelsA, subPixelsB, NLM_DATA_FINAL);
     }
@@ -82,10 +171,24 @@ private:
     // stored in either buffer according to the AddSample 'target' value.
 
 	//vector<NlmeansPixel> pixelsA,   pixelsB;
-	BlockedArray<Pixel> *pixelsA, *pixelsB;
+	PixelBuffer *pixelsA, *pixelsB;
+    // Tiles of each buffer that received samples since the last denoising
+    DirtyTiles *dirtyA, *dirtyB;
+    // Serialize the tile merges of each buffer with half storage, whose
+    // updates can't be atomic
+    Mutex *mergeMutex[2];
 
 	float *filterTable;
+    bool useTiles;
+    // File the buffers are dumped to along with the image, if not empty
+    string dumpFilename;
+    // Tile output of a distributed render, written instead of the image if
+    // not empty
+    string tileFilename;
+    DualTileInfo tileInfo;
 	NLMeanFilter *NLmean;
+    // Symmetric kernel, NULL unless the "nlm-cpu" denoiser is used
+    NlmeansKernel *nlmKernel;
     // The denoiser used to filter out the noise from the rendering.
     //NlmeansDenoiser *_denoiser;
 
@@ -95,11 +198,46 @@ private:
     int subPixelRes;
    // vector<NlmeansSubPixel> subPixelsA,   subPixelsB;
 
+    // Store the normalized, filtered RGB value of each pixel in 'Lrgb', which
+    // is the input of the NL-means filter. Half buffers resolve their rows
+    // when they are read instead.
+    void ResolvePixels() const;
+
+    // Add the sample to 'pixels', whose first pixel is at raster position
+    // (xStart, yStart). Returns false, without adding anything, if the
+    // sample footprint isn't fully inside 'pixels'. The touched pixels are
+    // marked in 'dirty' unless it is NULL, and the raster extent 'touched'
+    // {x0, x1, y0, y1} is grown to include them unless it is NULL.
+    bool Accumulate(const CameraSample &sample, const Spectrum &L,
+        PixelBuffer *pixels, int xStart, int yStart, bool syncNeeded,
+        DirtyTiles *dirty, int *touched = NULL);
+
+    // Filter both buffers with the selected denoiser, update the pixel errors
+    // used by the sampling maps and return the combined rgb image, which the
+    // NLMeanFilter owns
+    float *Denoise(NlmeansData dataType) const;
+
     inline
     float sqr(float v) { return v*v; }
 };
 
 
+// The "nlm-cpu" denoising of the film: filter both buffers with 'kernel',
+// then compute the pixel errors and the combined image with 'nlmean', which
+// owns the returned image
+float *NlmKernelDenoise(NlmeansKernel *kernel, NLMeanFilter *nlmean,
+    PixelBuffer *pixelsA, PixelBuffer *pixelsB, NlmeansData dataType);
+
+// Split the frame extent into 'count' tiles as Sampler::ComputeSubWindow()
+// splits the sample extent, and return the extent of tile 'num'
+void DualTileExtent(const int frame[4], int num, int count, int extent[4]);
+
+// Assemble the tiles written by the workers of a distributed render, denoise
+// the frame and write it to 'filename', or to the film's filename if empty.
+// Returns false, after reporting the error, if the tiles don't cover the
+// frame exactly or can't be read.
+bool MergeDualTiles(const vector<string> &tileFiles, const string &filename);
+
 DualFilm *CreateDualFilm(const ParamSet &params, Filter *filter);
 
 #endif	/* DUALFILM_H */
@@ -198,38 +198,46 @@ void ImageFilm::GetPixelExtent(int *xstart, int *xend,
 }
 
 
+struct ImageFilm::ToRGB {
+    ToRGB(const ImageFilm *f, float s, float *out)
+        : film(f), splatScale(s), rgb(out) { }
+    void operator()(int x, int y) const {
+        const Pixel &pixel = (*film->pixels)(x, y);
+        float *prgb = &rgb[3 * (y * film->xPixelCount + x)];
+
+        // Convert pixel XYZ color to RGB
+        XYZToRGB(pixel.Lxyz, prgb);
+
+        // Normalize pixel with weight sum
+        float weightSum = pixel.weightSum;
+        if (weightSum != 0.f) {
+            float invWt = 1.f / weightSum;
+            prgb[0] = max(0.f, prgb[0] * invWt);
+            prgb[1] = max(0.f, prgb[1] * invWt);
+            prgb[2] = max(0.f, prgb[2] * invWt);
+        }
+
+        // Add splat value at pixel
+        float splatRGB[3];
+        XYZToRGB(pixel.splatXYZ, splatRGB);
+        prgb[0] += splatScale * splatRGB[0];
+        prgb[1] += splatScale * splatRGB[1];
+        prgb[2] += splatScale * splatRGB[2];
+    }
+    const ImageFilm *film;
+    float splatScale;
+    float *rgb;
+};
+
+
 void ImageFilm::WriteImage(float splatScale) {
     // Convert image to RGB and compute final pixel values
     int nPix = xPixelCount * yPixelCount;
     float *rgb = new float[3*nPix];
-    float *frgb = new float[3*nPix];
-    int offset = 0;
-    for (int y = 0; y < yPixelCount; ++y) {
-        for (int x = 0; x < xPixelCount; ++x) {
-            // Convert pixel XYZ color to RGB
-            XYZToRGB((*pixels)(x, y).Lxyz, &rgb[3*offset]);
-
-            // Normalize pixel with weight sum
-            float weightSum = (*pixels)(x, y).weightSum;
-            if (weightSum != 0.f) {
-                float invWt = 1.f / weightSum;
-                rgb[3*offset  ] = max(0.f, rgb[3*offset  ] * invWt);
-                rgb[3*offset+1] = max(0.f, rgb[3*offset+1] * invWt);
-                rgb[3*offset+2] = max(0.f, rgb[3*offset+2] * invWt);
-            }
-
-            // Add splat value at pixel
-            float splatRGB[3];
-            XYZToRGB((*pixels)(x, y).splatXYZ, splatRGB);
-            rgb[3*offset  ] += splatScale * splatRGB[0];
-            rgb[3*offset+1] += splatScale * splatRGB[1];
-            rgb[3*offset+2] += splatScale * splatRGB[2];
-            ++offset;
-        }
-    }
-	
+    ParallelFor2D(xPixelCount, yPixelCount, ToRGB(this, splatScale, rgb), 4096);
+
     // Write RGB image
-    ::WriteImage(filename, frgb, NULL, xPixelCount, yPixelCount,
+    ::WriteImage(filename, rgb, NULL, xPixelCount, yPixelCount,
                  xResolution, yResolution, xPixelStart, yPixelStart);
 
     // Release temporary image memory
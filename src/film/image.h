@@ -78,6 +78,8 @@ private:
     };
     BlockedArray<Pixel> *pixels;
     float *filterTable;
+    // Final value of a pixel, the WriteImage() loop body
+    struct ToRGB;
 
     string filtername;
 };
@@ -37,6 +37,326 @@
 #include "paramset.h"
 #include "math.h"
 #include "filters/gaussian.h"
+#include "parallel.h"
+#include "memory.h"
+#include <algorithm>
+#include <functional>
+
+
+// fp16 conversions of the half PixelBuffer storage, using the half type of
+// OpenEXR. DualFilm only asks for half storage when it's available.
+#ifdef PBRT_HAS_OPENEXR
+#include <half.h>
+
+static inline float HalfToFloat(uint16_t bits) {
+    half h;
+    h.setBits(bits);
+    return h;
+}
+
+
+static inline uint16_t FloatToHalf(float v) {
+    return half(Clamp(v, -HALF_MAX, HALF_MAX)).bits();
+}
+#else
+static inline float HalfToFloat(uint16_t bits) {
+    Severe("Half PixelBuffer storage needs OpenEXR support");
+    return 0.f;
+}
+
+
+static inline uint16_t FloatToHalf(float v) {
+    Severe("Half PixelBuffer storage needs OpenEXR support");
+    return 0;
+}
+#endif
+
+
+// PixelBuffer Method Definitions
+PixelBuffer::PixelBuffer(int xres, int yres, PixelStorage storage)
+    : storage(storage) {
+    xPixelCount = xres;
+    yPixelCount = yres;
+    nPix = xPixelCount * yPixelCount;
+
+    // All the planes share one allocation, with each plane padded to a
+    // multiple of the cache line size
+    for (int c = 0; c < 3; ++c)
+        Lxyz[c] = Lrgb[c] = LrgbSumBox[c] = LrgbSumSqrBox[c] = NULL;
+    weightSum = NULL;
+    for (int c = 0; c < 3; ++c)
+        xyzMean[c] = boxMean[c] = boxVar[c] = NULL;
+    if (storage == PIXEL_STORAGE_FLOAT) {
+        int lineFloats = PBRT_L1_CACHE_LINE_SIZE / sizeof(float);
+        stride = (nPix + lineFloats - 1) / lineFloats * lineFloats;
+        bytes = 14 * stride * sizeof(float);
+        float *plane = AllocAligned<float>(14 * stride);
+        data = plane;
+        for (int c = 0; c < 3; ++c) { Lxyz[c] = plane; plane += stride; }
+        weightSum = plane; plane += stride;
+        for (int c = 0; c < 3; ++c) { Lrgb[c] = plane; plane += stride; }
+        nSamplesBox = (int *)plane; plane += stride;
+        for (int c = 0; c < 3; ++c) { LrgbSumBox[c] = plane; plane += stride; }
+        for (int c = 0; c < 3; ++c) { LrgbSumSqrBox[c] = plane; plane += stride; }
+    }
+    else {
+        // The 32-bit planes follow the fp16 ones
+        int lineHalfs = PBRT_L1_CACHE_LINE_SIZE / sizeof(uint16_t);
+        stride = (nPix + lineHalfs - 1) / lineHalfs * lineHalfs;
+        bytes = 9 * stride * sizeof(uint16_t) + stride * (sizeof(float) + sizeof(int));
+        uint16_t *plane = AllocAligned<uint16_t>(bytes / sizeof(uint16_t));
+        data = plane;
+        for (int c = 0; c < 3; ++c) { xyzMean[c] = plane; plane += stride; }
+        for (int c = 0; c < 3; ++c) { boxMean[c] = plane; plane += stride; }
+        for (int c = 0; c < 3; ++c) { boxVar[c] = plane; plane += stride; }
+        weightSum = (float *)plane;
+        nSamplesBox = (int *)(weightSum + stride);
+    }
+    Clear();
+}
+
+
+PixelBuffer::~PixelBuffer() {
+    FreeAligned(data);
+}
+
+
+void PixelBuffer::Clear() {
+    // Zero bits are 0 in both precisions
+    memset(data, 0, bytes);
+}
+
+
+const float *PixelBuffer::LrgbRow(int c, int y, float *scratch) const {
+    int offset = y * xPixelCount;
+    if (storage == PIXEL_STORAGE_FLOAT)
+        return Lrgb[c] + offset;
+    // Same as DualFilm::ResolvePixels(), on the stored means
+    for (int x = 0; x < xPixelCount; ++x) {
+        float xyz[3], rgb[3];
+        for (int i = 0; i < 3; ++i)
+            xyz[i] = HalfToFloat(xyzMean[i][offset + x]);
+        XYZToRGB(xyz, rgb);
+        scratch[x] = max(0.f, rgb[c]);
+    }
+    return scratch;
+}
+
+
+const float *PixelBuffer::SumRow(int c, int y, float *scratch) const {
+    int offset = y * xPixelCount;
+    if (storage == PIXEL_STORAGE_FLOAT)
+        return LrgbSumBox[c] + offset;
+    for (int x = 0; x < xPixelCount; ++x)
+        scratch[x] = nSamplesBox[offset + x] * HalfToFloat(boxMean[c][offset + x]);
+    return scratch;
+}
+
+
+const float *PixelBuffer::SumSqrRow(int c, int y, float *scratch) const {
+    int offset = y * xPixelCount;
+    if (storage == PIXEL_STORAGE_FLOAT)
+        return LrgbSumSqrBox[c] + offset;
+    for (int x = 0; x < xPixelCount; ++x) {
+        float mean = HalfToFloat(boxMean[c][offset + x]);
+        float var = HalfToFloat(boxVar[c][offset + x]);
+        scratch[x] = nSamplesBox[offset + x] * (var + mean * mean);
+    }
+    return scratch;
+}
+
+
+void PixelBuffer::AddFiltered(int pix, const float xyz[3], float wt) {
+    if (storage == PIXEL_STORAGE_FLOAT) {
+        for (int c = 0; c < 3; ++c)
+            Lxyz[c][pix] += xyz[c];
+        weightSum[pix] += wt;
+        return;
+    }
+    float oldWt = weightSum[pix], newWt = oldWt + wt;
+    float invWt = (newWt != 0.f) ? 1.f / newWt : 0.f;
+    for (int c = 0; c < 3; ++c)
+        xyzMean[c][pix] = FloatToHalf((HalfToFloat(xyzMean[c][pix]) * oldWt + xyz[c]) * invWt);
+    weightSum[pix] = newWt;
+}
+
+
+void PixelBuffer::AddBox(int pix, int n, const float sum[3], const float sumSqr[3]) {
+    if (storage == PIXEL_STORAGE_FLOAT) {
+        for (int c = 0; c < 3; ++c) {
+            LrgbSumBox[c][pix] += sum[c];
+            LrgbSumSqrBox[c][pix] += sumSqr[c];
+        }
+        nSamplesBox[pix] += n;
+        return;
+    }
+    // Pairwise update of the mean and of the sum of squared deviations, the
+    // new samples being small enough in number for their float sums
+    int nOld = nSamplesBox[pix], nNew = nOld + n;
+    for (int c = 0; c < 3; ++c) {
+        float oldMean = HalfToFloat(boxMean[c][pix]);
+        float oldM2 = HalfToFloat(boxVar[c][pix]) * nOld;
+        float mean = sum[c] / n;
+        float m2 = max(0.f, sumSqr[c] - sum[c] * mean);
+        float delta = mean - oldMean;
+        boxMean[c][pix] = FloatToHalf(oldMean + delta * n / nNew);
+        boxVar[c][pix] = FloatToHalf((oldM2 + m2 + delta * delta * nOld * n / nNew) / nNew);
+    }
+    nSamplesBox[pix] = nNew;
+}
+
+
+bool PixelBuffer::Write(FILE *f) const {
+    if (storage == PIXEL_STORAGE_FLOAT) {
+        for (int p = 0; p < 14; ++p)
+            if (fwrite((float *)data + p * stride, sizeof(float), nPix, f) != (size_t)nPix)
+                return false;
+        return true;
+    }
+    // Same planes as the float storage, converted row by row
+    float *row = new float[xPixelCount];
+    bool ok = true;
+    for (int p = 0; p < 14 && ok; ++p) {
+        for (int y = 0; y < yPixelCount && ok; ++y) {
+            int offset = y * xPixelCount;
+            const void *src = row;
+            if (p < 3)
+                for (int x = 0; x < xPixelCount; ++x)
+                    row[x] = HalfToFloat(xyzMean[p][offset + x]) * weightSum[offset + x];
+            else if (p == 3)
+                src = weightSum + offset;
+            else if (p < 7)
+                LrgbRow(p - 4, y, row);
+            else if (p == 7)
+                src = SamplesRow(y);
+            else if (p < 11)
+                SumRow(p - 8, y, row);
+            else
+                SumSqrRow(p - 11, y, row);
+            ok = fwrite(src, sizeof(float), xPixelCount, f) == (size_t)xPixelCount;
+        }
+    }
+    delete[] row;
+    return ok;
+}
+
+
+bool PixelBuffer::Read(FILE *f) {
+    if (storage == PIXEL_STORAGE_FLOAT) {
+        for (int p = 0; p < 14; ++p)
+            if (fread((float *)data + p * stride, sizeof(float), nPix, f) != (size_t)nPix)
+                return false;
+        return true;
+    }
+    // Read the float planes, then add them to the cleared buffer
+    PixelBuffer planes(xPixelCount, yPixelCount);
+    if (!planes.Read(f))
+        return false;
+    Clear();
+    for (int pix = 0; pix < nPix; ++pix) {
+        float xyz[3], sum[3], sumSqr[3];
+        for (int c = 0; c < 3; ++c) {
+            xyz[c] = planes.Lxyz[c][pix];
+            sum[c] = planes.LrgbSumBox[c][pix];
+            sumSqr[c] = planes.LrgbSumSqrBox[c][pix];
+        }
+        AddFiltered(pix, xyz, planes.weightSum[pix]);
+        if (planes.nSamplesBox[pix] > 0)
+            AddBox(pix, planes.nSamplesBox[pix], sum, sumSqr);
+    }
+    return true;
+}
+
+
+// The dump starts with a magic string, a version number and the resolution,
+// followed by the planes of buffer A and then of buffer B, in native byte
+// order
+static const char DUAL_BUFFERS_MAGIC[8] = { 'P', 'B', 'R', 'T', 'D', 'U', 'A', 'L' };
+static const int32_t DUAL_BUFFERS_VERSION = 1;
+
+bool WriteDualBuffers(const string &filename, const PixelBuffer *pixelsA,
+        const PixelBuffer *pixelsB) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("Unable to open \"%s\" to dump the film buffers", filename.c_str());
+        return false;
+    }
+    int32_t header[3] = { DUAL_BUFFERS_VERSION, pixelsA->xPixelCount, pixelsA->yPixelCount };
+    bool ok = fwrite(DUAL_BUFFERS_MAGIC, 1, 8, f) == 8 &&
+              fwrite(header, sizeof(int32_t), 3, f) == 3 &&
+              pixelsA->Write(f) && pixelsB->Write(f);
+    if (fclose(f) != 0) ok = false;
+    if (!ok)
+        Error("Error writing the film buffers to \"%s\"", filename.c_str());
+    return ok;
+}
+
+
+bool ReadDualBuffers(const string &filename, PixelBuffer **pixelsA,
+        PixelBuffer **pixelsB) {
+    *pixelsA = *pixelsB = NULL;
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Error("Unable to open film buffers \"%s\"", filename.c_str());
+        return false;
+    }
+    char magic[8];
+    int32_t header[3];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, DUAL_BUFFERS_MAGIC, 8) != 0 ||
+        fread(header, sizeof(int32_t), 3, f) != 3 ||
+        header[0] != DUAL_BUFFERS_VERSION || header[1] <= 0 || header[2] <= 0) {
+        Error("\"%s\" isn't a film buffer dump", filename.c_str());
+        fclose(f);
+        return false;
+    }
+    PixelBuffer *a = new PixelBuffer(header[1], header[2]);
+    PixelBuffer *b = new PixelBuffer(header[1], header[2]);
+    bool ok = a->Read(f) && b->Read(f);
+    fclose(f);
+    if (!ok) {
+        Error("Error reading the film buffers from \"%s\"", filename.c_str());
+        delete a;
+        delete b;
+        return false;
+    }
+    *pixelsA = a;
+    *pixelsB = b;
+    return true;
+}
+
+
+// DirtyTiles Method Definitions
+DirtyTiles::DirtyTiles(int xres, int yres, int tileSize)
+    : tileSize(tileSize) {
+    xTiles = (xres + tileSize - 1) / tileSize;
+    yTiles = (yres + tileSize - 1) / tileSize;
+    dirty = new AtomicInt32[xTiles * yTiles];
+    MarkAll();
+}
+
+
+void DirtyTiles::Mark(int x0, int y0, int x1, int y1) {
+    int tx0 = max(0, x0 / tileSize), tx1 = min(xTiles - 1, x1 / tileSize);
+    int ty0 = max(0, y0 / tileSize), ty1 = min(yTiles - 1, y1 / tileSize);
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            // Only write when needed, most samples land in dirty tiles
+            AtomicInt32 &d = dirty[tx + ty * xTiles];
+            if (!d) d = 1;
+        }
+}
+
+
+void DirtyTiles::MarkAll() {
+    for (int t = 0; t < xTiles * yTiles; ++t)
+        dirty[t] = 1;
+}
+
+
+void DirtyTiles::Clear() {
+    for (int t = 0; t < xTiles * yTiles; ++t)
+        dirty[t] = 0;
+}
 
 
 // NLMean Filter Method Definitions
@@ -44,163 +364,541 @@ float NLMeanFilter::Evaluate(float x, float y) const {
     return 1.f;
 }
 
-float* NLMeanFilter::NLFiltering(BlockedArray<Pixel> *pixelsA, BlockedArray<Pixel> *pixelsB, int xPixelCount, int yPixelCount){
+// NLMeanTask Declarations
+class NLMeanTask : public Task {
+public:
+    NLMeanTask(NLMeanFilter *flt, NLMeanPass p, int b, int x0, int x1, int y0, int y1)
+        : filter(flt), pass(p), buffer(b), xStart(x0), xEnd(x1), yStart(y0), yEnd(y1) { }
+    void Run() {
+        filter->RunPass(pass, buffer, xStart, xEnd, yStart, yEnd);
+    }
+private:
+    NLMeanFilter *filter;
+    NLMeanPass pass;
+    int buffer, xStart, xEnd, yStart, yEnd;
+};
+
+
+void NLMeanFilter::RunPass(NLMeanPass pass, int buffer, int xStart, int xEnd, int yStart, int yEnd) {
+	switch (pass) {
+	case NLM_PASS_GATHER:
+		GatherRows(_pixels[buffer], _xPixelCount, _yPixelCount, yStart, yEnd, _rgb[buffer], _var[buffer],
+			_samples[buffer]);
+		break;
+	case NLM_PASS_FILTER:
+		if (engine == NLM_ENGINE_BRUTE)
+			CalRows(_rgb[buffer], _var[buffer], _xPixelCount, _yPixelCount,
+				xStart, xEnd, yStart, yEnd, _flt[buffer]);
+		else
+			CalBoxRows(_rgb[buffer], _var[buffer], _xPixelCount, _yPixelCount,
+				xStart, xEnd, yStart, yEnd, _flt[buffer]);
+		break;
+	case NLM_PASS_COMBINE:
+		CombineRows(yStart, yEnd);
+		break;
+	case NLM_PASS_MAP_INIT:
+	case NLM_PASS_MAP_HISTOGRAM:
+	case NLM_PASS_MAP_APPLY:
+		MapRows(pass, yStart, yEnd);
+		break;
+	}
+}
+
+
+void NLMeanFilter::PassTasks(NLMeanPass pass, int nBuffers, int minRows, vector<Task *> &tasks) {
+	// Split the image in row bands, with enough bands per buffer to keep all
+	// the cores busy, but no band thinner than 'minRows'
+	int nBands = min(4 * NumSystemCores(), _yPixelCount / max(1, minRows));
+	nBands = max(1, nBands);
+	int bandRows = (_yPixelCount + nBands - 1) / nBands;
+	_bandRows = bandRows;
+	_nBands = (_yPixelCount + bandRows - 1) / bandRows;
+
+	for (int b = 0; b < nBuffers; b++)
+		for (int y = 0; y < _yPixelCount; y += bandRows)
+			tasks.push_back(new NLMeanTask(this, pass, b, 0, _xPixelCount, y, min(y + bandRows, _yPixelCount)));
+}
+
+
+void NLMeanFilter::RunPassParallel(NLMeanPass pass, int nBuffers, int minRows) {
+	vector<Task *> tasks;
+	PassTasks(pass, nBuffers, minRows, tasks);
+	EnqueueTasks(tasks);
+	WaitForAllTasks();
+	for (uint32_t i = 0; i < tasks.size(); ++i)
+		delete tasks[i];
+}
+
+
+NLMeanFilter::~NLMeanFilter() {
+	FreeAligned(_work);
+}
+
+
+void NLMeanFilter::Reserve(int xPixelCount, int yPixelCount) {
+	if (_work && _workXRes == xPixelCount && _workYRes == yPixelCount)
+		return;
+	FreeAligned(_work);
+
+	// Interleaved or planar rgb images, each padded to a multiple of the
+	// cache line size: the gathered values and variances and the filtered
+	// values of both buffers, the combined image and the buffer variances;
+	// then the two pixel error images and the gathered sample counts, which
+	// have the size of a float
+	int nPix = xPixelCount * yPixelCount;
+	int lineFloats = PBRT_L1_CACHE_LINE_SIZE / sizeof(float);
+	int stride3 = (3*nPix + lineFloats - 1) / lineFloats * lineFloats;
+	int stride1 = (nPix + lineFloats - 1) / lineFloats * lineFloats;
+	_work = AllocAligned<float>(9 * stride3 + 4 * stride1);
+	_workBytes = (9 * stride3 + 4 * stride1) * sizeof(float);
+	float *plane = _work;
+	for (int b = 0; b < 2; b++) {
+		_rgb[b] = plane; plane += stride3;
+		_var[b] = plane; plane += stride3;
+		_cache[b] = plane; plane += stride3;
+	}
+	_out = plane; plane += stride3;
+	ImgVar_A = plane; plane += stride3;
+	ImgVar_B = plane; plane += stride3;
+	ImgErr_A = plane; plane += stride1;
+	ImgErr_B = plane; plane += stride1;
+	for (int b = 0; b < 2; b++) {
+		_samples[b] = (int *)plane; plane += stride1;
+	}
+
+	_workXRes = xPixelCount;
+	_workYRes = yPixelCount;
+	_cacheValid = false;
+	Info("NL-means workspace: %.1f MB for %dx%d pixels", _workBytes / (1024.f * 1024.f),
+		xPixelCount, yPixelCount);
+}
+
+
+void NLMeanFilter::AddScratch(int32_t bytes) {
+	int32_t cur = AtomicAdd(&_scratchBytes, bytes);
+	for (int32_t peak = _scratchPeak; cur > peak; peak = _scratchPeak)
+		if (AtomicCompareAndSwap(&_scratchPeak, cur, peak) == peak)
+			break;
+}
+
+
+void NLMeanFilter::ReportMemory() const {
+	size_t mapBytes = (_mapIn.capacity() + _mapTmp.capacity() + _mapOut.capacity() +
+		_bandMax.capacity()) * sizeof(float) + _histCount.capacity() * sizeof(uint32_t) +
+		_histSum.capacity() * sizeof(double);
+	float steady = (_workBytes + mapBytes) / (1024.f * 1024.f);
+	Info("NL-means memory: %.1f MB steady, %.1f MB peak",
+		steady, steady + _scratchPeak / (1024.f * 1024.f));
+}
+
+
+float* NLMeanFilter::NLFiltering(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+	const DirtyTiles *dirtyA, const DirtyTiles *dirtyB){
+
+	vector<Task *> tasks;
+	BeginFiltering(pixelsA, pixelsB, xPixelCount, yPixelCount, dirtyA, dirtyB, tasks);
+	EnqueueTasks(tasks);
+	WaitForAllTasks();
+	return EndFiltering(tasks);
+}
+
+
+void NLMeanFilter::BeginFiltering(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+	const DirtyTiles *dirtyA, const DirtyTiles *dirtyB, vector<Task *> &tasks){
 
 	int nPix = xPixelCount * yPixelCount;
 	this->nPixs = nPix;
 	this->_xPixelCount = xPixelCount;
 	this->_yPixelCount = yPixelCount;
 
-	float *rgbA , *rgbB;
-	float *out = new float[nPix];
+	// The filtered buffers of the previous call can only be reused if the
+	// workspace wasn't reallocated since
+	Reserve(xPixelCount, yPixelCount);
+	bool cacheValid = _cacheValid;
+	_cacheValid = true;
+
+	_pixels[0] = pixelsA;
+	_pixels[1] = pixelsB;
+	for (int b = 0; b < 2; b++)
+		_flt[b] = _cache[b];
+
+	// Both buffers are filtered concurrently. The box engine recomputes the
+	// patch apron above and below each band, so its bands are kept a few
+	// patch radii high to bound that overhead.
+	// The filter pass only reads these copies and the Lrgb values, so the
+	// buffers can take new samples while it runs
+	RunPassParallel(NLM_PASS_GATHER, 2, 1);
+	const DirtyTiles *dirty[2] = { dirtyA, dirtyB };
+	if (!cacheValid || !dirtyA || !dirtyB || !RefilterTasks(dirty, tasks)) {
+		int minRows = (engine == NLM_ENGINE_BOX) ? max(16, 4*(int)r) : 1;
+		PassTasks(NLM_PASS_FILTER, 2, minRows, tasks);
+	}
+}
+
 
-	rgbA = Cal(pixelsA, xPixelCount, yPixelCount);
-	rgbB = Cal(pixelsB, xPixelCount, yPixelCount);
+float *NLMeanFilter::EndFiltering(vector<Task *> &tasks){
+	for (uint32_t i = 0; i < tasks.size(); ++i)
+		delete tasks[i];
+	tasks.clear();
+
+	// The buffers kept taking samples since BeginFiltering(), so the errors
+	// and the combination weights come from the counts gathered with the
+	// values that were filtered
+	_flt[0] = _cache[0];
+	_flt[1] = _cache[1];
+	_n[0] = _samples[0];
+	_n[1] = _samples[1];
+	RunPassParallel(NLM_PASS_COMBINE, 1, 1);
+	return _out;
+}
 
-	ImgVar_A = new float[nPix*3];
-	ImgVar_B = new float[nPix*3];
-	ImgErr_A = new float[nPix*3];
-	ImgErr_B = new float[nPix*3];
 
-	 // Compute observed variance
-    for (int i = 0; i < nPix*3; i++) {
-		float vv = pow((rgbA[i] - rgbB[i]), 2);
-		if(vv != 0)
+bool NLMeanFilter::RefilterTasks(const DirtyTiles *dirty[2], vector<Task *> &tasks) {
+	// A filtered pixel depends on the input pixels within the search window
+	// radius plus the patch radius, so the dirty tiles are dilated by that
+	// reach to get the tiles to refilter
+	int tileSize = dirty[0]->tileSize;
+	int xTiles = dirty[0]->xTiles, yTiles = dirty[0]->yTiles;
+	int reach = ((int)f + (int)r + tileSize - 1) / tileSize;
+	vector<char> refilter(2 * xTiles * yTiles, 0);
+	int nRefilter = 0;
+	for (int b = 0; b < 2; b++)
+	{
+		for (int ty = 0; ty < yTiles; ty++)
 		{
-			std::printf("%f  ///////// \n",vv);
+			for (int tx = 0; tx < xTiles; tx++)
+			{
+				bool hit = false;
+				for (int uy = max(0, ty - reach); uy <= min(yTiles - 1, ty + reach) && !hit; uy++)
+					for (int ux = max(0, tx - reach); ux <= min(xTiles - 1, tx + reach) && !hit; ux++)
+						hit = dirty[b]->IsDirty(ux, uy);
+				if (hit) {
+					refilter[tx + (ty + b*yTiles)*xTiles] = 1;
+					nRefilter++;
+				}
+			}
 		}
+	}
+
+	// Small rectangles have a relatively larger apron to recompute, so the
+	// whole image is filtered when more than half of it is dirty
+	if (nRefilter > xTiles * yTiles) {
+		Info("NL-means refresh: %d of %d tiles dirty, filtering the whole image",
+			nRefilter, 2 * xTiles * yTiles);
+		return false;
+	}
+	Info("NL-means refresh: refiltering %d of %d tiles", nRefilter, 2 * xTiles * yTiles);
+
+	// One task per horizontal run of tiles to refilter
+	for (int b = 0; b < 2; b++)
+	{
+		for (int ty = 0; ty < yTiles; ty++)
+		{
+			const char *row = &refilter[(ty + b*yTiles)*xTiles];
+			for (int tx = 0; tx < xTiles; )
+			{
+				if (!row[tx]) { tx++; continue; }
+				int tx1 = tx;
+				while (tx1 < xTiles && row[tx1]) tx1++;
+				tasks.push_back(new NLMeanTask(this, NLM_PASS_FILTER, b,
+					tx * tileSize, min(tx1 * tileSize, _xPixelCount),
+					ty * tileSize, min((ty + 1) * tileSize, _yPixelCount)));
+				tx = tx1;
+			}
+		}
+	}
+	return true;
+}
+
+
+float *NLMeanFilter::Combine(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+	float *fltA, float *fltB){
 
+	int nPix = xPixelCount * yPixelCount;
+	this->nPixs = nPix;
+	this->_xPixelCount = xPixelCount;
+	this->_yPixelCount = yPixelCount;
+
+	Reserve(xPixelCount, yPixelCount);
+	_pixels[0] = pixelsA;
+	_pixels[1] = pixelsB;
+	_flt[0] = fltA;
+	_flt[1] = fltB;
+	_n[0] = pixelsA->nSamplesBox;
+	_n[1] = pixelsB->nSamplesBox;
+
+	RunPassParallel(NLM_PASS_COMBINE, 1, 1);
+
+	return _out;
+}
+
+
+void NLMeanFilter::CombineRows(int yStart, int yEnd) {
+	float *rgbA = _flt[0], *rgbB = _flt[1];
+	int xPixelCount = _xPixelCount;
+
+	 // Compute observed variance
+    for (int i = 3*yStart*xPixelCount; i < 3*yEnd*xPixelCount; i++) {
+		float vv = pow((rgbA[i] - rgbB[i]), 2);
         ImgVar_A[i] = 2.f * vv / (1e-3f + pow(rgbA[i], 2));
         ImgVar_B[i] = 2.f * vv / (1e-3f + pow(rgbB[i], 2));
     }
 
     // Update the pixel costs
-	UpdateError(ImgVar_A, pixelsA, ImgErr_A);
-	UpdateError(ImgVar_B, pixelsB, ImgErr_B);
+	UpdateError(ImgVar_A, _n[0], ImgErr_A, yStart, yEnd);
+	UpdateError(ImgVar_B, _n[1], ImgErr_B, yStart, yEnd);
 
-	for(int j =0; j < yPixelCount ; j++){
+	float *out = _out;
+	for(int j = yStart; j < yEnd ; j++){
+		const int *nA = _n[0] + j*xPixelCount, *nB = _n[1] + j*xPixelCount;
 		for(int i =0; i < xPixelCount; i++){
 			int index = i + j*xPixelCount;
-			out[index*3   ] = (rgbA[index*3   ] * (*pixelsA)(i, j)._nSamplesBox + rgbB[index*3   ] * (*pixelsB)(i, j)._nSamplesBox) / ((*pixelsA)(i, j)._nSamplesBox + (*pixelsB)(i, j)._nSamplesBox);
-			out[index*3 +1] = (rgbA[index*3 +1] * (*pixelsA)(i, j)._nSamplesBox + rgbB[index*3 +1] * (*pixelsB)(i, j)._nSamplesBox) / ((*pixelsA)(i, j)._nSamplesBox + (*pixelsB)(i, j)._nSamplesBox);
-			out[index*3 +2] = (rgbA[index*3 +2] * (*pixelsA)(i, j)._nSamplesBox + rgbB[index*3 +2] * (*pixelsB)(i, j)._nSamplesBox) / ((*pixelsA)(i, j)._nSamplesBox + (*pixelsB)(i, j)._nSamplesBox);
+			out[index*3   ] = (rgbA[index*3   ] * nA[i] + rgbB[index*3   ] * nB[i]) / (nA[i] + nB[i]);
+			out[index*3 +1] = (rgbA[index*3 +1] * nA[i] + rgbB[index*3 +1] * nB[i]) / (nA[i] + nB[i]);
+			out[index*3 +2] = (rgbA[index*3 +2] * nA[i] + rgbB[index*3 +2] * nB[i]) / (nA[i] + nB[i]);
 		}
 	}
-
-	return out;
 }
 
 
-void NLMeanFilter::UpdateError(float *ImgVar, BlockedArray<Pixel> *pixels, float *ImgErr){
+void NLMeanFilter::UpdateError(float *ImgVar, const int *nSamples, float *ImgErr, int yStart, int yEnd){
 
-	for (int pix = 0; pix < nPixs; pix++) {
+	for (int pix = yStart*_xPixelCount; pix < yEnd*_xPixelCount; pix++) {
         /*fltErr[pix]._pix = pix;
         */
         // The pixel error
         float pixel_error = (ImgVar[pix*3] + ImgVar[pix*3 +1] + ImgVar[pix*3 +2]) / 3.f;
 
         // Set the pixel error info
-		ImgErr[pix] = pixel_error / (*pixels)(pix%_xPixelCount, pix/_xPixelCount)._nSamplesBox;
+		ImgErr[pix] = pixel_error / nSamples[pix];
 
     }
 }
 
-void NLMeanFilter::GetSamplingMaps(int spp, int nSamples, float *mapA, float *mapB) {
-    // Initialize the sampling maps using the pixel costs
-    //mapA.resize(_nPix);
-	//mapB.resize(_nPix);
+// Pixels without samples have an undefined error, count them as the worst
+// ones
+struct SumErrors {
+	SumErrors(const float *a, const float *b, float *out) : errA(a), errB(b), err(out) { }
+	void operator()(int pix) const {
+		err[pix] = errA[pix] + errB[pix];
+		if (isnan(err[pix]))
+			err[pix] = INFINITY;
+	}
+	const float *errA, *errB;
+	float *err;
+};
+
+float NLMeanFilter::GetError(float percentile) const {
+	vector<float> err(nPixs);
+	ParallelFor(nPixs, SumErrors(ImgErr_A, ImgErr_B, &err[0]), 4096);
+	int n = Clamp(Ceil2Int(percentile / 100.f * nPixs) - 1, 0, nPixs - 1);
+	nth_element(err.begin(), err.begin() + n, err.end());
+	return err[n];
+}
 
-    for (int pix = 0; pix < nPixs; pix++) {
-        mapA[pix] = ImgErr_A[pix] + ImgErr_B[pix];
-    }
+// Replaces the errors that aren't finite
+struct ReplaceUndefined {
+	ReplaceUndefined(float *v, float r) : vals(v), replacement(r) { }
+	void operator()(int pix) const {
+		if (!(vals[pix] < INFINITY))
+			vals[pix] = replacement;
+	}
+	float *vals;
+	float replacement;
+};
+
+// The sampling map is solved with a histogram of the error values. For
+// non-negative floats, the bit pattern is monotonic in the value, so its top
+// bits (exponent and 4 mantissa bits) give bins no wider than 1/16 of their
+// lower bound.
+static const int NLM_MAP_BIN_SHIFT = 19;
+static const int NLM_MAP_BINS = 1 << (32 - NLM_MAP_BIN_SHIFT - 1);
+
+static inline int MapBin(float v) {
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(float));
+	return bits >> NLM_MAP_BIN_SHIFT;
+}
+
+static inline float MapBinUpper(int bin) {
+	uint32_t bits = (uint32_t(bin) << NLM_MAP_BIN_SHIFT) | ((1u << NLM_MAP_BIN_SHIFT) - 1);
+	float v;
+	memcpy(&v, &bits, sizeof(float));
+	return v;
+}
 
-    // Blur the maps a little
-    //Gauss2D gauss(.8f, KERNEL_NORM_UNIT);
-    //gauss.Apply(_xPixelCount, _yPixelCount, mapA, _tmpMap, mapA);
 
-    // Normalize them to sum up to nSamples/2 each
-    //float sumA = accumulate(mapA.begin(), mapA.end(), 0.f);
-	float sumA = 0.0f;
-	for (int index = 0; index < nPixs; index++ )
-	{
-		sumA += mapA[index];
+void NLMeanFilter::MapRows(NLMeanPass pass, int yStart, int yEnd) {
+	int band = yStart / _bandRows;
+	int pixStart = yStart * _xPixelCount, pixEnd = yEnd * _xPixelCount;
+	switch (pass) {
+	case NLM_PASS_MAP_INIT: {
+		// Initialize the map using the pixel costs, and find the largest
+		// finite one
+		float maxErr = 0.f;
+		for (int pix = pixStart; pix < pixEnd; pix++) {
+			float e = ImgErr_A[pix] + ImgErr_B[pix];
+			_mapIn[pix] = e;
+			if (e > maxErr && e < INFINITY)
+				maxErr = e;
+		}
+		_bandMax[band] = maxErr;
+		break;
+	}
+	case NLM_PASS_MAP_HISTOGRAM: {
+		uint32_t *count = &_histCount[band * NLM_MAP_BINS];
+		double *sum = &_histSum[band * NLM_MAP_BINS];
+		memset(count, 0, NLM_MAP_BINS * sizeof(uint32_t));
+		memset(sum, 0, NLM_MAP_BINS * sizeof(double));
+		for (int pix = pixStart; pix < pixEnd; pix++) {
+			float e = _mapOut[pix];
+			if (e > 0.f) {
+				int bin = MapBin(e);
+				count[bin]++;
+				sum[bin] += e;
+			}
+		}
+		break;
 	}
+	case NLM_PASS_MAP_APPLY:
+		for (int pix = pixStart; pix < pixEnd; pix++) {
+			float e = _mapOut[pix];
+			float m = e > 0.f ? float(min(_mapScale * e, double(_mapLim))) : _mapZero;
+			_map[pix] = m;
+		}
+		break;
+	default:
+		break;
+	}
+}
 
-    float nSamplesA = nSamples / 2.f;
-    for (int pix = 0; pix < nPixs; pix++) {
-        mapA[pix] *= nSamplesA / sumA;
-    }
 
-    // Clamp the map to "lim" samples per pixel max. "lim" is set to spp-1, so
-    // that, even with error propagation, no more than spp can be picked
-    int nPixOver1, nPixOver2;
-    int lim = spp;
-    do {
-        nPixOver1 = 0;
-        for (int pix = 0; pix < nPixs; pix++) {
-            if (mapA[pix] > lim) {
-                mapA[pix] = lim;
-                nPixOver1 += 1;
-            }
-        }
-        // Redistribute the remaining budget over the map
-        nPixOver2 = 0;
-        //float distributed = accumulate(mapA.begin(), mapA.end(), 0.f);
-		float distributed = 0.0f;
-		for (int index = 0; index < nPixs; index++ )
-		{
-			distributed += mapA[index];
+void NLMeanFilter::GetSamplingMaps(int spp, int nSamples, float *mapA, float *mapB) {
+	// Initialize the sampling maps using the pixel costs
+	_mapIn.resize(nPixs);
+	_mapTmp.resize(nPixs);
+	_mapOut.resize(nPixs);
+	int maxBands = max(1, min(4 * NumSystemCores(), _yPixelCount));
+	_bandMax.resize(maxBands);
+	RunPassParallel(NLM_PASS_MAP_INIT, 1, 1);
+
+	// Pixels with an undefined error (e.g. without samples) count as the
+	// worst finite ones, so that they don't spread NaNs through the blur
+	float maxErr = 0.f;
+	for (int b = 0; b < _nBands; b++)
+		maxErr = max(maxErr, _bandMax[b]);
+	ParallelFor(nPixs, ReplaceUndefined(&_mapIn[0], maxErr), 4096);
+
+	// Blur the maps a little
+	Gauss2D gauss(.8f, KERNEL_NORM_UNIT);
+	gauss.Apply(_xPixelCount, _yPixelCount, _mapIn, _mapTmp, _mapOut);
+
+	// Histogram the blurred map, one histogram per band
+	_histCount.resize(maxBands * NLM_MAP_BINS);
+	_histSum.resize(maxBands * NLM_MAP_BINS);
+	RunPassParallel(NLM_PASS_MAP_HISTOGRAM, 1, 1);
+	for (int b = 1; b < _nBands; b++) {
+		const uint32_t *count = &_histCount[b * NLM_MAP_BINS];
+		const double *sum = &_histSum[b * NLM_MAP_BINS];
+		for (int bin = 0; bin < NLM_MAP_BINS; bin++) {
+			_histCount[bin] += count[bin];
+			_histSum[bin] += sum[bin];
 		}
+	}
+	double total = 0.;
+	int nPos = 0;
+	for (int bin = 0; bin < NLM_MAP_BINS; bin++) {
+		total += _histSum[bin];
+		nPos += _histCount[bin];
+	}
 
-        float scale = (nSamplesA-nPixOver1*lim)/(distributed-nPixOver1*lim);
-        if (scale < 0) {
-            Severe("Negative scale in sample redistribution!");
-        }
-        for (int pix = 0; pix < nPixs; pix++) {
-            if (mapA[pix] < lim)
-                mapA[pix] *= scale;
+	// Scale the map to sum up to nSamples/2, clamped to "lim" samples per
+	// pixel max. With 'scale' the solution, the pixels above lim/scale are
+	// clamped and the remaining budget goes to the others:
+	//   nClamped * lim + scale * sum(unclamped) = nSamples/2
+	double nSamplesA = nSamples / 2.;
+	int lim = spp;
+	_mapLim = lim;
+	_mapZero = 0.f;
+	if (total <= 0.) {
+		// Nothing to go by, sample uniformly
+		_mapScale = 0.;
+		_mapZero = min(float(lim), float(nSamplesA / nPixs));
+	}
+	else if (nSamplesA >= double(nPos) * lim) {
+		// Every pixel with an error gets the maximum, the others share the
+		// rest of the budget
+		_mapScale = INFINITY;
+		if (nPos < nPixs)
+			_mapZero = min(float(lim), float((nSamplesA - double(nPos) * lim) / (nPixs - nPos)));
+	}
+	else {
+		// Walk down the bins, clamping whole bins until the scale for the
+		// remaining pixels keeps the current bin below the limit. The
+		// threshold then lies in the last clamped bin.
+		double nClamped = 0., sumClamped = 0.;
+		int thresholdBin = -1;
+		for (int bin = NLM_MAP_BINS - 1; bin >= 0; bin--) {
+			if (_histCount[bin] == 0)
+				continue;
+			double scale = (nSamplesA - nClamped * lim) / (total - sumClamped);
+			if (scale * MapBinUpper(bin) <= lim)
+				break;
+			nClamped += _histCount[bin];
+			sumClamped += _histSum[bin];
+			thresholdBin = bin;
+		}
 
-            if (mapA[pix] > lim)
-                nPixOver2 += 1;
-        }
-    } while(nPixOver2 > 0);
+		double scale = nSamplesA / total;
+		if (thresholdBin >= 0) {
+			// Sort the threshold bin and find the exact split within it
+			nClamped -= _histCount[thresholdBin];
+			sumClamped -= _histSum[thresholdBin];
+			vector<float> vals;
+			vals.reserve(_histCount[thresholdBin]);
+			for (int pix = 0; pix < nPixs; pix++) {
+				float e = _mapOut[pix];
+				if (e > 0.f && MapBin(e) == thresholdBin)
+					vals.push_back(e);
+			}
+			sort(vals.begin(), vals.end(), std::greater<float>());
+			for (uint32_t k = 0; ; k++) {
+				scale = (nSamplesA - nClamped * lim) / (total - sumClamped);
+				if (k == vals.size() || scale * vals[k] <= lim)
+					break;
+				nClamped += 1.;
+				sumClamped += vals[k];
+			}
+		}
+		_mapScale = max(0., scale);
+	}
 
-    //copy(mapA.begin(), mapA.end(), mapB.begin());
-    /*if (PbrtOptions.verbose) {
-        DumpMap(mapA, "map", DUMP_ITERATION);
-    }*/
+	_map = mapA;
+	RunPassParallel(NLM_PASS_MAP_APPLY, 1, 1);
+	memcpy(mapB, mapA, nPixs * sizeof(float));
+	/*if (PbrtOptions.verbose) {
+		DumpMap(mapA, "map", DUMP_ITERATION);
+	}*/
 }
 
 
-float* NLMeanFilter::Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixelCount)
+float* NLMeanFilter::Cal(PixelBuffer *pixels, int xPixelCount, int yPixelCount)
 {
-	int nPix = xPixelCount * yPixelCount;
-
-	float *outRGB = new float[3*nPix];
-	//int offset;
-	//int xMin, xMax, yMin, yMax;
+	Reserve(xPixelCount, yPixelCount);
 
 	// cal mean & variance   of pixelA  pixelB
-	float *mean = new float[3];
-	float *var  = new float[nPix*3];
-	int n, index;
-	for (int y = 0; y < yPixelCount; y++)
-	{
-		for (int x = 0; x < xPixelCount; x++)
-		{
-			index = y*xPixelCount + x;
+	GatherRows(pixels, xPixelCount, yPixelCount, 0, yPixelCount, _rgb[0], _var[0], _samples[0]);
+	CalRows(_rgb[0], _var[0], xPixelCount, yPixelCount, 0, xPixelCount, 0, yPixelCount, _out);
 
-			n = (*pixels)(x, y)._nSamplesBox;
-			mean[0] = (*pixels)(x, y)._LrgbSumBox[0] / n;
-			mean[1] = (*pixels)(x, y)._LrgbSumBox[1] / n;
-			mean[2] = (*pixels)(x, y)._LrgbSumBox[2] / n;
+	return _out;
+}
 
-			var[index*3   ] = max( 0.f, ((*pixels)(x, y)._LrgbSumSqrBox[0] -  (*pixels)(x, y)._LrgbSumBox[0]*mean[0]) / (n+1)) ;
-			var[index*3 +1] = max( 0.f, ((*pixels)(x, y)._LrgbSumSqrBox[1] -  (*pixels)(x, y)._LrgbSumBox[1]*mean[1]) / (n+1)) ;
-			var[index*3 +2] = max( 0.f, ((*pixels)(x, y)._LrgbSumSqrBox[2] -  (*pixels)(x, y)._LrgbSumBox[2]*mean[2]) / (n+1)) ;
-		}
-	}
 
+void NLMeanFilter::CalRows(const float *rgb, const float *var, int xPixelCount, int yPixelCount,
+	int xStart, int xEnd, int yStart, int yEnd, float *outRGB)
+{
+	//int offset;
+	//int xMin, xMax, yMin, yMax;
 
 
 	//float *dis = new float[nPix*3];
@@ -258,10 +956,11 @@ float* NLMeanFilter::Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixe
 	float dis;
 
 	int qx, qy;
+	int nPix = xPixelCount * yPixelCount;
 
-	for (int y = 0; y < yPixelCount ; y++)
+	for (int y = yStart; y < yEnd ; y++)
 	{
-		for (int x = 0; x < xPixelCount; x++)
+		for (int x = xStart; x < xEnd; x++)
 		{
 			int index = x + y*xPixelCount;
 
@@ -293,12 +992,12 @@ float* NLMeanFilter::Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixe
 									if( ( (x+px) >= 0 && (y+py) >= 0 && (x+px) < xPixelCount && (y+py) < yPixelCount) &&
 										( (qx+px) >= 0 && (qy+py) >= 0 && (qx+px) < xPixelCount && (qy+py) < yPixelCount)
 									){
-										int indexP = (x+px + (y+py)*xPixelCount)*3 + i;
-										int indexQ = (qx+px + (qy+py)*xPixelCount)*3 + i;
+										int indexP = (x+px + (y+py)*xPixelCount) + i*nPix;
+										int indexQ = (qx+px + (qy+py)*xPixelCount) + i*nPix;
 
 										int m = min(var[indexP], var[indexQ]);
 
-										dis += (pow((*pixels)(x+px, y+py)._Lrgb[i] - (*pixels)(qx+px, qy+py)._Lrgb[i] , 2)
+										dis += (pow(rgb[indexP] - rgb[indexQ] , 2)
 													- alpha*(var[indexP] - m) ) / (epslon+ k*k*(var[indexP] + var[indexQ]));
 									}
 								}
@@ -309,9 +1008,9 @@ float* NLMeanFilter::Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixe
 						weight = exp(-1* max(0.f, dis));
 						totalW += weight;
 
-						outRGB[index*3    ] += (*pixels)(qx, qy)._Lrgb[0] * weight;
-						outRGB[index*3 + 1] += (*pixels)(qx, qy)._Lrgb[1] * weight;
-						outRGB[index*3 + 2] += (*pixels)(qx, qy)._Lrgb[2] * weight;
+						outRGB[index*3    ] += rgb[qx + qy*xPixelCount + 0] * weight;
+						outRGB[index*3 + 1] += rgb[qx + qy*xPixelCount + nPix] * weight;
+						outRGB[index*3 + 2] += rgb[qx + qy*xPixelCount + 2*nPix] * weight;
 					}
 				}
 			}
@@ -321,20 +1020,182 @@ float* NLMeanFilter::Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixe
 
 		}
 	}
+}
+
+
+float* NLMeanFilter::CalBox(PixelBuffer *pixels, int xPixelCount, int yPixelCount)
+{
+	Reserve(xPixelCount, yPixelCount);
+
+	GatherRows(pixels, xPixelCount, yPixelCount, 0, yPixelCount, _rgb[0], _var[0], _samples[0]);
+	CalBoxRows(_rgb[0], _var[0], xPixelCount, yPixelCount, 0, xPixelCount, 0, yPixelCount, _out);
+
+	return _out;
+}
+
+
+void NLMeanFilter::CalBoxRows(const float *rgb, const float *var, int xPixelCount, int yPixelCount,
+	int xStart, int xEnd, int yStart, int yEnd, float *outRGB)
+{
+	// Same filter as CalRows(), but the loops are reordered: for each neighbor
+	// offset (dx, dy), the per-pixel distance terms are computed once over the
+	// whole band, and the patch sums are obtained with a horizontal and a
+	// vertical running box sum (core/kernel2d.h). This is the
+	// conv_box_h/conv_box_v approach of core/nlmkernel.cu, and the cost no
+	// longer depends on the patch radius.
+	// The distance and weighting loops are the SSE2/AVX2 row kernels of
+	// filters/nlmsimd.cpp, selected by 'simd'.
+	int wnd_rad = (int)f;
+	int ptc_rad = (int)r;
+
+	// The distance terms are needed over the rectangle plus the patch apron
+	int dStart = max(0, yStart - ptc_rad), dEnd = min(yPixelCount, yEnd + ptc_rad);
+	int cStart = max(0, xStart - ptc_rad), cEnd = min(xPixelCount, xEnd + ptc_rad);
+	int nRows = yEnd - yStart, nDistRows = dEnd - dStart;
+
+	// Band accumulators, planar like the inputs
+	int nPix = xPixelCount * yPixelCount, nBand = nRows*xPixelCount;
+	float *totalW = new float[nBand];
+	float *accRGB = new float[3*nBand];
+	for (int i = 0; i < nBand; i++) totalW[i] = 0.f;
+	for (int i = 0; i < 3*nBand; i++) accRGB[i] = 0.f;
+
+	float *dist = new float[nDistRows*xPixelCount];
+	float *tmp = new float[nDistRows*xPixelCount];
+	double *colSum = new double[xPixelCount];
+	int32_t scratchBytes = (nBand + 3*nBand + 2*nDistRows*xPixelCount) * sizeof(float) +
+		xPixelCount * sizeof(double);
+	AddScratch(scratchBytes);
+	float invNorm = 1.f / (3*(2*f+1)*(2*f+1));
+	float k2 = k*k;
+
+	for (int dy = -wnd_rad; dy <= wnd_rad; dy++)
+	{
+		for (int dx = -wnd_rad; dx <= wnd_rad; dx++)
+		{
+			// Pixels whose neighbor at (dx, dy) lies inside the image
+			int x0 = max(0, -dx), x1 = min(xPixelCount, xPixelCount - dx);
+			int y0 = max(0, -dy), y1 = min(yPixelCount, yPixelCount - dy);
+
+			// Per-pixel distance term, zero where the neighbor is outside
+			for (int y = 0; y < nDistRows; y++)
+				for (int x = cStart; x < cEnd; x++)
+					dist[x + y*xPixelCount] = 0.f;
+			int dx0 = max(x0, cStart), dx1 = min(x1, cEnd);
+			for (int y = max(y0, dStart); y < min(y1, dEnd) && dx0 < dx1; y++)
+			{
+				int indexP = dx0 + y*xPixelCount;
+				int indexQ = indexP + dx + dy*xPixelCount;
+				const float *rgbP[3], *varP[3], *rgbQ[3], *varQ[3];
+				for (int i = 0; i < 3; i++)
+				{
+					rgbP[i] = &rgb[indexP + i*nPix]; varP[i] = &var[indexP + i*nPix];
+					rgbQ[i] = &rgb[indexQ + i*nPix]; varQ[i] = &var[indexQ + i*nPix];
+				}
+				NLMDistanceRow(simd, dx1 - dx0, rgbP, varP, rgbQ, varQ, alpha, k2, epslon,
+					&dist[(y - dStart)*xPixelCount + dx0]);
+			}
+
+			// Patch sums: horizontal box sum of radius ptc_rad, then vertical
+			// box sum over the band rows, back into dist
+			BoxSumRows(dist, tmp, xPixelCount, 1, nDistRows, ptc_rad,
+				xStart, xEnd, BOX_NORM_NONE);
+			BoxSumColumns(tmp, dStart, &dist[(yStart - dStart)*xPixelCount], yStart, yEnd,
+				xPixelCount, yPixelCount, ptc_rad, xStart, xEnd, BOX_NORM_NONE, colSum);
+
+			// Accumulate the weighted neighbors
+			int wx0 = max(x0, xStart), wx1 = min(x1, xEnd);
+			for (int y = max(y0, yStart); y < min(y1, yEnd) && wx0 < wx1; y++)
+			{
+				int indexB = wx0 + (y - yStart)*xPixelCount;
+				int indexQ = wx0 + dx + (y + dy)*xPixelCount;
+				const float *rgbQ[3];
+				float *acc[3];
+				for (int i = 0; i < 3; i++)
+				{
+					rgbQ[i] = &rgb[indexQ + i*nPix];
+					acc[i] = &accRGB[indexB + i*nBand];
+				}
+				NLMWeightRow(simd, wx1 - wx0, &dist[(y - dStart)*xPixelCount + wx0], invNorm,
+					rgbQ, &totalW[indexB], acc);
+			}
+		}
+	}
 
-	delete[] mean;
-	delete[] var;
+	// The A/B combination still reads interleaved rgb
+	for (int y = yStart; y < yEnd; y++)
+	{
+		for (int x = xStart; x < xEnd; x++)
+		{
+			int i = x + (y - yStart)*xPixelCount;
+			int index = x + y*xPixelCount;
+			outRGB[index*3    ] = accRGB[i          ] / totalW[i];
+			outRGB[index*3 + 1] = accRGB[i +   nBand] / totalW[i];
+			outRGB[index*3 + 2] = accRGB[i + 2*nBand] / totalW[i];
+		}
+	}
 
-	return outRGB;
+	delete[] dist;
+	delete[] tmp;
+	delete[] colSum;
+	delete[] totalW;
+	delete[] accRGB;
+	AddScratch(-scratchBytes);
 }
 
+
+void NLMeanFilter::GatherRows(PixelBuffer *pixels, int xPixelCount, int yPixelCount, int yStart, int yEnd,
+	float *rgb, float *var, int *nSamples)
+{
+	// Planar layout, the plane of channel i starts at i*nPix
+	int nPix = xPixelCount * yPixelCount;
+	// Rows of half buffers are converted to floats first
+	float *scratch = NULL;
+	if (pixels->storage == PIXEL_STORAGE_HALF)
+		scratch = new float[3 * xPixelCount];
+	float *sumRow = scratch;
+	float *sqrRow = scratch ? scratch + xPixelCount : NULL;
+	float *lrgbRow = scratch ? scratch + 2*xPixelCount : NULL;
+	for (int y = yStart; y < yEnd; y++)
+	{
+		int *n = &nSamples[y*xPixelCount];
+		memcpy(n, pixels->SamplesRow(y), xPixelCount * sizeof(int));
+		for (int i = 0; i < 3; i++)
+		{
+			const float *sum = pixels->SumRow(i, y, sumRow);
+			const float *sumSqr = pixels->SumSqrRow(i, y, sqrRow);
+			float *rgbRow = &rgb[y*xPixelCount + i*nPix];
+			float *varRow = &var[y*xPixelCount + i*nPix];
+			memcpy(rgbRow, pixels->LrgbRow(i, y, lrgbRow), xPixelCount * sizeof(float));
+			for (int x = 0; x < xPixelCount; x++)
+			{
+				float mean = sum[x] / n[x];
+				varRow[x] = max( 0.f, (sumSqr[x] - sum[x]*mean) / (n[x]+1)) ;
+			}
+		}
+	}
+	delete[] scratch;
+}
+
+
 NLMeanFilter *CreateNLMeanFilter(const ParamSet &ps) {
     // Find common filter parameters
     float r = ps.FindOneFloat("rwidth", 7.f);
     float f = ps.FindOneFloat("fwidth", 3.f);
     float k = ps.FindOneFloat("kvalue", 0.45f);
 	float alpha = ps.FindOneFloat("alpha", 0.5f);
-    return new NLMeanFilter(r, f, k, alpha);
+	NLMeanEngine engine = NLMeanEngineFromString(ps.FindOneString("engine", "box"));
+	NLMSimdLevel simd = NLMSimdFromString(ps.FindOneString("simd", "auto"));
+    return new NLMeanFilter(r, f, k, alpha, engine, simd);
+}
+
+
+NLMeanEngine NLMeanEngineFromString(const string &name) {
+	if (name == "brute")
+		return NLM_ENGINE_BRUTE;
+	if (name != "box")
+		Warning("NL-means engine \"%s\" unknown. Using \"box\".", name.c_str());
+	return NLM_ENGINE_BOX;
 }
 
 
@@ -38,53 +38,158 @@
 
 // filters/NLmean.h*
 #include "filter.h"
+#include "parallel.h"
+#include "kernel2d.h"
+#include "filters/nlmsimd.h"
 
 #define EPSLON 1e-10
 
-struct Pixel {
-    Pixel() {
-        _weightSum = 0.f;
-        _nSamplesBox = 0.f;
-        for (int i = 0; i < 3; ++i) 
-        {
-            _Lrgb[i] = 0.f;
-            _LrgbSumBox[i] = 0.f;
-            _LrgbSumSqrBox[i] = 0.f;
-            _varSumBox[i] = 0.f;
-            _varSumSqrBox[i] = 0.f;
-        }
-    }
-    float Lxyz[3];
-    float weightSum;
-    float splatXYZ[3];
-    float pad;
-    // These store the sample values, as well as the cumulative weights, as
-    // defined by the filter.
-    float _Lrgb[3];
-    float _weightSum;
+// Precision of the values kept in a PixelBuffer. PIXEL_STORAGE_HALF stores
+// fp16 values, more than halving the size of the film buffers (26 bytes per
+// pixel instead of 56). To avoid the range and cancellation problems of fp16
+// sums, the buffer then keeps the filtered XYZ values divided by their weight
+// sum and the mean and variance of the box samples; the weight sum stays a
+// float, as an fp16 sum stops growing once it is a few thousand times larger
+// than the filter weights added to it, and the sample counts stay 32-bit
+// integers. The resolved RGB values are computed when read. Every merge
+// rounds the stored means once, to a relative error of at most 2^-11
+// (0.05%), so a pixel merged m times has its mean and variance within about
+// m * 2^-11 of the float result. Values beyond 65504 saturate.
+// Half buffers can't be updated atomically: samples are accumulated in float
+// tiles and merged under a lock, see DualFilm.
+enum PixelStorage {
+    PIXEL_STORAGE_FLOAT,
+    PIXEL_STORAGE_HALF
+};
+
+// Planar storage of one of the two DualFilm buffers. Each field is a separate
+// array of nPix values in row-major order, and each plane starts on a cache
+// line so that whole rows can be streamed with SIMD loads.
+struct PixelBuffer {
+    PixelBuffer(int xres, int yres, PixelStorage storage = PIXEL_STORAGE_FLOAT);
+    ~PixelBuffer();
+    void Clear();
+
+    int Index(int x, int y) const { return x + y * xPixelCount; }
+    // Rows of the resolved RGB values and of the box sums, for either
+    // storage. Float rows are returned in place, half rows are converted into
+    // 'scratch', which must hold xPixelCount values, and 'scratch' is
+    // returned.
+    const float *LrgbRow(int c, int y, float *scratch) const;
+    const float *SumRow(int c, int y, float *scratch) const;
+    const float *SumSqrRow(int c, int y, float *scratch) const;
+    const int *SamplesRow(int y) const { return nSamplesBox + y * xPixelCount; }
+
+    // Add filtered XYZ values and their filter weight, or the box sums of
+    // 'n' samples, to pixel 'pix'. These aren't atomic.
+    void AddFiltered(int pix, const float xyz[3], float weight);
+    void AddBox(int pix, int n, const float sum[3], const float sumSqr[3]);
+
+    // Copy of all the planes, see WriteDualBuffers(). The file always holds
+    // float values, whatever the storage.
+    bool Write(FILE *f) const;
+    bool Read(FILE *f);
+
+    // Bytes allocated for the planes
+    size_t Bytes() const { return bytes; }
+
+    const PixelStorage storage;
+    int xPixelCount, yPixelCount, nPix;
+    // The filtered XYZ sums and filter weight sums of the samples, and the
+    // normalized RGB values resolved from them. Only the weight sums are
+    // kept with half storage, the others are NULL.
+    float *Lxyz[3];
+    float *weightSum;
+    float *Lrgb[3];
     // The 'box' data is used to compute the variance of samples falling within
     // the boundary of a pixel. It is not affected by the reconstruction filter.
-    int _nSamplesBox;
-    float _LrgbSumBox[3];
-    float _LrgbSumSqrBox[3];
-    // Buffer variance
-    float _tmp[3];
-    float _varSumBox[3];
-    float _varSumSqrBox[3];
+    int *nSamplesBox;
+    float *LrgbSumBox[3];       // NULL with half storage
+    float *LrgbSumSqrBox[3];    // NULL with half storage
+
+private:
+    // fp16 bits of the half storage planes: filtered XYZ values divided by
+    // the weight sum, and the box mean and variance
+    uint16_t *xyzMean[3], *boxMean[3], *boxVar[3];
+    void *data;
+    size_t bytes;
+    int stride;
+};
+
+// Dump of the two buffers of a DualFilm (its "dumpbuffers" parameter), read
+// back by tools/nlmbench.cpp to benchmark the denoisers without rendering.
+// Both return false, after reporting the error, if the file can't be used.
+bool WriteDualBuffers(const string &filename, const PixelBuffer *pixelsA,
+    const PixelBuffer *pixelsB);
+bool ReadDualBuffers(const string &filename, PixelBuffer **pixelsA,
+    PixelBuffer **pixelsB);
+
+// Tiles of a PixelBuffer that received samples since the last NL-means
+// filtering. DualFilm marks them as samples land, so that NLFiltering() can
+// refilter only the tiles within reach of a change and reuse its previous
+// output elsewhere. Marking is safe from concurrent render tasks.
+class DirtyTiles {
+public:
+    DirtyTiles(int xres, int yres, int tileSize = 32);
+    ~DirtyTiles() { delete[] dirty; }
+
+    // Mark the tiles overlapping pixels [x0, x1] x [y0, y1]
+    void Mark(int x0, int y0, int x1, int y1);
+    void MarkAll();
+    void Clear();
+    bool IsDirty(int tx, int ty) const { return dirty[tx + ty * xTiles] != 0; }
+
+    int tileSize, xTiles, yTiles;
+
+private:
+    AtomicInt32 *dirty;
+};
+
+// Implementation used to evaluate the patch distances. NLM_ENGINE_BRUTE
+// recomputes every patch distance from scratch and is kept as the reference,
+// NLM_ENGINE_BOX handles one neighbor offset at a time over the whole image
+// and gets the patch sums with running box filters.
+enum NLMeanEngine {
+    NLM_ENGINE_BRUTE,
+    NLM_ENGINE_BOX
+};
+
+// The NL-means passes, each of which is run over row bands by NLMeanTasks.
+enum NLMeanPass {
+    NLM_PASS_GATHER,    // linear copies of the pixel values, variances and counts
+    NLM_PASS_FILTER,    // the NL-means filter itself
+    NLM_PASS_COMBINE,   // buffer variance, pixel error and A/B combination
+    NLM_PASS_MAP_INIT,  // sampling map from the pixel errors
+    NLM_PASS_MAP_HISTOGRAM, // histogram of the blurred map
+    NLM_PASS_MAP_APPLY  // scaling and clamping of the map
 };
-//typedef BlockedArray<Pixel> NLPixel;
 
 // NL-Mean Filter Declarations
 class NLMeanFilter : public Filter {
 public:
 
     // Non-local Mean Filter Public Methods
-    NLMeanFilter(float r, float f, float k, float a)
-        : Filter(r, r), alpha(a), f(f) , k(k), r(r)
+    NLMeanFilter(float r, float f, float k, float a,
+        NLMeanEngine e = NLM_ENGINE_BOX, NLMSimdLevel s = NLMSimdSupported())
+        : Filter(r, r), alpha(a), f(f) , k(k), r(r), engine(e), simd(s)
     {
             epslon = EPSLON;
+            _work = NULL;
+            _workXRes = _workYRes = 0;
+            _workBytes = 0;
+            _cacheValid = false;
+            _scratchBytes = _scratchPeak = 0;
 
     }
+    ~NLMeanFilter();
+
+    // Size the workspace for images of the given resolution. All the images
+    // of a call, and the ones it returns, live in the workspace, which is
+    // only reallocated when the resolution changes.
+    void Reserve(int xPixelCount, int yPixelCount);
+    // Report the workspace size and the peak memory including the scratch
+    // space of the filter tasks (verbose mode only)
+    void ReportMemory() const;
 
     int nPixs;
     int _xPixelCount;
@@ -92,11 +197,38 @@ public:
 
     float Evaluate(float x, float y) const;
 
-    float *NLFiltering(BlockedArray<Pixel> *pixelsA, BlockedArray<Pixel> *pixelsB, int xPixelCount, int yPixelCount);
-    float *Cal(BlockedArray<Pixel> *pixels, int xPixelCount, int yPixelCount);
+    // Filter both buffers and combine them. The returned image is owned by
+    // the filter and valid until its next call. When the dirty tiles of both
+    // buffers are given and the previous call filtered images of the same
+    // size, only the tiles they can influence are filtered again.
+    float *NLFiltering(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+        const DirtyTiles *dirtyA = NULL, const DirtyTiles *dirtyB = NULL);
+    // NLFiltering() split around its filter pass, whose tasks may then run
+    // along with other work. BeginFiltering() copies what the filter reads
+    // and returns its tasks, EndFiltering() must be called once they are done
+    // and returns the combined image. The buffers can take new samples in
+    // between: the pixel errors and the combination use the sample counts
+    // copied by BeginFiltering().
+    void BeginFiltering(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+        const DirtyTiles *dirtyA, const DirtyTiles *dirtyB, vector<Task *> &tasks);
+    float *EndFiltering(vector<Task *> &tasks);
+    float *Cal(PixelBuffer *pixels, int xPixelCount, int yPixelCount);
+    float *CalBox(PixelBuffer *pixels, int xPixelCount, int yPixelCount);
+    // Compute the pixel errors and the combined image from two buffers
+    // filtered elsewhere (interleaved rgb, only read during the call). As for
+    // NLFiltering(), the image returned by these is owned by the filter.
+    float *Combine(PixelBuffer *pixelsA, PixelBuffer *pixelsB, int xPixelCount, int yPixelCount,
+        float *fltA, float *fltB);
 
-    void UpdateError(float *ImgVar, BlockedArray<Pixel> *_fltSpp, float *ImgErr);
+    void UpdateError(float *ImgVar, const int *nSamples, float *ImgErr, int yStart, int yEnd);
     void GetSamplingMaps(int spp, int nSamples, float *mapA, float *mapB);
+    // Percentile (in [0, 100]) of the pixel errors of both buffers, as set by
+    // the last Combine()
+    float GetError(float percentile) const;
+
+    // Run one pass over pixels [xStart, xEnd) x [yStart, yEnd) of the given
+    // buffer (0 is A). Only the filter pass supports partial rows.
+    void RunPass(NLMeanPass pass, int buffer, int xStart, int xEnd, int yStart, int yEnd);
 
     
 private:
@@ -105,6 +237,8 @@ private:
     const float f;
     const float k;
     const float r;
+    const NLMeanEngine engine;
+    const NLMSimdLevel simd;    // row kernels used by the box engine
     float epslon/* = 1e-10*/;
 
     float *ImgVar_A ;
@@ -113,10 +247,60 @@ private:
     float *ImgErr_A;
     float *ImgErr_B;
 
+    // State of the NLFiltering call in progress, shared by the NLMeanTasks
+    PixelBuffer *_pixels[2];
+    float *_rgb[2], *_var[2], *_flt[2];
+    float *_out;
+    // Sample counts read by the combine pass: the copies made by the gather
+    // pass, or the buffers' own counts for Combine()
+    int *_samples[2];
+    const int *_n[2];
+
+    // Filtered buffers kept from one NLFiltering call to the next, for the
+    // incremental refresh
+    float *_cache[2];
+    bool _cacheValid;
+
+    // Single aligned allocation holding all the images above
+    float *_work;
+    int _workXRes, _workYRes;
+    size_t _workBytes;
+    // Scratch space of the running filter tasks, and its peak
+    AtomicInt32 _scratchBytes, _scratchPeak;
+    void AddScratch(int32_t bytes);
+
+    void PassTasks(NLMeanPass pass, int nBuffers, int minRows, vector<Task *> &tasks);
+    void RunPassParallel(NLMeanPass pass, int nBuffers, int minRows);
+    // Bands of the last PassTasks() call, which the sampling map passes
+    // use to index their partial results
+    int _bandRows, _nBands;
+    // Add the tasks filtering the output tiles within reach of the dirty
+    // tiles, returns false when most of the image would be refiltered anyway
+    bool RefilterTasks(const DirtyTiles *dirty[2], vector<Task *> &tasks);
+    void GatherRows(PixelBuffer *pixels, int xPixelCount, int yPixelCount, int yStart, int yEnd,
+        float *rgb, float *var, int *nSamples);
+    void CalRows(const float *rgb, const float *var, int xPixelCount, int yPixelCount,
+        int xStart, int xEnd, int yStart, int yEnd, float *outRGB);
+    void CalBoxRows(const float *rgb, const float *var, int xPixelCount, int yPixelCount,
+        int xStart, int xEnd, int yStart, int yEnd, float *outRGB);
+    void CombineRows(int yStart, int yEnd);
+
+    // State of the GetSamplingMaps call in progress. The map is blurred,
+    // then scaled by '_mapScale' and clamped to '_mapLim'.
+    float *_map;
+    vector<float> _mapIn, _mapTmp, _mapOut;
+    vector<float> _bandMax;
+    vector<uint32_t> _histCount;
+    vector<double> _histSum;
+    double _mapScale;
+    float _mapLim, _mapZero;
+    void MapRows(NLMeanPass pass, int yStart, int yEnd);
+
 };
 
 
 NLMeanFilter *CreateNLMeanFilter(const ParamSet &ps);
+NLMeanEngine NLMeanEngineFromString(const string &name);
 
 
 #endif // PBRT_FILTERS_NLMean_H
@@ -0,0 +1,339 @@
+
+/*
+    pbrt source code Copyright(c) 1998-2012 Matt Pharr and Greg Humphreys.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// filters/nlmsimd.cpp*
+#include "stdafx.h"
+#include "filters/nlmsimd.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PBRT_NLM_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+// The AVX2 kernels are compiled for AVX2 whatever the global target and
+// only run after the CPUID check in NLMSimdSupported()
+#if defined(PBRT_NLM_HAS_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define PBRT_NLM_HAS_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NLM_AVX2_FUNC
+#else
+#define NLM_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
+// NLMSimd Scalar Kernels
+static void DistanceRowScalar(int n,
+        const float *const rgbP[3], const float *const varP[3],
+        const float *const rgbQ[3], const float *const varQ[3],
+        float alpha, float k2, float eps, float *dist) {
+    for (int x = 0; x < n; ++x) {
+        float d = 0.f;
+        for (int c = 0; c < 3; ++c) {
+            float vp = varP[c][x], vq = varQ[c][x];
+            int m = min(vp, vq);
+            float diff = rgbP[c][x] - rgbQ[c][x];
+            d += (diff*diff - alpha*(vp - m)) / (eps + k2*(vp + vq));
+        }
+        dist[x] = d;
+    }
+}
+
+
+static void WeightRowScalar(int n, const float *dist, float invNorm,
+        const float *const rgbQ[3], float *totalW, float *const acc[3]) {
+    for (int x = 0; x < n; ++x) {
+        float w = expf(-max(0.f, dist[x] * invNorm));
+        totalW[x] += w;
+        acc[0][x] += rgbQ[0][x] * w;
+        acc[1][x] += rgbQ[1][x] * w;
+        acc[2][x] += rgbQ[2][x] * w;
+    }
+}
+
+
+// Vector expf() uses the Cephes polynomial: exp(x) = 2^n * exp(g) with
+// n = round(x/ln2) and |g| <= ln2/2, about 1 ulp off the C library
+#define NLM_EXP_HI       88.3762626647949f
+#define NLM_EXP_LO      -88.3762626647949f
+#define NLM_LOG2E        1.44269504088896341f
+#define NLM_EXP_C1       0.693359375f
+#define NLM_EXP_C2      -2.12194440e-4f
+#define NLM_EXP_P0       1.9875691500E-4f
+#define NLM_EXP_P1       1.3981999507E-3f
+#define NLM_EXP_P2       8.3334519073E-3f
+#define NLM_EXP_P3       4.1665795894E-2f
+#define NLM_EXP_P4       1.6666665459E-1f
+#define NLM_EXP_P5       5.0000001201E-1f
+
+#ifdef PBRT_NLM_HAS_SSE2
+// NLMSimd SSE2 Kernels
+static inline __m128 Exp4(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(NLM_EXP_LO)), _mm_set1_ps(NLM_EXP_HI));
+    __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(NLM_LOG2E)), _mm_set1_ps(0.5f));
+    // floor(fx): truncate, then step down where truncation rounded up
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+    fx = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, fx), _mm_set1_ps(1.f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NLM_EXP_C1)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NLM_EXP_C2)));
+    __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(NLM_EXP_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NLM_EXP_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NLM_EXP_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NLM_EXP_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NLM_EXP_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NLM_EXP_P5));
+    y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, z), x), _mm_set1_ps(1.f));
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx),
+        _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(e));
+}
+
+
+static void DistanceRowSSE2(int n,
+        const float *const rgbP[3], const float *const varP[3],
+        const float *const rgbQ[3], const float *const varQ[3],
+        float alpha, float k2, float eps, float *dist) {
+    const __m128 valpha = _mm_set1_ps(alpha), vk2 = _mm_set1_ps(k2);
+    const __m128 veps = _mm_set1_ps(eps);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128 d = _mm_setzero_ps();
+        for (int c = 0; c < 3; ++c) {
+            __m128 vp = _mm_loadu_ps(varP[c] + x), vq = _mm_loadu_ps(varQ[c] + x);
+            __m128 m = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(vp, vq)));
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(rgbP[c] + x), _mm_loadu_ps(rgbQ[c] + x));
+            __m128 num = _mm_sub_ps(_mm_mul_ps(diff, diff),
+                                    _mm_mul_ps(valpha, _mm_sub_ps(vp, m)));
+            __m128 den = _mm_add_ps(veps, _mm_mul_ps(vk2, _mm_add_ps(vp, vq)));
+            d = _mm_add_ps(d, _mm_div_ps(num, den));
+        }
+        _mm_storeu_ps(dist + x, d);
+    }
+    if (x < n) {
+        const float *rp[3] = { rgbP[0] + x, rgbP[1] + x, rgbP[2] + x };
+        const float *vp[3] = { varP[0] + x, varP[1] + x, varP[2] + x };
+        const float *rq[3] = { rgbQ[0] + x, rgbQ[1] + x, rgbQ[2] + x };
+        const float *vq[3] = { varQ[0] + x, varQ[1] + x, varQ[2] + x };
+        DistanceRowScalar(n - x, rp, vp, rq, vq, alpha, k2, eps, dist + x);
+    }
+}
+
+
+static void WeightRowSSE2(int n, const float *dist, float invNorm,
+        const float *const rgbQ[3], float *totalW, float *const acc[3]) {
+    const __m128 vnorm = _mm_set1_ps(-invNorm);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128 w = Exp4(_mm_min_ps(_mm_setzero_ps(),
+                                   _mm_mul_ps(_mm_loadu_ps(dist + x), vnorm)));
+        _mm_storeu_ps(totalW + x, _mm_add_ps(_mm_loadu_ps(totalW + x), w));
+        for (int c = 0; c < 3; ++c)
+            _mm_storeu_ps(acc[c] + x, _mm_add_ps(_mm_loadu_ps(acc[c] + x),
+                _mm_mul_ps(_mm_loadu_ps(rgbQ[c] + x), w)));
+    }
+    if (x < n) {
+        const float *rq[3] = { rgbQ[0] + x, rgbQ[1] + x, rgbQ[2] + x };
+        float *a[3] = { acc[0] + x, acc[1] + x, acc[2] + x };
+        WeightRowScalar(n - x, dist + x, invNorm, rq, totalW + x, a);
+    }
+}
+#endif // PBRT_NLM_HAS_SSE2
+
+#ifdef PBRT_NLM_HAS_AVX2
+// NLMSimd AVX2 Kernels
+NLM_AVX2_FUNC static inline __m256 Exp8(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(NLM_EXP_LO)), _mm256_set1_ps(NLM_EXP_HI));
+    __m256 fx = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(NLM_LOG2E)), _mm256_set1_ps(0.5f));
+    fx = _mm256_floor_ps(fx);
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(NLM_EXP_C1)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(NLM_EXP_C2)));
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 y = _mm256_set1_ps(NLM_EXP_P0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NLM_EXP_P1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NLM_EXP_P2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NLM_EXP_P3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NLM_EXP_P4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(NLM_EXP_P5));
+    y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), x), _mm256_set1_ps(1.f));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx),
+        _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+
+NLM_AVX2_FUNC static void DistanceRowAVX2(int n,
+        const float *const rgbP[3], const float *const varP[3],
+        const float *const rgbQ[3], const float *const varQ[3],
+        float alpha, float k2, float eps, float *dist) {
+    const __m256 valpha = _mm256_set1_ps(alpha), vk2 = _mm256_set1_ps(k2);
+    const __m256 veps = _mm256_set1_ps(eps);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256 d = _mm256_setzero_ps();
+        for (int c = 0; c < 3; ++c) {
+            __m256 vp = _mm256_loadu_ps(varP[c] + x), vq = _mm256_loadu_ps(varQ[c] + x);
+            __m256 m = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_min_ps(vp, vq)));
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(rgbP[c] + x), _mm256_loadu_ps(rgbQ[c] + x));
+            __m256 num = _mm256_sub_ps(_mm256_mul_ps(diff, diff),
+                                       _mm256_mul_ps(valpha, _mm256_sub_ps(vp, m)));
+            __m256 den = _mm256_add_ps(veps, _mm256_mul_ps(vk2, _mm256_add_ps(vp, vq)));
+            d = _mm256_add_ps(d, _mm256_div_ps(num, den));
+        }
+        _mm256_storeu_ps(dist + x, d);
+    }
+    if (x < n) {
+        const float *rp[3] = { rgbP[0] + x, rgbP[1] + x, rgbP[2] + x };
+        const float *vp[3] = { varP[0] + x, varP[1] + x, varP[2] + x };
+        const float *rq[3] = { rgbQ[0] + x, rgbQ[1] + x, rgbQ[2] + x };
+        const float *vq[3] = { varQ[0] + x, varQ[1] + x, varQ[2] + x };
+        DistanceRowSSE2(n - x, rp, vp, rq, vq, alpha, k2, eps, dist + x);
+    }
+}
+
+
+NLM_AVX2_FUNC static void WeightRowAVX2(int n, const float *dist, float invNorm,
+        const float *const rgbQ[3], float *totalW, float *const acc[3]) {
+    const __m256 vnorm = _mm256_set1_ps(-invNorm);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256 w = Exp8(_mm256_min_ps(_mm256_setzero_ps(),
+                                      _mm256_mul_ps(_mm256_loadu_ps(dist + x), vnorm)));
+        _mm256_storeu_ps(totalW + x, _mm256_add_ps(_mm256_loadu_ps(totalW + x), w));
+        for (int c = 0; c < 3; ++c)
+            _mm256_storeu_ps(acc[c] + x, _mm256_add_ps(_mm256_loadu_ps(acc[c] + x),
+                _mm256_mul_ps(_mm256_loadu_ps(rgbQ[c] + x), w)));
+    }
+    if (x < n) {
+        const float *rq[3] = { rgbQ[0] + x, rgbQ[1] + x, rgbQ[2] + x };
+        float *a[3] = { acc[0] + x, acc[1] + x, acc[2] + x };
+        WeightRowSSE2(n - x, dist + x, invNorm, rq, totalW + x, a);
+    }
+}
+#endif // PBRT_NLM_HAS_AVX2
+
+// NLMSimd Function Definitions
+NLMSimdLevel NLMSimdSupported() {
+#if defined(PBRT_NLM_HAS_AVX2) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7) {
+        __cpuidex(info, 7, 0);
+        bool avx2 = (info[1] & (1 << 5)) != 0;
+        __cpuid(info, 1);
+        // The OS must also save the YMM registers on context switches
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        if (avx2 && osxsave && (_xgetbv(0) & 6) == 6)
+            return NLM_SIMD_AVX2;
+    }
+    return NLM_SIMD_SSE2;
+#elif defined(PBRT_NLM_HAS_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return NLM_SIMD_AVX2;
+    return NLM_SIMD_SSE2;
+#elif defined(PBRT_NLM_HAS_SSE2)
+    return NLM_SIMD_SSE2;
+#else
+    return NLM_SIMD_SCALAR;
+#endif
+}
+
+
+NLMSimdLevel NLMSimdFromString(const string &name) {
+    NLMSimdLevel supported = NLMSimdSupported();
+    NLMSimdLevel level;
+    if (name == "auto")        return supported;
+    else if (name == "scalar") level = NLM_SIMD_SCALAR;
+    else if (name == "sse2")   level = NLM_SIMD_SSE2;
+    else if (name == "avx2")   level = NLM_SIMD_AVX2;
+    else {
+        Warning("NL-means SIMD level \"%s\" unknown. Using \"%s\".",
+                name.c_str(), NLMSimdName(supported));
+        return supported;
+    }
+    if (level > supported) {
+        Warning("NL-means SIMD level \"%s\" not supported on this machine. "
+                "Using \"%s\".", name.c_str(), NLMSimdName(supported));
+        return supported;
+    }
+    return level;
+}
+
+
+const char *NLMSimdName(NLMSimdLevel level) {
+    switch (level) {
+        case NLM_SIMD_AVX2: return "avx2";
+        case NLM_SIMD_SSE2: return "sse2";
+        default:            return "scalar";
+    }
+}
+
+
+void NLMDistanceRow(NLMSimdLevel level, int n,
+        const float *const rgbP[3], const float *const varP[3],
+        const float *const rgbQ[3], const float *const varQ[3],
+        float alpha, float k2, float eps, float *dist) {
+#ifdef PBRT_NLM_HAS_AVX2
+    if (level == NLM_SIMD_AVX2) {
+        DistanceRowAVX2(n, rgbP, varP, rgbQ, varQ, alpha, k2, eps, dist);
+        return;
+    }
+#endif
+#ifdef PBRT_NLM_HAS_SSE2
+    if (level >= NLM_SIMD_SSE2) {
+        DistanceRowSSE2(n, rgbP, varP, rgbQ, varQ, alpha, k2, eps, dist);
+        return;
+    }
+#endif
+    DistanceRowScalar(n, rgbP, varP, rgbQ, varQ, alpha, k2, eps, dist);
+}
+
+
+void NLMWeightRow(NLMSimdLevel level, int n, const float *dist,
+        float invNorm, const float *const rgbQ[3], float *totalW,
+        float *const acc[3]) {
+#ifdef PBRT_NLM_HAS_AVX2
+    if (level == NLM_SIMD_AVX2) {
+        WeightRowAVX2(n, dist, invNorm, rgbQ, totalW, acc);
+        return;
+    }
+#endif
+#ifdef PBRT_NLM_HAS_SSE2
+    if (level >= NLM_SIMD_SSE2) {
+        WeightRowSSE2(n, dist, invNorm, rgbQ, totalW, acc);
+        return;
+    }
+#endif
+    WeightRowScalar(n, dist, invNorm, rgbQ, totalW, acc);
+}
@@ -0,0 +1,72 @@
+
+/*
+    pbrt source code Copyright(c) 1998-2012 Matt Pharr and Greg Humphreys.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#pragma once
+#endif
+
+#ifndef PBRT_FILTERS_NLMSIMD_H
+#define PBRT_FILTERS_NLMSIMD_H
+
+// filters/nlmsimd.h*
+#include "pbrt.h"
+
+// Row kernels of the box-filtered NL-means engine. Each kernel has a scalar
+// reference version and SSE2/AVX2 versions working on 4 or 8 pixels at once;
+// the images are planar, one float plane per channel.
+enum NLMSimdLevel {
+    NLM_SIMD_SCALAR,
+    NLM_SIMD_SSE2,
+    NLM_SIMD_AVX2
+};
+
+// Best level supported by both this build and the CPU (queried with CPUID).
+NLMSimdLevel NLMSimdSupported();
+// Parse "auto", "scalar", "sse2" or "avx2", clamped to NLMSimdSupported().
+NLMSimdLevel NLMSimdFromString(const string &name);
+const char *NLMSimdName(NLMSimdLevel level);
+
+// Variance-normalized distance between the 'n' pixels P of a row and their
+// neighbors Q, summed over the three channels:
+//   dist = sum_c ((P_c-Q_c)^2 - alpha*(varP_c-int(min(varP_c,varQ_c))))
+//          / (eps + k2*(varP_c+varQ_c))
+void NLMDistanceRow(NLMSimdLevel level, int n,
+    const float *const rgbP[3], const float *const varP[3],
+    const float *const rgbQ[3], const float *const varQ[3],
+    float alpha, float k2, float eps, float *dist);
+
+// Turn the patch distance sums into weights w = exp(-max(0, dist*invNorm))
+// and accumulate them in 'totalW', and the weighted neighbors Q in 'acc'.
+void NLMWeightRow(NLMSimdLevel level, int n, const float *dist,
+    float invNorm, const float *const rgbQ[3], float *totalW,
+    float *const acc[3]);
+
+#endif // PBRT_FILTERS_NLMSIMD_H
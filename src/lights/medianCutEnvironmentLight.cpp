@@ -37,12 +37,80 @@
 #include "montecarlo.h"
 #include "paramset.h"
 #include "imageio.h"
+#include "parallel.h"
 #include <math.h>
 
 
 vector<MedianCutRect*> leafs;
 int     nowleafs;
 
+// Loop bodies of the light setup
+struct ScaleTexel
+{
+    ScaleTexel(RGBSpectrum *t, const RGBSpectrum &s) : texels(t), scale(s) { }
+    void operator()(int i) const { texels[i] *= scale; }
+    RGBSpectrum *texels;
+    RGBSpectrum scale;
+};
+
+// Weights row _v_ of the map by the solid angle of its texels
+struct WeightRow
+{
+    WeightRow(const RGBSpectrum *t, RGBSpectrum *sa, float *im, int w, int h)
+        : texels(t), summedArea(sa), img(im), width(w), height(h) { }
+    void operator()(int v) const
+    {
+        float sinTheta = sinf(M_PI * float(v+.5f)/float(height));
+        for (int u = 0; u < width; ++u) {
+            summedArea[u + v*width] = texels[u + v*width]/*.y()*/ * sinTheta;
+            img[u + v*width] = texels[u + v*width].y() * sinTheta;
+        }
+    }
+    const RGBSpectrum *texels;
+    RGBSpectrum *summedArea;
+    float *img;
+    int width, height;
+};
+
+// Summed-area table recurrence over block _k_ of the anti-diagonal _diag_ of
+// _blockSize_ texel blocks, the block in block row _firstRow_ + _k_. A block
+// only needs the blocks above it and to its left, which lie on earlier
+// diagonals, so the blocks of a diagonal are independent and every texel
+// is summed exactly as in a serial pass.
+struct SummedAreaBlock
+{
+    SummedAreaBlock(RGBSpectrum *t, int w, int h, int bs, int d, int first)
+        : summedArea(t), width(w), height(h), blockSize(bs), diag(d), firstRow(first) { }
+    void operator()(int k) const
+    {
+        int by = firstRow + k, bx = diag - by;
+        int i1 = min((by + 1) * blockSize, height);
+        int j1 = min((bx + 1) * blockSize, width);
+        for (int i = by * blockSize; i < i1; i++)
+        {
+            for (int j = bx * blockSize; j < j1; j++)
+            {
+                int _i_j = i*width+j;
+                if(i==0)
+                {
+                    if(j!=0)
+                        summedArea[_i_j] += summedArea[_i_j - 1];
+                }
+                else if(j==0)
+                {
+                    summedArea[_i_j] += summedArea[_i_j - width];
+                }
+                else
+                {
+                    summedArea[_i_j] = summedArea[_i_j] + summedArea[_i_j-1] + summedArea[_i_j-width] - summedArea[_i_j-width-1];
+                }
+            }
+        }
+    }
+    RGBSpectrum *summedArea;
+    int width, height, blockSize, diag, firstRow;
+};
+
 MedianCutEnvironmentLight::~MedianCutEnvironmentLight() {
     delete summedArea;
     delete distribution;
@@ -61,8 +129,7 @@ MedianCutEnvironmentLight::MedianCutEnvironmentLight(const Transform &light2worl
     {
         texels = ReadImage(texmap, &width, &height);
         if (texels)
-            for (int i = 0; i < width * height; ++i)
-                texels[i] *= L.ToRGBSpectrum();
+            ParallelFor(width * height, ScaleTexel(texels, L.ToRGBSpectrum()), 4096);
     }
     if (!texels) {
         width = height = 1;
@@ -77,15 +144,7 @@ MedianCutEnvironmentLight::MedianCutEnvironmentLight(const Transform &light2worl
     for (int i=0;i<width*height;i++){
         summedArea[i]=0;
     }
-    for (int v = 0; v < height; ++v) {
-        float vp = (float)v / (float)height;
-        float sinTheta = sinf(M_PI * float(v+.5f)/float(height));
-        for (int u = 0; u < width; ++u) {
-            float up = (float)u / (float)width;
-            summedArea[u + v*width] = texels[u + v*width]/*.y()*/ * sinTheta;
-            img[u + v*width] = texels[u + v*width].y() * sinTheta;
-        }
-    }   
+    ParallelFor(height, WeightRow(texels, summedArea, img, width, height), 16);
     // Compute sampling distributions for rows and columns of image
     distribution = new Distribution2D(img, width, height);
     InitSummedAreaTable(summedArea,width,height);
@@ -101,26 +160,16 @@ MedianCutEnvironmentLight::MedianCutEnvironmentLight(const Transform &light2worl
 
 void MedianCutEnvironmentLight::InitSummedAreaTable(RGBSpectrum *summedArea, unsigned int width, unsigned int height)const
 {
-    for(unsigned int i = 0; i < height; i++ )
+    // Wavefront over square blocks: the blocks of each anti-diagonal run in
+    // parallel once the previous diagonals are done
+    const int blockSize = 64;
+    int xBlocks = (width + blockSize - 1) / blockSize;
+    int yBlocks = (height + blockSize - 1) / blockSize;
+    for (int d = 0; d < xBlocks + yBlocks - 1; d++)
     {
-        for(unsigned int j = 0; j < width; j++)
-        {
-            int _i_j = i*width+j;
-            if(i==0)
-            {
-                if(j!=0)
-                    summedArea[_i_j] += summedArea[_i_j - 1];
-            }
-            else if(j==0)
-            {
-                if(i!=0)
-                    summedArea[_i_j] += summedArea[_i_j - width];
-            }
-            else
-            {
-                summedArea[_i_j] = summedArea[_i_j] + summedArea[_i_j-1] + summedArea[_i_j-width] - summedArea[_i_j-width-1];
-            }
-        }
+        int firstRow = max(0, d - (xBlocks - 1)), lastRow = min(d, yBlocks - 1);
+        ParallelFor(lastRow - firstRow + 1,
+            SummedAreaBlock(summedArea, width, height, blockSize, d, firstRow));
     }
 }
 
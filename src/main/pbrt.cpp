@@ -36,11 +36,112 @@
 #include "probes.h"
 #include "parser.h"
 #include "parallel.h"
+#include "film/dualfilm.h"
+#if defined(PBRT_IS_WINDOWS)
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+// Start 'args[0]' with the arguments 'args', returns its process id or -1
+static intptr_t SpawnProcess(const vector<string> &args) {
+    vector<const char *> argv;
+    for (uint32_t i = 0; i < args.size(); ++i)
+        argv.push_back(args[i].c_str());
+    argv.push_back(NULL);
+#if defined(PBRT_IS_WINDOWS)
+    return _spawnv(_P_NOWAIT, argv[0], &argv[0]);
+#else
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], (char * const *)&argv[0]);
+        _exit(127);
+    }
+    return pid;
+#endif
+}
+
+
+// Wait for a process started by SpawnProcess(), returns true if it succeeded
+static bool WaitProcess(intptr_t pid) {
+#if defined(PBRT_IS_WINDOWS)
+    int status;
+    return _cwait(&status, pid, 0) != -1 && status == 0;
+#else
+    int status;
+    return waitpid(pid_t(pid), &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+#endif
+}
+
+
+// Local stand-in for a render farm: render the frame as 'nWorkers' tiles in
+// as many pbrt processes, each writing its raw buffers, then merge them
+static int RenderDistributed(const char *pbrt, const Options &options,
+        const vector<string> &filenames, int nWorkers) {
+    if (filenames.size() == 0) {
+        fprintf(stderr, "pbrt: --distribute needs scene files\n");
+        return 1;
+    }
+    // The workers share the cores
+    int nCores = options.nCores > 0 ? options.nCores : NumSystemCores();
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", max(1, nCores / nWorkers));
+    string workerCores = buf;
+    snprintf(buf, sizeof(buf), "%d", nWorkers);
+    string nTiles = buf;
+
+    vector<string> tileFiles;
+    vector<intptr_t> pids;
+    bool ok = true;
+    for (int w = 0; w < nWorkers; ++w) {
+        snprintf(buf, sizeof(buf), "%d", w);
+        tileFiles.push_back(filenames[0] + ".tile" + buf + ".dual");
+        vector<string> args;
+        args.push_back(pbrt);
+        args.push_back("--ncores"); args.push_back(workerCores);
+        args.push_back("--tile"); args.push_back(buf);
+        args.push_back("--ntiles"); args.push_back(nTiles);
+        args.push_back("--tilefile"); args.push_back(tileFiles.back());
+        if (options.quickRender) args.push_back("--quick");
+        if (options.quiet) args.push_back("--quiet");
+        if (options.verbose) args.push_back("--verbose");
+        if (options.resume) args.push_back("--resume");
+        args.insert(args.end(), filenames.begin(), filenames.end());
+        intptr_t pid = SpawnProcess(args);
+        if (pid == -1) {
+            fprintf(stderr, "pbrt: unable to start worker %d\n", w);
+            ok = false;
+            break;
+        }
+        pids.push_back(pid);
+    }
+    for (uint32_t w = 0; w < pids.size(); ++w) {
+        if (!WaitProcess(pids[w])) {
+            fprintf(stderr, "pbrt: worker %d failed\n", int(w));
+            ok = false;
+        }
+    }
+    if (!ok)
+        return 1;
+
+    pbrtInit(options);
+    ok = MergeDualTiles(tileFiles, options.imageFile);
+    pbrtCleanup();
+    if (ok)
+        for (uint32_t w = 0; w < tileFiles.size(); ++w)
+            remove(tileFiles[w].c_str());
+    return ok ? 0 : 1;
+}
+
 
 // main program
 int main(int argc, char *argv[]) {
     Options options;
     vector<string> filenames;
+    int nWorkers = 0;
+    bool mergeTiles = false;
     // Process command-line arguments
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--ncores")) options.nCores = atoi(argv[++i]);
@@ -48,13 +149,37 @@ int main(int argc, char *argv[]) {
         else if (!strcmp(argv[i], "--quick")) options.quickRender = true;
         else if (!strcmp(argv[i], "--quiet")) options.quiet = true;
         else if (!strcmp(argv[i], "--verbose")) options.verbose = true;
+        else if (!strcmp(argv[i], "--resume")) options.resume = true;
+        else if (!strcmp(argv[i], "--tile")) options.tile = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ntiles")) options.nTiles = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tilefile")) options.tileFile = argv[++i];
+        else if (!strcmp(argv[i], "--distribute")) nWorkers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--mergetiles")) mergeTiles = true;
         else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
             printf("usage: pbrt [--ncores n] [--outfile filename] [--quick] [--quiet] "
-                   "[--verbose] [--help] <filename.pbrt> ...\n");
+                   "[--verbose] [--resume] [--help] <filename.pbrt> ...\n"
+                   "  distributed rendering, with the \"dual\" film:\n"
+                   "    pbrt [options] --distribute n <filename.pbrt> ...\n"
+                   "      renders n tiles in local worker processes and merges them\n"
+                   "    pbrt [options] --tile i --ntiles n --tilefile tile.dual <filename.pbrt> ...\n"
+                   "      renders tile i of n and writes its buffers to tile.dual\n"
+                   "    pbrt [--outfile filename] --mergetiles <tile.dual> ...\n"
+                   "      merges the tiles into the denoised image\n");
             return 0;
         }
         else filenames.push_back(argv[i]);
     }
+    if (options.nTiles > 0 && (options.tile < 0 || options.tile >= options.nTiles ||
+                               options.tileFile == "")) {
+        fprintf(stderr, "pbrt: --tile needs 0 <= tile < --ntiles and a --tilefile\n");
+        return 1;
+    }
+    if (mergeTiles) {
+        pbrtInit(options);
+        bool ok = MergeDualTiles(filenames, options.imageFile);
+        pbrtCleanup();
+        return ok ? 0 : 1;
+    }
 
     // Print welcome banner
     if (!options.quiet) {
@@ -65,6 +190,8 @@ int main(int argc, char *argv[]) {
         printf("See the file LICENSE.txt for the conditions of the license.\n");
         fflush(stdout);
     }
+    if (nWorkers > 0)
+        return RenderDistributed(argv[0], options, filenames, nWorkers);
     pbrtInit(options);
     // Process scene description
     PBRT_STARTED_PARSING();
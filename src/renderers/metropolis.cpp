@@ -551,9 +551,11 @@ void MetropolisRenderer::Render(const Scene *scene) {
                                  (camera->film->xResolution * camera->film->yResolution) / (16*16));
                 nDirectTasks = RoundUpPow2(nDirectTasks);
                 ProgressReporter directProgress(nDirectTasks, "Direct Lighting");
+                WorkerLocal<RenderTaskScratch> scratch;
                 for (int i = 0; i < nDirectTasks; ++i)
                     directTasks.push_back(new SamplerRendererTask(scene, this, camera, directProgress,
-                                                                  &sampler, sample, false, i, nDirectTasks));
+                                                                  &sampler, sample, false, i, nDirectTasks,
+                                                                  &scratch));
                 std::reverse(directTasks.begin(), directTasks.end());
                 EnqueueTasks(directTasks);
                 WaitForAllTasks();
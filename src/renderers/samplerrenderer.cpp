@@ -68,33 +68,50 @@ void SamplerRendererTask::Run() {
         return;
     }
 
-    // Declare local variables used for rendering loop
-    MemoryArena arena;
+    // Declare local variables used for rendering loop. The memory arena and
+    // the space for samples and intersections are the worker's, only tasks
+    // run outside of the task workers allocate their own.
+    RenderTaskScratch *scratch = scratchPool ? scratchPool->Get() : NULL;
+    RenderTaskScratch *ownScratch = NULL;
+    if (!scratch)
+        scratch = ownScratch = new RenderTaskScratch;
+    scratch->Reserve(origSample, sampler->MaximumSampleCount());
+    MemoryArena &arena = scratch->arena;
     RNG rng(taskNum);
-
-    // Allocate space for samples and intersections
-    int maxSamples = sampler->MaximumSampleCount();
-    Sample *samples = origSample->Duplicate(maxSamples);
-    RayDifferential *rays = new RayDifferential[maxSamples];
-    Spectrum *Ls = new Spectrum[maxSamples];
-    Spectrum *Ts = new Spectrum[maxSamples];
-    Intersection *isects = new Intersection[maxSamples];
+    Sample *samples = scratch->samples;
+    RayDifferential *rays = scratch->rays;
+    Spectrum *Ls = scratch->Ls;
+    Spectrum *Ts = scratch->Ts;
+    Intersection *isects = scratch->isects;
+    float *rayWeights = scratch->rayWeights;
+    bool *hits = scratch->hits;
 
     // Get samples from _Sampler_ and update image
     int sampleCount;
     while ((sampleCount = sampler->GetMoreSamples(samples, rng)) > 0) {
-        // Generate camera rays and compute radiance along rays
+        // Generate camera rays
         for (int i = 0; i < sampleCount; ++i) {
             // Find camera ray for _sample[i]_
             PBRT_STARTED_GENERATING_CAMERA_RAY(&samples[i]);
-            float rayWeight = camera->GenerateRayDifferential(samples[i], &rays[i]);
+            rayWeights[i] = camera->GenerateRayDifferential(samples[i], &rays[i]);
             rays[i].ScaleDifferentials(1.f / sqrtf(sampler->samplesPerPixel));
-            PBRT_FINISHED_GENERATING_CAMERA_RAY(&samples[i], &rays[i], rayWeight);
+            PBRT_FINISHED_GENERATING_CAMERA_RAY(&samples[i], &rays[i], rayWeights[i]);
+        }
+
+        // With packet tracing, find the first hits of the whole batch at
+        // once. The rays of zero weight are traced too, but never shaded.
+        if (packetTracing)
+            scene->IntersectBatch(rays, isects, hits, sampleCount);
 
+        // Compute radiance along camera rays
+        for (int i = 0; i < sampleCount; ++i) {
+            float rayWeight = rayWeights[i];
             // Evaluate radiance along camera ray
             PBRT_STARTED_CAMERA_RAY_INTEGRATION(&rays[i], &samples[i]);
             if (visualizeObjectIds) {
-                if (rayWeight > 0.f && scene->Intersect(rays[i], &isects[i])) {
+                bool hit = packetTracing ? hits[i] :
+                    (rayWeight > 0.f && scene->Intersect(rays[i], &isects[i]));
+                if (rayWeight > 0.f && hit) {
                     // random shading based on shape id...
                     uint32_t ids[2] = { isects[i].shapeId, isects[i].primitiveId };
                     uint32_t h = hash((char *)ids, sizeof(ids));
@@ -108,8 +125,11 @@ void SamplerRendererTask::Run() {
             }
             else {
             if (rayWeight > 0.f)
-                Ls[i] = rayWeight * renderer->Li(scene, rays[i], &samples[i], rng,
-                                                 arena, &isects[i], &Ts[i]);
+                Ls[i] = rayWeight * (packetTracing ?
+                    renderer->LiIntersected(scene, rays[i], hits[i], isects[i],
+                                            &samples[i], rng, arena, &Ts[i]) :
+                    renderer->Li(scene, rays[i], &samples[i], rng,
+                                 arena, &isects[i], &Ts[i]));
             else {
                 Ls[i] = 0.f;
                 Ts[i] = 1.f;
@@ -154,11 +174,7 @@ void SamplerRendererTask::Run() {
     camera->film->UpdateDisplay(sampler->xPixelStart,
         sampler->yPixelStart, sampler->xPixelEnd+1, sampler->yPixelEnd+1);
     delete sampler;
-    delete[] samples;
-    delete[] rays;
-    delete[] Ls;
-    delete[] Ts;
-    delete[] isects;
+    delete ownScratch;
     reporter.Update();
     PBRT_FINISHED_RENDERTASK(taskNum);
 }
@@ -168,12 +184,13 @@ void SamplerRendererTask::Run() {
 // SamplerRenderer Method Definitions
 SamplerRenderer::SamplerRenderer(Sampler *s, Camera *c,
                                  SurfaceIntegrator *si, VolumeIntegrator *vi,
-                                 bool visIds) {
+                                 bool visIds, bool packets) {
     sampler = s;
     camera = c;
     surfaceIntegrator = si;
     volumeIntegrator = vi;
     visualizeObjectIds = visIds;
+    packetTracing = packets;
 }
 
 
@@ -204,12 +221,14 @@ void SamplerRenderer::Render(const Scene *scene) {
     int nTasks = max(32 * NumSystemCores(), nPixels / (16*16));
     nTasks = RoundUpPow2(nTasks);
     ProgressReporter reporter(nTasks, "Rendering");
+    WorkerLocal<RenderTaskScratch> scratch;
     vector<Task *> renderTasks;
     for (int i = 0; i < nTasks; ++i)
         renderTasks.push_back(new SamplerRendererTask(scene, this, camera,
                                                       reporter, sampler, sample, 
                                                       visualizeObjectIds, 
-                                                      nTasks-1-i, nTasks));
+                                                      nTasks-1-i, nTasks, &scratch,
+                                                      packetTracing));
     EnqueueTasks(renderTasks);
     WaitForAllTasks();
     for (uint32_t i = 0; i < renderTasks.size(); ++i)
@@ -227,14 +246,22 @@ Spectrum SamplerRenderer::Li(const Scene *scene,
         MemoryArena &arena, Intersection *isect, Spectrum *T) const {
     Assert(ray.time == sample->time);
     Assert(!ray.HasNaNs());
-    // Allocate local variables for _isect_ and _T_ if needed
-    Spectrum localT;
-    if (!T) T = &localT;
+    // Allocate local variable for _isect_ if needed
     Intersection localIsect;
     if (!isect) isect = &localIsect;
+    bool hit = scene->Intersect(ray, isect);
+    return LiIntersected(scene, ray, hit, *isect, sample, rng, arena, T);
+}
+
+
+Spectrum SamplerRenderer::LiIntersected(const Scene *scene,
+        const RayDifferential &ray, bool hit, const Intersection &isect,
+        const Sample *sample, RNG &rng, MemoryArena &arena, Spectrum *T) const {
+    Spectrum localT;
+    if (!T) T = &localT;
     Spectrum Li = 0.f;
-    if (scene->Intersect(ray, isect))
-        Li = surfaceIntegrator->Li(scene, this, ray, *isect, sample,
+    if (hit)
+        Li = surfaceIntegrator->Li(scene, this, ray, isect, sample,
                                    rng, arena);
     else {
         // Handle ray that doesn't intersect any geometry
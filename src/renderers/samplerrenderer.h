@@ -46,17 +46,23 @@ class SamplerRenderer : public Renderer {
 public:
     // SamplerRenderer Public Methods
     SamplerRenderer(Sampler *s, Camera *c, SurfaceIntegrator *si,
-                    VolumeIntegrator *vi, bool visIds);
+                    VolumeIntegrator *vi, bool visIds, bool packets = false);
     ~SamplerRenderer();
     void Render(const Scene *scene);
     Spectrum Li(const Scene *scene, const RayDifferential &ray,
         const Sample *sample, RNG &rng, MemoryArena &arena,
         Intersection *isect = NULL, Spectrum *T = NULL) const;
+    Spectrum LiIntersected(const Scene *scene, const RayDifferential &ray,
+        bool hit, const Intersection &isect, const Sample *sample, RNG &rng,
+        MemoryArena &arena, Spectrum *T = NULL) const;
     Spectrum Transmittance(const Scene *scene, const RayDifferential &ray,
         const Sample *sample, RNG &rng, MemoryArena &arena) const;
 private:
     // SamplerRenderer Private Data
     bool visualizeObjectIds;
+    // Intersect the camera rays of each sample batch together, see
+    // Primitive::IntersectBatch()
+    bool packetTracing;
     Sampler *sampler;
     Camera *camera;
     SurfaceIntegrator *surfaceIntegrator;
@@ -71,11 +77,14 @@ public:
     // SamplerRendererTask Public Methods
     SamplerRendererTask(const Scene *sc, Renderer *ren, Camera *c,
                         ProgressReporter &pr, Sampler *ms, Sample *sam, 
-                        bool visIds, int tn, int tc)
+                        bool visIds, int tn, int tc,
+                        WorkerLocal<RenderTaskScratch> *scr = NULL,
+                        bool packets = false)
       : reporter(pr)
     {
         scene = sc; renderer = ren; camera = c; mainSampler = ms;
         origSample = sam; visualizeObjectIds = visIds; taskNum = tn; taskCount = tc;
+        scratchPool = scr; packetTracing = packets;
     }
     void Run();
 private:
@@ -88,6 +97,8 @@ private:
     Sample *origSample;
     bool visualizeObjectIds;
     int taskNum, taskCount;
+    WorkerLocal<RenderTaskScratch> *scratchPool;
+    bool packetTracing;
 };
 
 
@@ -34,6 +34,8 @@
 #include "camera.h"
 #include "intersection.h"
 #include "samplers/dualsampler.h"
+#include "timer.h"
+#include "fileutil.h"
 
 static uint32_t hash(char *key, uint32_t len)
 {
@@ -49,9 +51,96 @@ static uint32_t hash(char *key, uint32_t len)
     return hash;
 }
 
+// Progress of the adaptive phase, saved in the checkpoints along with the
+// film buffers and the DualSampler state
+struct TwoStagesProgress {
+    int32_t nextIteration;      // adaptive iterations already completed
+    int32_t nPixelsPerIteration;
+    double samplesPerSec, denoiseTime;
+    double elapsed;             // time spent rendering, for the time budget
+};
+
+// The checkpoint starts with a magic string, a version number and the
+// settings it must be resumed with, followed by a TwoStagesProgress, the
+// film buffers and the sampler state, in native byte order
+static const char CHECKPOINT_MAGIC[8] = { 'P', 'B', 'R', 'T', 'C', 'K', 'P', 'T' };
+static const int32_t CHECKPOINT_VERSION = 2;
+
+static void CheckpointHeader(const DualFilm *film, DualSampler *sampler,
+        int32_t header[5]) {
+    header[0] = CHECKPOINT_VERSION;
+    header[1] = film->GetXPixelCount();
+    header[2] = film->GetYPixelCount();
+    header[3] = sampler->samplesPerPixel;
+    header[4] = sampler->GetIterationCount();
+}
+
+
+// The checkpoint is written next to 'filename' and renamed over it, so that a
+// render killed meanwhile leaves the previous checkpoint intact
+static bool WriteCheckpoint(const string &filename, const DualFilm *film,
+        DualSampler *sampler, const TwoStagesProgress &progress) {
+    string tmpFilename = filename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Error("Unable to open \"%s\" to write the checkpoint", tmpFilename.c_str());
+        return false;
+    }
+    int32_t header[5];
+    CheckpointHeader(film, sampler, header);
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, 8, f) == 8 &&
+              fwrite(header, sizeof(int32_t), 5, f) == 5 &&
+              fwrite(&progress, sizeof(progress), 1, f) == 1 &&
+              film->WriteCheckpoint(f) && sampler->WriteCheckpoint(f);
+    if (ok)
+        ok = CommitFile(f, tmpFilename, filename);
+    else {
+        fclose(f);
+        remove(tmpFilename.c_str());
+    }
+    if (!ok)
+        Error("Error writing the checkpoint \"%s\"", filename.c_str());
+    return ok;
+}
+
+
+// Returns false, with the film and the sampler untouched, if there is no
+// checkpoint of this render to resume from
+static bool ReadCheckpoint(const string &filename, DualFilm *film,
+        DualSampler *sampler, TwoStagesProgress *progress) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Warning("No checkpoint \"%s\" to resume from, starting over",
+                filename.c_str());
+        return false;
+    }
+    char magic[8];
+    int32_t header[5], expected[5];
+    CheckpointHeader(film, sampler, expected);
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+        fread(header, sizeof(int32_t), 5, f) != 5 ||
+        memcmp(header, expected, sizeof(header)) != 0 ||
+        fread(progress, sizeof(*progress), 1, f) != 1) {
+        Warning("\"%s\" isn't a checkpoint of this render, starting over",
+                filename.c_str());
+        fclose(f);
+        return false;
+    }
+    // The file is only ever replaced whole, so a short read here means it
+    // was damaged, and the film was already partly overwritten
+    bool ok = film->ReadCheckpoint(f) && sampler->ReadCheckpoint(f);
+    fclose(f);
+    if (!ok)
+        Severe("Checkpoint \"%s\" is truncated", filename.c_str());
+    return true;
+}
+
+
 // TwoStagesSamplerRendererTask Definitions
 void TwoStagesSamplerRendererTask::Run() {
     PBRT_STARTED_RENDERTASK(taskNum);
+    Timer timer;
+    timer.Start();
     // Get sub-_Sampler_ for _TwoStagesSamplerRendererTask_
     Sampler *sampler = mainSampler->GetSubSampler(taskNum, taskCount);
     if (!sampler)
@@ -64,33 +153,63 @@ void TwoStagesSamplerRendererTask::Run() {
     //
     DualFilm *dualfilm = dynamic_cast<DualFilm*> (camera->film);
     bool singleBuffered = (dualfilm == NULL);
-    // Declare local variables used for rendering loop
-    MemoryArena arena;
+    TargetBuffer target = (taskNum < taskCount/2) ? BUFFER_A : BUFFER_B;
+    // The sub-samplers of a DualSampler keep the extent of the whole film,
+    // their own pixels are their sub-window
+    int x0 = sampler->xPixelStart, x1 = sampler->xPixelEnd;
+    int y0 = sampler->yPixelStart, y1 = sampler->yPixelEnd;
+    if (dualSampler)
+        static_cast<DualSampler *>(sampler)->GetSubWindow(&x0, &x1, &y0, &y1);
+    // Private accumulation tile covering this task's pixels, merged at the end
+    DualFilmTile *tile = NULL;
+    if (!singleBuffered)
+        tile = dualfilm->CreateTile(x0, x1, y0, y1, target);
+    // Declare local variables used for rendering loop. The memory arena and
+    // the space for samples and intersections are the worker's, only tasks
+    // run outside of the task workers allocate their own.
+    RenderTaskScratch *scratch = scratchPool ? scratchPool->Get() : NULL;
+    RenderTaskScratch *ownScratch = NULL;
+    if (!scratch)
+        scratch = ownScratch = new RenderTaskScratch;
+    scratch->Reserve(origSample, sampler->MaximumSampleCount());
+    MemoryArena &arena = scratch->arena;
     RNG rng(taskNum);
-
-    // Allocate space for samples and intersections
-    int maxSamples = sampler->MaximumSampleCount();
-    Sample *samples = origSample->Duplicate(maxSamples);
-    RayDifferential *rays = new RayDifferential[maxSamples];
-    Spectrum *Ls = new Spectrum[maxSamples];
-    Spectrum *Ts = new Spectrum[maxSamples];
-    Intersection *isects = new Intersection[maxSamples];
+    Sample *samples = scratch->samples;
+    RayDifferential *rays = scratch->rays;
+    Spectrum *Ls = scratch->Ls;
+    Spectrum *Ts = scratch->Ts;
+    Intersection *isects = scratch->isects;
+    float *rayWeights = scratch->rayWeights;
+    bool *hits = scratch->hits;
 
     // Get samples from _Sampler_ and update image
     int sampleCount;
+    int64_t nSamples = 0;
     while ((sampleCount = sampler->GetMoreSamples(samples, rng)) > 0) {
-        // Generate camera rays and compute radiance along rays
+        nSamples += sampleCount;
+        // Generate camera rays
         for (int i = 0; i < sampleCount; ++i) {
             // Find camera ray for _sample[i]_
             PBRT_STARTED_GENERATING_CAMERA_RAY(&samples[i]);
-            float rayWeight = camera->GenerateRayDifferential(samples[i], &rays[i]);
+            rayWeights[i] = camera->GenerateRayDifferential(samples[i], &rays[i]);
             rays[i].ScaleDifferentials(1.f / sqrtf(sampler->samplesPerPixel));
-            PBRT_FINISHED_GENERATING_CAMERA_RAY(&samples[i], &rays[i], rayWeight);
+            PBRT_FINISHED_GENERATING_CAMERA_RAY(&samples[i], &rays[i], rayWeights[i]);
+        }
+
+        // With packet tracing, find the first hits of the whole batch at
+        // once. The rays of zero weight are traced too, but never shaded.
+        if (packetTracing)
+            scene->IntersectBatch(rays, isects, hits, sampleCount);
 
+        // Compute radiance along camera rays
+        for (int i = 0; i < sampleCount; ++i) {
+            float rayWeight = rayWeights[i];
             // Evaluate radiance along camera ray
             PBRT_STARTED_CAMERA_RAY_INTEGRATION(&rays[i], &samples[i]);
             if (visualizeObjectIds) {
-                if (rayWeight > 0.f && scene->Intersect(rays[i], &isects[i])) {
+                bool hit = packetTracing ? hits[i] :
+                    (rayWeight > 0.f && scene->Intersect(rays[i], &isects[i]));
+                if (rayWeight > 0.f && hit) {
                     // random shading based on shape id...
                     uint32_t ids[2] = { isects[i].shapeId, isects[i].primitiveId };
                     uint32_t h = hash((char *)ids, sizeof(ids));
@@ -103,8 +222,11 @@ void TwoStagesSamplerRendererTask::Run() {
             }
             else {
             if (rayWeight > 0.f) {
-                Ls[i] = rayWeight * renderer->Li(scene, rays[i], &samples[i], rng,
-                                                 arena, &isects[i], &Ts[i]);
+                Ls[i] = rayWeight * (packetTracing ?
+                    renderer->LiIntersected(scene, rays[i], hits[i], isects[i],
+                                            &samples[i], rng, arena, &Ts[i]) :
+                    renderer->Li(scene, rays[i], &samples[i], rng,
+                                 arena, &isects[i], &Ts[i]));
             }
             else {
                 Ls[i] = 0.f;
@@ -143,11 +265,13 @@ void TwoStagesSamplerRendererTask::Run() {
                 }
             }
             else {
-                TargetBuffer target = (taskNum < taskCount/2) ? BUFFER_A : BUFFER_B;
                 for (int i = 0; i < sampleCount; ++i)
                 {
                     PBRT_STARTED_ADDING_IMAGE_SAMPLE(&samples[i], &rays[i], &Ls[i], &Ts[i]);
-                    dualfilm->AddSample(samples[i], Ls[i], target);
+                    if (tile)
+                        dualfilm->AddSample(samples[i], Ls[i], tile);
+                    else
+                        dualfilm->AddSample(samples[i], Ls[i], target);
                     PBRT_FINISHED_ADDING_IMAGE_SAMPLE();
                 }
             }
@@ -158,28 +282,60 @@ void TwoStagesSamplerRendererTask::Run() {
     }
 
     // Clean up after _TwoStagesSamplerRendererTask_ is done with its image region
-    camera->film->UpdateDisplay(sampler->xPixelStart,
-        sampler->yPixelStart, sampler->xPixelEnd+1, sampler->yPixelEnd+1);
+    if (tile) {
+        dualfilm->MergeTile(tile);
+        delete tile;
+    }
+    camera->film->UpdateDisplay(x0, y0, x1+1, y1+1);
     delete sampler;
-    delete[] samples;
-    delete[] rays;
-    delete[] Ls;
-    delete[] Ts;
-    delete[] isects;
+    delete ownScratch;
+    if (stats) {
+        stats->nSamples = nSamples;
+        stats->seconds = timer.Time();
+    }
     reporter.Update();
     PBRT_FINISHED_RENDERTASK(taskNum);
 }
 
 
+// Report how evenly the tasks of adaptive iteration 'iter' shared the work,
+// as the ratios of the largest task to the average one
+static void ReportTaskBalance(int iter, const vector<RenderTaskStats> &stats) {
+    int64_t maxSamples = 0, sumSamples = 0;
+    double maxSeconds = 0., sumSeconds = 0.;
+    for (uint32_t i = 0; i < stats.size(); ++i) {
+        maxSamples = max(maxSamples, stats[i].nSamples);
+        sumSamples += stats[i].nSamples;
+        maxSeconds = max(maxSeconds, stats[i].seconds);
+        sumSeconds += stats[i].seconds;
+    }
+    if (sumSamples == 0 || sumSeconds <= 0.)
+        return;
+    double n = stats.size();
+    Info("Adaptive iteration %d: %d tasks, samples max/mean %.2f, "
+         "time max/mean %.2f (longest task %.3fs)", iter, int(stats.size()),
+         maxSamples * n / sumSamples, maxSeconds * n / sumSeconds, maxSeconds);
+}
+
+
 
 // TwoStagesSamplerRenderer Method Definitions
 TwoStagesSamplerRenderer::TwoStagesSamplerRenderer(Sampler *s, Camera *c,
-    SurfaceIntegrator *si, VolumeIntegrator *vi, bool visIds) {
+    SurfaceIntegrator *si, VolumeIntegrator *vi, bool visIds,
+    float budget, float stale, const string &ckptFile, float ckptInterval,
+    bool packets) {
     sampler = s;
     camera = c;
     surfaceIntegrator = si;
     volumeIntegrator = vi;
     visualizeObjectIds = visIds;
+    timeBudget = budget;
+    staleness = Clamp(stale, 0.f, 1.f);
+    checkpointFile = ckptFile;
+    checkpointInterval = ckptInterval;
+    packetTracing = packets;
+    if (PbrtOptions.resume && checkpointFile == "")
+        Warning("--resume given but the renderer has no \"checkpoint\" file");
 }
 
 
@@ -194,6 +350,9 @@ TwoStagesSamplerRenderer::~TwoStagesSamplerRenderer() {
 // call by api.c => pbrtWorldEnd()
 //
 void TwoStagesSamplerRenderer::Render(const Scene *scene) {
+    // The time budget covers everything from here to the written image
+    Timer timer;
+    timer.Start();
     PBRT_FINISHED_PARSING();
     // Allow integrators to do preprocessing for the scene
     PBRT_STARTED_PREPROCESSING();
@@ -204,64 +363,200 @@ void TwoStagesSamplerRenderer::Render(const Scene *scene) {
     // Allocate and initialize _sample_
     Sample *sample = new Sample(sampler, surfaceIntegrator,
                                 volumeIntegrator, scene);
+    // Sample arrays and memory arenas shared by the tasks of all the passes
+    WorkerLocal<RenderTaskScratch> scratch;
 
     // Create and launch _TwoStagesSamplerRendererTask_s for rendering image
 
     DualSampler *dualSampler = dynamic_cast<DualSampler *> (sampler);
+    // Time spent by the interrupted renders this one resumes
+    double timeOffset = 0.;
 
     if (dualSampler != NULL) {
-        // Initialization phase using uniform sampling
+        DualFilm *dualFilm = dynamic_cast<DualFilm *>(camera->film);
         // Compute number of _TwoStagesSamplerRendererTask_s to create for rendering
         int nPixels = camera->film->xResolution * camera->film->yResolution;
         int nTasks = max(32 * NumSystemCores(), nPixels / (16*16));
         nTasks = RoundUpPow2(nTasks);
-        // Distribute the workload
-        ProgressReporter reporter(nTasks, "Rendering");
         vector<Task *> renderTasks;
-        for (int i = 0; i < nTasks; ++i)
-            renderTasks.push_back(new TwoStagesSamplerRendererTask(scene, this,
-                camera, reporter, sampler, sample, visualizeObjectIds, nTasks-1-i, nTasks, true));
-        EnqueueTasks(renderTasks);
-        WaitForAllTasks();
-        for (uint32_t i = 0; i < renderTasks.size(); ++i)
-            delete renderTasks[i];
-        renderTasks.clear();
+        int nIterations = dualSampler->GetIterationCount();
+        TwoStagesProgress progress;
+        bool resumed = PbrtOptions.resume && checkpointFile != "" &&
+            ReadCheckpoint(checkpointFile, dualFilm, dualSampler, &progress);
+        double lastCheckpoint = 0.;
+        if (resumed) {
+            timeOffset = progress.elapsed;
+            if (!PbrtOptions.quiet)
+                printf("Resuming after %d of %d adaptive iterations\n",
+                       progress.nextIteration, nIterations);
+        }
+        else {
+            // Initialization phase using uniform sampling
+            ProgressReporter reporter(nTasks, "Rendering");
+            for (int i = 0; i < nTasks; ++i)
+                renderTasks.push_back(new TwoStagesSamplerRendererTask(scene, this,
+                    camera, reporter, sampler, sample, visualizeObjectIds, nTasks-1-i, nTasks, true,
+                    NULL, &scratch, packetTracing));
+            double initStart = timer.Time();
+            EnqueueTasks(renderTasks);
+            WaitForAllTasks();
+            // Sampling throughput, used to size the iterations of a time budget
+            progress.samplesPerSec = dualSampler->GetInitSampleCount() /
+                max(timer.Time() - initStart, 1e-3);
+            for (uint32_t i = 0; i < renderTasks.size(); ++i)
+                delete renderTasks[i];
+            renderTasks.clear();
+            reporter.Done();
+
+            progress.nextIteration = 0;
+            progress.nPixelsPerIteration = (nIterations > 0) ?
+                Ceil2Int(float(dualSampler->PixelsToSampleTotal()) / nIterations) : 0;
+            progress.denoiseTime = 0.;
+            // With a time budget, the iterations are sized from the measured
+            // throughput instead of the sample budget
+            if (timeBudget > 0.f && dualSampler->PixelsToSampleTotal() > 0)
+                dualSampler->SetPixelsToSampleTotal(nIterations * dualSampler->GetPixelCount());
+            if (checkpointFile != "") {
+                progress.elapsed = timer.Time();
+                WriteCheckpoint(checkpointFile, dualFilm, dualSampler, progress);
+                lastCheckpoint = timer.Time();
+            }
+        }
         if (dualSampler->PixelsToSampleTotal() == 0)
             dualSampler->Finalize();
-        reporter.Done();
 
         // Adaptive phase. If the there is no pixels left to sample, the user
         // requested uniform sampling and we skip the adaptive phase.
         if (dualSampler->PixelsToSampleTotal() > 0) {
             dualSampler->SetAdaptiveMode();
-            // Compute number of _TwoStagesSamplerRendererTask_s to create for rendering
-            int nIterations = dualSampler->GetIterationCount();
-            int nPixelsPerIteration = Ceil2Int(float(dualSampler->PixelsToSampleTotal()) / nIterations);
-            nTasks = max(32 * NumSystemCores(), nPixels / (16*16));
-            nTasks = RoundUpPow2(nTasks);
-            int nTasksTotal = nIterations * nTasks;
+            int nPixelsPerIteration = progress.nPixelsPerIteration;
+            double samplesPerSec = progress.samplesPerSec;
+            double denoiseTime = progress.denoiseTime;
+            int spp = dualSampler->samplesPerPixel;
+            int firstIter = progress.nextIteration;
+            int nTasksTotal = (nIterations - firstIter) * nTasks;
             // Set the progress reporter
             ProgressReporter reporterAdapt(nTasksTotal, "Adaptive Rendering");
-            for (int iter = 0; iter < nIterations; iter++) {
-                dualSampler->GetSamplingMaps(nPixelsPerIteration);
-
-                // Generate tasks
-                for (int i = 0; i < nTasks; ++i)
-                    renderTasks.push_back(new TwoStagesSamplerRendererTask(
-                        scene, this, camera, reporterAdapt, sampler, sample,
-                        visualizeObjectIds, nTasks-1-i, nTasks, true));
-
-                // Do the work
-                EnqueueTasks(renderTasks);
-                WaitForAllTasks();
-
-                // Clean up
-                for (uint32_t i = 0; i < renderTasks.size(); ++i)
-                    delete renderTasks[i];
-                renderTasks.clear();
+            int iter;
+            bool converged = false;
+            for (iter = firstIter; iter < nIterations; iter++) {
+                // With a non-zero staleness, all iterations but the first
+                // overlap their denoising with rendering, see below. The
+                // first iteration after resuming has no previous maps either.
+                bool pipelined = (staleness > 0.f && iter > firstIter);
+                if (!pipelined) {
+                    // Stop early if the image already meets the error threshold
+                    double denoiseStart = timer.Time();
+                    if (!dualSampler->UpdatePixelErrors()) {
+                        converged = true;
+                        break;
+                    }
+                    denoiseTime = timer.Time() - denoiseStart;
+                }
+
+                if (timeBudget > 0.f) {
+                    // Share the remaining time between the iterations left,
+                    // keeping one denoising per iteration plus the final one
+                    int nLeft = nIterations - iter;
+                    double timeLeft = timeBudget - timeOffset - timer.Time() -
+                        nLeft * denoiseTime;
+                    double nSamples = samplesPerSec * timeLeft / nLeft;
+                    nPixelsPerIteration = (int)min(nSamples / spp,
+                        (double)dualSampler->GetPixelCount());
+                    if (nPixelsPerIteration <= 0)
+                        break;
+                }
+                double iterStart = timer.Time();
+
+                // In pipelined mode, the first 'staleness' fraction of the
+                // samples is drawn from the maps of the previous iteration,
+                // while the denoiser works on a snapshot of the buffers. The
+                // rest is drawn from the updated maps. The iteration's tasks
+                // are split between the two parts so that the progress
+                // reporter total still holds.
+                int nPixelsStale = 0;
+                if (pipelined)
+                    nPixelsStale = min(nPixelsPerIteration,
+                        Ceil2Int(staleness * nPixelsPerIteration));
+                int nParts = (nPixelsStale > 0 && nPixelsStale < nPixelsPerIteration) ? 2 : 1;
+                int nPartTasks = nTasks / nParts;
+                vector<RenderTaskStats> taskStats(nTasks);
+                int part = 0;
+                if (pipelined) {
+                    dualSampler->GetSamplingMaps(nPixelsStale);
+                    vector<Task *> denoiseTasks;
+                    dualSampler->BeginPixelErrors(denoiseTasks);
+                    for (int i = 0; i < nPartTasks; ++i)
+                        renderTasks.push_back(new TwoStagesSamplerRendererTask(
+                            scene, this, camera, reporterAdapt, sampler, sample,
+                            visualizeObjectIds, nPartTasks-1-i, nPartTasks, true,
+                            &taskStats[nPartTasks-1-i], &scratch, packetTracing));
+                    part++;
+
+                    // Tasks are run last in, first out: queue the denoising
+                    // last so that its longer tasks start first
+                    EnqueueTasks(renderTasks);
+                    EnqueueTasks(denoiseTasks);
+                    WaitForAllTasks();
+                    for (uint32_t i = 0; i < renderTasks.size(); ++i)
+                        delete renderTasks[i];
+                    renderTasks.clear();
+                    if (!dualSampler->EndPixelErrors(denoiseTasks)) {
+                        converged = true;
+                        break;
+                    }
+                }
+                if (nPixelsStale < nPixelsPerIteration) {
+                    dualSampler->GetSamplingMaps(nPixelsPerIteration - nPixelsStale);
+
+                    // Generate tasks
+                    for (int i = 0; i < nPartTasks; ++i)
+                        renderTasks.push_back(new TwoStagesSamplerRendererTask(
+                            scene, this, camera, reporterAdapt, sampler, sample,
+                            visualizeObjectIds, nPartTasks-1-i, nPartTasks, true,
+                            &taskStats[part*nPartTasks + nPartTasks-1-i],
+                            &scratch, packetTracing));
+
+                    // Do the work
+                    EnqueueTasks(renderTasks);
+                    WaitForAllTasks();
+
+                    // Clean up
+                    for (uint32_t i = 0; i < renderTasks.size(); ++i)
+                        delete renderTasks[i];
+                    renderTasks.clear();
+                }
+
+                // Track the throughput of the adaptive sampling, which
+                // typically favors the costlier pixels
+                samplesPerSec = double(nPixelsPerIteration) * spp /
+                    max(timer.Time() - iterStart, 1e-3);
+                ReportTaskBalance(iter, taskStats);
+
+                if (checkpointFile != "" &&
+                    timer.Time() - lastCheckpoint >= checkpointInterval) {
+                    progress.nextIteration = iter + 1;
+                    progress.nPixelsPerIteration = nPixelsPerIteration;
+                    progress.samplesPerSec = samplesPerSec;
+                    progress.denoiseTime = denoiseTime;
+                    progress.elapsed = timeOffset + timer.Time();
+                    WriteCheckpoint(checkpointFile, dualFilm, dualSampler, progress);
+                    lastCheckpoint = timer.Time();
+                }
             }
             dualSampler->Finalize();
             reporterAdapt.Done();
+            if (converged && !PbrtOptions.quiet) {
+                printf("Error threshold reached after %d of %d adaptive "
+                       "iterations (error %g)", iter, nIterations,
+                       dualSampler->GetError());
+                // A time budget has no sample count to save from
+                if (timeBudget == 0.f) {
+                    int64_t saved = (int64_t)dualSampler->PixelsToSampleTotal() * spp;
+                    printf(", %lld samples saved", (long long)saved);
+                }
+                printf("\n");
+            }
         }
     }
     else {
@@ -274,7 +569,7 @@ void TwoStagesSamplerRenderer::Render(const Scene *scene) {
         for (int i = 0; i < nTasks; ++i)
             renderTasks.push_back(new TwoStagesSamplerRendererTask(scene, this,
                 camera, reporter, sampler, sample, visualizeObjectIds,
-                nTasks-1-i, nTasks));
+                nTasks-1-i, nTasks, false, NULL, &scratch, packetTracing));
         EnqueueTasks(renderTasks);
         WaitForAllTasks();
         for (uint32_t i = 0; i < renderTasks.size(); ++i)
@@ -286,6 +581,9 @@ void TwoStagesSamplerRenderer::Render(const Scene *scene) {
     // Clean up after rendering and store final image
     delete sample;
     camera->film->WriteImage();
+    if (timeBudget > 0.f && !PbrtOptions.quiet)
+        printf("Rendered in %.2fs with a time budget of %.2fs\n",
+               timeOffset + timer.Time(), timeBudget);
 }
 
 
@@ -295,14 +593,22 @@ Spectrum TwoStagesSamplerRenderer::Li(const Scene *scene,
     Spectrum *T) const {
     Assert(ray.time == sample->time);
     Assert(!ray.HasNaNs());
-    // Allocate local variables for _isect_ and _T_ if needed
-    Spectrum localT;
-    if (!T) T = &localT;
+    // Allocate local variable for _isect_ if needed
     Intersection localIsect;
     if (!isect) isect = &localIsect;
+    bool hit = scene->Intersect(ray, isect);
+    return LiIntersected(scene, ray, hit, *isect, sample, rng, arena, T);
+}
+
+
+Spectrum TwoStagesSamplerRenderer::LiIntersected(const Scene *scene,
+        const RayDifferential &ray, bool hit, const Intersection &isect,
+        const Sample *sample, RNG &rng, MemoryArena &arena, Spectrum *T) const {
+    Spectrum localT;
+    if (!T) T = &localT;
     Spectrum Li = 0.f;
-    if (scene->Intersect(ray, isect)) {
-        Li = surfaceIntegrator->Li(scene, this, ray, *isect, sample,
+    if (hit) {
+        Li = surfaceIntegrator->Li(scene, this, ray, isect, sample,
                                    rng, arena);
     }
     else {
@@ -312,7 +618,6 @@ Spectrum TwoStagesSamplerRenderer::Li(const Scene *scene,
     }
     Spectrum Lvi = volumeIntegrator->Li(scene, this, ray, sample, rng,
                                         T, arena);
-    // Restore the old isect, in case it was NULL
     return *T * Li + Lvi;
 }
 
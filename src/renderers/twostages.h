@@ -40,12 +40,17 @@ class TwoStagesSamplerRenderer : public Renderer {
 public:
     // TwoStagesSamplerRenderer Public Methods
     TwoStagesSamplerRenderer(Sampler *s, Camera *c, SurfaceIntegrator *si,
-                    VolumeIntegrator *vi, bool visIds);
+                    VolumeIntegrator *vi, bool visIds, float timeBudget = 0.f,
+                    float staleness = 0.f, const string &checkpointFile = "",
+                    float checkpointInterval = 0.f, bool packets = false);
     ~TwoStagesSamplerRenderer();
     void Render(const Scene *scene);
     Spectrum Li(const Scene *scene, const RayDifferential &ray,
         const Sample *sample, RNG &rng, MemoryArena &arena,
         Intersection *isect = NULL, Spectrum *T = NULL) const;
+    Spectrum LiIntersected(const Scene *scene, const RayDifferential &ray,
+        bool hit, const Intersection &isect, const Sample *sample, RNG &rng,
+        MemoryArena &arena, Spectrum *T = NULL) const;
     Spectrum Transmittance(const Scene *scene, const RayDifferential &ray,
         const Sample *sample, RNG &rng, MemoryArena &arena) const;
 private:
@@ -55,22 +60,49 @@ private:
     Camera *camera;
     SurfaceIntegrator *surfaceIntegrator;
     VolumeIntegrator *volumeIntegrator;
+    // Wall-clock time for rendering and writing the image, in seconds. When
+    // set, it replaces the adaptive sample budget of the DualSampler.
+    float timeBudget;
+    // Fraction of each adaptive iteration sampled with the maps of the
+    // previous iteration while the denoiser runs. 0 runs the iterations
+    // strictly one after the other.
+    float staleness;
+    // File the progress is saved to after the initialization phase and the
+    // adaptive iterations, at most once per 'checkpointInterval' seconds.
+    // With --resume, the render continues from it. Empty disables both.
+    string checkpointFile;
+    float checkpointInterval;
+    // Intersect the camera rays of each sample batch together, see
+    // Primitive::IntersectBatch()
+    bool packetTracing;
 };
 
 
 
+// Work done by one render task, used to report how evenly the tasks of an
+// adaptive iteration share it
+struct RenderTaskStats {
+    RenderTaskStats() : nSamples(0), seconds(0.) { }
+    int64_t nSamples;
+    double seconds;
+};
+
+
 // TwoStagesSamplerRendererTask Declarations
 class TwoStagesSamplerRendererTask : public Task {
 public:
     // TwoStagesSamplerRendererTask Public Methods
     TwoStagesSamplerRendererTask(const Scene *sc, TwoStagesSamplerRenderer *ren, Camera *c,
                         ProgressReporter &pr, Sampler *ms, Sample *sam,
-                        bool visIds, int tn, int tc, bool isDual = false)
+                        bool visIds, int tn, int tc, bool isDual = false,
+                        RenderTaskStats *st = NULL,
+                        WorkerLocal<RenderTaskScratch> *scr = NULL,
+                        bool packets = false)
       : reporter(pr)
     {
         scene = sc; renderer = ren; camera = c; mainSampler = ms;
         origSample = sam; visualizeObjectIds = visIds; taskNum = tn; taskCount = tc;
-        dualSampler = isDual;
+        dualSampler = isDual; stats = st; scratchPool = scr; packetTracing = packets;
     }
     void Run();
 private:
@@ -84,6 +116,9 @@ private:
     Sample *origSample;
     bool visualizeObjectIds;
     int taskNum, taskCount;
+    RenderTaskStats *stats;
+    WorkerLocal<RenderTaskScratch> *scratchPool;
+    bool packetTracing;
 };
 
 
@@ -15,16 +15,66 @@
 #include "montecarlo.h"
 #include "camera.h"
 
+// Finalization mix of MurmurHash3, every input bit affects every output bit
+static inline uint32_t MixBits(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+
+// Bits of 'n' in reverse order
+static inline uint32_t ReverseBits(uint32_t n) {
+    n = (n << 16) | (n >> 16);
+    n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+    n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+    n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+    n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+    return n;
+}
+
+
+// Scrambling seed of dimension 'dim' of the pixel with seed 'pixelSeed'
+static inline uint32_t DimensionSeed(uint32_t pixelSeed, uint32_t dim) {
+    return MixBits(pixelSeed + dim * 0x9e3779b9u);
+}
+
+
+// Sum of the pixels [x0,x1) x [y0,y1) from a summed-area table of width 'w'
+static inline double SummedArea(const double *sums, int w, int x0, int x1,
+        int y0, int y1) {
+    return sums[y1*w + x1] - sums[y0*w + x1] - sums[y1*w + x0] + sums[y0*w + x0];
+}
+
+
+// Sum of the part of [x0,x1) x [y0,y1) before the cut 's', along x or y
+static inline double HeadSum(const double *sums, int w, bool splitX, int x0,
+        int x1, int y0, int y1, int s) {
+    return splitX ? SummedArea(sums, w, x0, s, y0, y1) :
+                    SummedArea(sums, w, x0, x1, y0, s);
+}
+
+
 DualSampler::DualSampler(int xstart, int xend, int ystart, int yend,
-    int spp, float sopen, float sclose, float threshold, int nIterations,
-    int sppInit, const DualFilm *film)
+    int spp, float sopen, float sclose, float threshold, float errPercentile,
+    int nIterations, int sppInit, int batchSize, bool ldSampling,
+    const DualFilm *film)
     : Sampler(xstart, xend, ystart, yend, spp, sopen, sclose),
       _xPixelCount(film->GetXPixelCount()),
       _yPixelCount(film->GetYPixelCount()),
       _nIterations(nIterations),
+      _batchSize(max(batchSize, spp)),
+      _ldSampling(ldSampling),
+      _threshold(threshold),
+      _errPercentile(errPercentile),
       _film(film) {
+    int xFilmEnd, yFilmEnd;
+    film->GetPixelExtent(&_xFilmStart, &xFilmEnd, &_yFilmStart, &yFilmEnd);
     _sppInitReq = sppInit;
-    _samplesBuf = NULL;
+    _firstPass = true;
     initBase(NULL);
 }
 
@@ -37,9 +87,15 @@ DualSampler::DualSampler(const DualSampler *parent, int xstart,
     : Sampler(parent->xPixelStart, parent->xPixelEnd, parent->yPixelStart,
       parent->yPixelEnd, parent->samplesPerPixel, parent->shutterOpen,
       parent->shutterClose),
+      _xFilmStart(parent->_xFilmStart),
+      _yFilmStart(parent->_yFilmStart),
       _xPixelCount(parent->_xPixelCount),
       _yPixelCount(parent->_yPixelCount),
       _nIterations(parent->_nIterations),
+      _batchSize(parent->_batchSize),
+      _ldSampling(parent->_ldSampling),
+      _threshold(parent->_threshold),
+      _errPercentile(parent->_errPercentile),
       _film(parent->_film) {
 
     _xPos = xstart;
@@ -47,7 +103,6 @@ DualSampler::DualSampler(const DualSampler *parent, int xstart,
     _xStartSub = xstart; _xEndSub = xend;
     _yStartSub = ystart; _yEndSub = yend;
     _sppInitReq = parent->_sppInitReq;
-    _samplesBuf = NULL;
     initBase(parent, firstPass);
 }
 
@@ -57,19 +112,26 @@ DualSampler::DualSampler(const DualSampler *parent, int xstart,
 // This version of the sampler uses a sampling map to drive the sampling.
 DualSampler::DualSampler(const DualSampler *parent, int xstart,
     int xend, int ystart, int yend, float *samplingMap,
-    NlmeansScramblingInfo *scrambling)
+    uint32_t *nGenerated, bool firstPass)
     : Sampler(parent->xPixelStart, parent->xPixelEnd, parent->yPixelStart,
       parent->yPixelEnd, parent->samplesPerPixel, parent->shutterOpen,
       parent->shutterClose),
+      _xFilmStart(parent->_xFilmStart),
+      _yFilmStart(parent->_yFilmStart),
       _xPixelCount(parent->_xPixelCount),
       _yPixelCount(parent->_yPixelCount),
       _nIterations(parent->_nIterations),
+      _batchSize(parent->_batchSize),
+      _ldSampling(parent->_ldSampling),
+      _threshold(parent->_threshold),
+      _errPercentile(parent->_errPercentile),
       _film(parent->_film) {
     // Update the sampler state
     _adaptive = true;
     _samplerInit = NULL;
-    _samplesBuf = NULL;
-    _scramblingA = scrambling;
+    _nGeneratedA = nGenerated;
+    _mapSumsA = _mapSumsB = NULL;
+    _firstPass = firstPass;
 
     // Each sub-sampler is tasked to sample a specific tile of the whole image.
     _xPos = xstart;
@@ -96,13 +158,13 @@ DualSampler::DualSampler(const DualSampler *parent, int xstart,
 DualSampler::~DualSampler() {
     if (_samplerInit != NULL) delete _samplerInit;
     if (_isMainSampler) {
-        delete [] _scramblingA;
-        delete [] _scramblingB;
-        delete _samplingMapA;
-        delete _samplingMapB;
+        delete [] _nGeneratedA;
+        delete [] _nGeneratedB;
+        delete [] _samplingMapA;
+        delete [] _samplingMapB;
+        delete [] _mapSumsA;
+        delete [] _mapSumsB;
     }
-    if (_samplesBuf != NULL)
-        delete [] _samplesBuf;
 }
 
 
@@ -125,25 +187,30 @@ void DualSampler::initBase(const DualSampler * parent, bool firstPass) {
 
     // Compute the total number of pixels to be generated
     int nPix = _xPixelCount * _yPixelCount;
-    int nSamplesInit = (sppInitA + sppInitB) * nPix;
-    int nSamplesAdapt = samplesPerPixel * nPix - nSamplesInit;
+    _nSamplesInit = (sppInitA + sppInitB) * nPix;
+    int nSamplesAdapt = samplesPerPixel * nPix - _nSamplesInit;
     _pixelsToSampleTotal = Ceil2Int(float(nSamplesAdapt) / samplesPerPixel);
 
     if (parent != NULL) {
         _xPos = _xStartSub;
         _yPos = _yStartSub;
         _isMainSampler = false;
-        _scramblingA = (firstPass) ? parent->_scramblingA : parent->_scramblingB;
+        _nGeneratedA = (firstPass) ? parent->_nGeneratedA : parent->_nGeneratedB;
+        _mapSumsA = _mapSumsB = NULL;
+        _firstPass = firstPass;
     }
     else {
         _xPos = xPixelStart;
         _yPos = yPixelStart;
         _isMainSampler = true;
         int nPixInit = (xPixelEnd-xPixelStart) * (yPixelEnd-yPixelStart);
-        _scramblingA = new NlmeansScramblingInfo[nPixInit];
-        _scramblingB = new NlmeansScramblingInfo[nPixInit];
+        _nGeneratedA = new uint32_t[nPixInit]();
+        _nGeneratedB = new uint32_t[nPixInit]();
         _samplingMapA = new float[nPixInit];
         _samplingMapB = new float[nPixInit];
+        int nSums = (_xPixelCount+1) * (_yPixelCount+1);
+        _mapSumsA = new double[nSums]();
+        _mapSumsB = new double[nSums]();
     }
 }
 
@@ -163,19 +230,86 @@ Sampler *DualSampler::GetSubSampler(int num, int count) {
         return new DualSampler(this, x0, x1, y0, y1, firstPass);
     }
     else {
-        // Compute this job's tile
+        // Compute this job's tile. Equal-area tiles would leave most of the
+        // work to the few tiles covering the noisy regions, so the tiles are
+        // cut to hold the same share of the sampling map instead.
         int x0, x1, y0, y1;
-        ComputeSubWindow(num, count, &x0, &x1, &y0, &y1);
-
-        // Ensure we don't go outside the sampling map bounds
-        x0 = max(x0, 0); x1 = min(x1, _xPixelCount);
-        y0 = max(y0, 0); y1 = min(y1, _yPixelCount);
+        BalancedSubWindow(firstPass ? _mapSumsA : _mapSumsB, num, count,
+            &x0, &x1, &y0, &y1);
+        if (x0 == x1 || y0 == y1) return NULL;
+        x0 += _xFilmStart; x1 += _xFilmStart;
+        y0 += _yFilmStart; y1 += _yFilmStart;
 
         // Use the appropriate sampling map
         if (firstPass)
-            return new DualSampler(this, x0, x1, y0, y1, _samplingMapA, _scramblingA);
+            return new DualSampler(this, x0, x1, y0, y1, _samplingMapA, _nGeneratedA, true);
         else
-            return new DualSampler(this, x0, x1, y0, y1, _samplingMapB, _scramblingB);
+            return new DualSampler(this, x0, x1, y0, y1, _samplingMapB, _nGeneratedB, false);
+    }
+}
+
+
+void DualSampler::BuildMapSums(const float *samplingMap, double *mapSums) const {
+    // A pixel never gets more than 'samplesPerPixel' samples, see
+    // GetMoreSamplesMap()
+    int w = _xPixelCount + 1;
+    float maxSpp = samplesPerPixel;
+    for (int x = 0; x < w; x++)
+        mapSums[x] = 0.;
+    for (int y = 0; y < _yPixelCount; y++) {
+        double rowSum = 0.;
+        mapSums[(y+1)*w] = 0.;
+        for (int x = 0; x < _xPixelCount; x++) {
+            rowSum += min(samplingMap[x + y*_xPixelCount], maxSpp);
+            mapSums[(y+1)*w + x+1] = mapSums[y*w + x+1] + rowSum;
+        }
+    }
+}
+
+
+void DualSampler::BalancedSubWindow(const double *mapSums, int num, int count,
+        int *x0, int *x1, int *y0, int *y1) const {
+    int w = _xPixelCount + 1;
+    *x0 = 0; *x1 = _xPixelCount;
+    *y0 = 0; *y1 = _yPixelCount;
+    // Descend the binary split of the film down to tile 'num'. Each split cuts
+    // the longer side of the current region where the first part gets its
+    // share of the samples.
+    while (count > 1) {
+        int nFirst = count / 2;
+        bool splitX = (*x1 - *x0) >= (*y1 - *y0);
+        int lo = splitX ? *x0 : *y0, hi = splitX ? *x1 : *y1;
+        double total = SummedArea(mapSums, w, *x0, *x1, *y0, *y1);
+        int split;
+        if (total <= 0.)
+            split = lo + (hi - lo) * nFirst / count;
+        else {
+            // Find the first cut whose first part reaches the target, then
+            // keep whichever of it and the previous cut is closer
+            double target = total * nFirst / count;
+            int a = lo, b = hi;
+            while (a < b) {
+                int m = (a + b) / 2;
+                if (HeadSum(mapSums, w, splitX, *x0, *x1, *y0, *y1, m) < target)
+                    a = m + 1;
+                else
+                    b = m;
+            }
+            split = a;
+            if (split > lo &&
+                target - HeadSum(mapSums, w, splitX, *x0, *x1, *y0, *y1, split-1) <
+                HeadSum(mapSums, w, splitX, *x0, *x1, *y0, *y1, split) - target)
+                split--;
+        }
+        if (num < nFirst) {
+            if (splitX) *x1 = split; else *y1 = split;
+            count = nFirst;
+        }
+        else {
+            if (splitX) *x0 = split; else *y0 = split;
+            num -= nFirst;
+            count -= nFirst;
+        }
     }
 }
 
@@ -195,20 +329,18 @@ int DualSampler::GetMoreSamplesMap(Sample *samples, RNG &rng) {
         for (int i = 0; i < nSamples; i++) {
             int xPos = samples[i].imageX;
             int yPos = samples[i].imageY;
-            if (xPos >= 0 && yPos >= 0 && xPos < _xPixelCount && yPos < _yPixelCount) {
+            if (xPos >= _xFilmStart && yPos >= _yFilmStart &&
+                xPos < _xFilmStart + _xPixelCount && yPos < _yFilmStart + _yPixelCount) {
                 int pix = (xPos-xPixelStart) + (yPos-yPixelStart) * (xPixelEnd-xPixelStart); // pixel offset
-                // Seed low-discrepancy scrambling for this pixel
-                if (_scramblingA[pix]._nGenerated == 0) {
-                    int nSeeds = 2;
-                    _scramblingA[pix]._seeds.resize(nSeeds);
-                    for (int i = 0; i < nSeeds; i++)
-                        _scramblingA[pix]._seeds[i] = rng.RandomUInt();
-                    _scramblingA[pix]._image = &_scramblingA[pix]._seeds[0];
+                if (_ldSampling) {
+                    LDPixelSample(xPos, yPos, _nGeneratedA[pix], samples[i], rng);
+                    continue;
                 }
-                // Draw scrambled low-discrepancy samples
-                float buffer[2]; // 2 floats per image sampleiv -
-                MyLDShuffleScrambled2D(1, 1, _scramblingA[pix]._nGenerated, &buffer[0], rng, _scramblingA[pix]._image);
-                _scramblingA[pix]._nGenerated++;
+                // Draw scrambled low-discrepancy image samples
+                float buffer[2]; // 2 floats per image sample
+                uint32_t seed = PixelSeed(xPos, yPos);
+                uint32_t scramble[2] = { DimensionSeed(seed, 0), DimensionSeed(seed, 1) };
+                Sample02(_nGeneratedA[pix]++, scramble, buffer);
                 samples[i].imageX = xPos + buffer[0];
                 samples[i].imageY = yPos + buffer[1];
             }
@@ -216,11 +348,17 @@ int DualSampler::GetMoreSamplesMap(Sample *samples, RNG &rng) {
         return nSamples;
     }
 
-    // Go over the tile until we get some samples
+    // Go over the tile, filling the batch with the samples of as many pixels
+    // as fit in it
+    int nBatch = 0;
     for ( ; _yPos < _yEndSub; _yPos++) {
         for ( ; _xPos < _xEndSub; _xPos++) {
+            // Stop before a pixel that might not fit, it starts the next batch
+            if (nBatch + samplesPerPixel > _batchSize)
+                return nBatch;
+
             // Get requested sample count for current pixel
-            int pix = _xPos + _yPos * _xPixelCount;
+            int pix = (_xPos - _xFilmStart) + (_yPos - _yFilmStart) * _xPixelCount;
             float req = _samplingMapA[pix];
 
             // Factor in the half-toning error from the previous pixel
@@ -244,285 +382,163 @@ int DualSampler::GetMoreSamplesMap(Sample *samples, RNG &rng) {
             float buffer[2]; // 2 floats per image sample
 
             // Get samples
+            Sample *pixelSamples = samples + nBatch;
+            if (_ldSampling) {
+                int pix = (_xPos-xPixelStart) + (_yPos-yPixelStart) * (xPixelEnd-xPixelStart);
+                for (int i = 0; i < nSamples; i++)
+                    LDPixelSample(_xPos, _yPos, _nGeneratedA[pix], pixelSamples[i], rng);
+                nBatch += nSamples;
+                continue;
+            }
             for (int i = 0; i < nSamples; i++) {
                 // Importance sampling
                 float xTmp = rng.RandomFloat(), yTmp = rng.RandomFloat();
-                samples[i].imageX = _xPos + xTmp;
-                samples[i].imageY = _yPos + yTmp;
-                samples[i].lensU = rng.RandomFloat();
-                samples[i].lensV = rng.RandomFloat();
-                samples[i].time = Lerp(rng.RandomFloat(), shutterOpen, shutterClose);
+                pixelSamples[i].imageX = _xPos + xTmp;
+                pixelSamples[i].imageY = _yPos + yTmp;
+                pixelSamples[i].lensU = rng.RandomFloat();
+                pixelSamples[i].lensV = rng.RandomFloat();
+                pixelSamples[i].time = Lerp(rng.RandomFloat(), shutterOpen, shutterClose);
                 // Generate random samples for integrators
-                for (uint32_t j = 0; j < samples[i].n1D.size(); ++j)
-                    for (uint32_t k = 0; k < samples[i].n1D[j]; ++k) {
-                        samples[i].oneD[j][k] = rng.RandomFloat();
+                for (uint32_t j = 0; j < pixelSamples[i].n1D.size(); ++j)
+                    for (uint32_t k = 0; k < pixelSamples[i].n1D[j]; ++k) {
+                        pixelSamples[i].oneD[j][k] = rng.RandomFloat();
                     }
-                for (uint32_t j = 0; j < samples[i].n2D.size(); ++j)
-                    for (uint32_t k = 0; k < 2*samples[i].n2D[j]; ++k)
-                        samples[i].twoD[j][k] = rng.RandomFloat();
+                for (uint32_t j = 0; j < pixelSamples[i].n2D.size(); ++j)
+                    for (uint32_t k = 0; k < 2*pixelSamples[i].n2D[j]; ++k)
+                        pixelSamples[i].twoD[j][k] = rng.RandomFloat();
 
                 // Replace image samples with low-discrepancy samples inside film buffer
-                int xPosSmp = Floor2Int(samples[i].imageX);
-                int yPosSmp = Floor2Int(samples[i].imageY);
-                if (xPosSmp >= 0 && yPosSmp >= 0 && xPosSmp < _xPixelCount && yPosSmp < _yPixelCount) {
+                int xPosSmp = Floor2Int(pixelSamples[i].imageX);
+                int yPosSmp = Floor2Int(pixelSamples[i].imageY);
+                if (xPosSmp >= _xFilmStart && yPosSmp >= _yFilmStart &&
+                    xPosSmp < _xFilmStart + _xPixelCount && yPosSmp < _yFilmStart + _yPixelCount) {
                     int pix = (xPosSmp-xPixelStart) + (yPosSmp-yPixelStart) * (xPixelEnd-xPixelStart); // pixel offset
-                    if (true) {//_scrambling[pix]._nGenerated < 32) {
-                        // Draw the samples
-                        MyLDShuffleScrambled2D(1, 1, _scramblingA[pix]._nGenerated, buffer, rng, _scramblingA[pix]._image);
-                        samples[i].imageX = xPosSmp + buffer[0];
-                        samples[i].imageY = yPosSmp + buffer[1];
-                        _scramblingA[pix]._nGenerated++;
-                    }
+                    uint32_t seed = PixelSeed(xPosSmp, yPosSmp);
+                    uint32_t scramble[2] = { DimensionSeed(seed, 0), DimensionSeed(seed, 1) };
+                    Sample02(_nGeneratedA[pix]++, scramble, buffer);
+                    pixelSamples[i].imageX = xPosSmp + buffer[0];
+                    pixelSamples[i].imageY = yPosSmp + buffer[1];
                 }
             }
-
-            // Move to next pixel and return sample count
-            _xPos++;
-            return nSamples;
+            nBatch += nSamples;
         }
         _xPos = _xStartSub;
     }
 
-    return 0;
+    return nBatch;
+}
+
+
+uint32_t DualSampler::PixelSeed(int xPos, int yPos) const {
+    // The seeds only depend on the raster position and the pass, so they
+    // need no storage and are the same in every tile of a distributed
+    // render
+    uint32_t h = MixBits(uint32_t(xPos));
+    h = MixBits(h ^ uint32_t(yPos));
+    return MixBits(h ^ (_firstPass ? 0x5bd1e995u : 0x1b873593u));
 }
 
 
-//void DualSampler::MyLDPixelSample(int xPos, int yPos, float shutterOpen,
-//    float shutterClose, int nPixelSamples, Sample *samples, RNG &rng,
-//    NlmeansScramblingInfo *scramblingArray) {
-//    // Prepare temporary array pointers for low-discrepancy camera samples
-//    float *buf = _samplesBuf;
-//    float *imageSamples = buf; buf += 2 * nPixelSamples;
-//    float *lensSamples = buf;  buf += 2 * nPixelSamples;
-//    float *timeSamples = buf;  buf += nPixelSamples;
-//
-//    // Prepare temporary array pointers for low-discrepancy integrator samples
-//    uint32_t count1D = samples[0].n1D.size();
-//    uint32_t count2D = samples[0].n2D.size();
-//    const uint32_t *n1D = count1D > 0 ? &samples[0].n1D[0] : NULL;
-//    const uint32_t *n2D = count2D > 0 ? &samples[0].n2D[0] : NULL;
-//    float **oneDSamples = ALLOCA(float *, count1D);
-//    float **twoDSamples = ALLOCA(float *, count2D);
-//    for (uint32_t i = 0; i < count1D; ++i) {
-//        oneDSamples[i] = buf;
-//        buf += n1D[i] * nPixelSamples;
-//    }
-//    for (uint32_t i = 0; i < count2D; ++i) {
-//        twoDSamples[i] = buf;
-//        buf += 2 * n2D[i] * nPixelSamples;
-//    }
-//
-//    // Get reference to the current pixel's scrambling info
-//    int pix = (xPos-xPixelStart) + (yPos-yPixelStart) * (xPixelEnd-xPixelStart);
-//    NlmeansScramblingInfo &scrambling = scramblingArray[pix];
-//
-//    // Define scrambling seeds on first call
-//    if (scrambling._nGenerated == 0) {
-//        int nSeeds = 5 + count1D + 2 * count2D;
-//        scrambling._seeds.resize(nSeeds);
-//        for (int i = 0; i < nSeeds; i++)
-//            scrambling._seeds[i] = rng.RandomUInt();
-//        scrambling._image = &scrambling._seeds[0];
-//        scrambling._lens = scrambling._image + 2;
-//        scrambling._time = scrambling._lens  + 2;
-//        scrambling._oneD = scrambling._time  + 1;
-//        scrambling._twoD = scrambling._oneD  + count1D;
-//    }
-//
-//    // Generate low-discrepancy pixel samples
-//    MyLDShuffleScrambled2D(1, nPixelSamples, scrambling._nGenerated, imageSamples, rng, scrambling._image);
-//    MyLDShuffleScrambled2D(1, nPixelSamples, scrambling._nGenerated, lensSamples,  rng, scrambling._lens);
-//    MyLDShuffleScrambled1D(1, nPixelSamples, scrambling._nGenerated, timeSamples,  rng, *scrambling._time);
-//    for (uint32_t i = 0; i < count1D; ++i)
-//        MyLDShuffleScrambled1D(n1D[i], nPixelSamples, scrambling._nGenerated, oneDSamples[i], rng, scrambling._oneD[i]);
-//    for (uint32_t i = 0; i < count2D; ++i)
-//        MyLDShuffleScrambled2D(n2D[i], nPixelSamples, scrambling._nGenerated, twoDSamples[i], rng, &scrambling._twoD[2*i]);
-//
-//    // Initialize _samples_ with computed sample values
-//    for (int i = 0; i < nPixelSamples; ++i) {
-//        samples[i].imageX = xPos + imageSamples[2*i];
-//        samples[i].imageY = yPos + imageSamples[2*i+1];
-//        samples[i].time = Lerp(timeSamples[i], shutterOpen, shutterClose);
-//        samples[i].lensU = lensSamples[2*i];
-//        samples[i].lensV = lensSamples[2*i+1];
-//        // Copy integrator samples into _samples[i]_
-//        for (uint32_t j = 0; j < count1D; ++j) {
-//            int startSamp = n1D[j] * i;
-//            for (uint32_t k = 0; k < n1D[j]; ++k)
-//                samples[i].oneD[j][k] = oneDSamples[j][startSamp+k];
-//        }
-//        for (uint32_t j = 0; j < count2D; ++j) {
-//            int startSamp = 2 * n2D[j] * i;
-//            for (uint32_t k = 0; k < 2*n2D[j]; ++k)
-//                samples[i].twoD[j][k] = twoDSamples[j][startSamp+k];
-//        }
-//    }
-//
-//    scrambling._nGenerated += nPixelSamples;
-//}
-
-
-//void DualSampler::MyLDPixelSampleInterleaved(int xPos, int yPos, float shutterOpen,
-//    float shutterClose, int nPixelSamples, Sample *samples, RNG &rng) {
-//    // Prepare temporary array pointers for low-discrepancy camera samples
-//    float *buf = _samplesBuf;
-//    float *imageSamples = buf; buf += 2 * nPixelSamples;
-//    float *lensSamples = buf;  buf += 2 * nPixelSamples;
-//    float *timeSamples = buf;  buf += nPixelSamples;
-//
-//    // Prepare temporary array pointers for low-discrepancy integrator samples
-//    uint32_t count1D = samples[0].n1D.size();
-//    uint32_t count2D = samples[0].n2D.size();
-//    const uint32_t *n1D = count1D > 0 ? &samples[0].n1D[0] : NULL;
-//    const uint32_t *n2D = count2D > 0 ? &samples[0].n2D[0] : NULL;
-//    float **oneDSamples = ALLOCA(float *, count1D);
-//    float **twoDSamples = ALLOCA(float *, count2D);
-//    for (uint32_t i = 0; i < count1D; ++i) {
-//        oneDSamples[i] = buf;
-//        buf += n1D[i] * nPixelSamples;
-//    }
-//    for (uint32_t i = 0; i < count2D; ++i) {
-//        twoDSamples[i] = buf;
-//        buf += 2 * n2D[i] * nPixelSamples;
-//    }
-//
-//    // Get reference to the current pixel's scrambling info
-//    int pix = (xPos-xPixelStart) + (yPos-yPixelStart) * (xPixelEnd-xPixelStart);
-//
-//    // Define scrambling seeds on first call
-//    if (_scramblingA[pix]._nGenerated == 0) {
-//        int nSeeds = 5 + count1D + 2 * count2D;
-//        _scramblingA[pix]._seeds.resize(nSeeds);
-//        _scramblingB[pix]._seeds.resize(nSeeds);
-//        for (int i = 0; i < nSeeds; i++) {
-//            _scramblingA[pix]._seeds[i] = rng.RandomUInt();
-//            _scramblingB[pix]._seeds[i] = rng.RandomUInt();
-//        }
-//        _scramblingA[pix]._image = &_scramblingA[pix]._seeds[0];
-//        _scramblingB[pix]._image = &_scramblingB[pix]._seeds[0];
-//        _scramblingA[pix]._lens = _scramblingA[pix]._image + 2;
-//        _scramblingB[pix]._lens = _scramblingB[pix]._image + 2;
-//        _scramblingA[pix]._time = _scramblingA[pix]._lens  + 2;
-//        _scramblingB[pix]._time = _scramblingB[pix]._lens  + 2;
-//        _scramblingA[pix]._oneD = _scramblingA[pix]._time  + 1;
-//        _scramblingB[pix]._oneD = _scramblingB[pix]._time  + 1;
-//        _scramblingA[pix]._twoD = _scramblingA[pix]._oneD  + count1D;
-//        _scramblingB[pix]._twoD = _scramblingB[pix]._oneD  + count1D;
-//    }
-//
-//    // Initialize _samples_ with computed sample values
-//    for (int i = 0; i < nPixelSamples; ++i) {
-//        NlmeansScramblingInfo &scrambling = (i%2 == 0) ? _scramblingA[pix] : _scramblingB[pix];
-//
-//        // Generate a low-discrepancy pixel sample for buffer A
-//        MyLDShuffleScrambled2D(1, 1, scrambling._nGenerated, &imageSamples[2*i], rng, scrambling._image);
-//        MyLDShuffleScrambled2D(1, 1, scrambling._nGenerated, &lensSamples[2*i],  rng, scrambling._lens);
-//        MyLDShuffleScrambled1D(1, 1, scrambling._nGenerated, &timeSamples[2*i],  rng, *scrambling._time);
-//        for (uint32_t j = 0; j < count1D; ++j)
-//            MyLDShuffleScrambled1D(n1D[j], 1, scrambling._nGenerated, oneDSamples[j], rng, scrambling._oneD[j]);
-//        for (uint32_t j = 0; j < count2D; ++j)
-//            MyLDShuffleScrambled2D(n2D[j], 1, scrambling._nGenerated, twoDSamples[j], rng, &scrambling._twoD[2*j]);
-//        scrambling._nGenerated ++;
-//
-//        // Add current pixel offset
-//        samples[i].imageX = xPos + imageSamples[2*i];
-//        samples[i].imageY = yPos + imageSamples[2*i+1];
-//        samples[i].time = Lerp(timeSamples[i], shutterOpen, shutterClose);
-//        samples[i].lensU = lensSamples[2*i];
-//        samples[i].lensV = lensSamples[2*i+1];
-//        // Copy integrator samples into _samples[i]_
-//        for (uint32_t j = 0; j < count1D; ++j) {
-//            int startSamp = n1D[j] * i;
-//            for (uint32_t k = 0; k < n1D[j]; ++k)
-//                samples[i].oneD[j][k] = oneDSamples[j][startSamp+k];
-//        }
-//        for (uint32_t j = 0; j < count2D; ++j) {
-//            int startSamp = 2 * n2D[j] * i;
-//            for (uint32_t k = 0; k < 2*n2D[j]; ++k)
-//                samples[i].twoD[j][k] = twoDSamples[j][startSamp+k];
-//        }
-//    }
-//}
-
-//int DualSampler::GetMoreSamplesMapLD(Sample *samples, RNG &rng) {
-//    // Nothing to do for degenerate patch
-//    if (_xStartSub == _xEndSub || _yStartSub == _yEndSub)
-//        return 0;
-//
-//    // During the initialization phase, we drawn samples one by one
-//    if (!_adaptive) {
-//        // Move to the next line of the tile if the current is done
-//        if (_xPos == _xEndSub) {
-//            _xPos = _xStartSub;
-//            _yPos++;
-//        }
-//
-//        // Stop if we processed all lines of the tile
-//        if (_yPos == _yEndSub)
-//            return 0;
-//
-//        // Allocate the "samples buffer" needed for low-discrepancy sampling
-//        if (_samplesBuf == NULL)
-//            _samplesBuf = new float[LDPixelSampleFloatsNeeded(samples, _sppInit)];
-//
-////        LDPixelSample(_xPos, _yPos, shutterOpen, shutterClose,
-////                    _sppInit, samples, _samplesBuf, rng);
-//        // Draw the samples
-//        MyLDPixelSample(_xPos, _yPos, shutterOpen, shutterClose, _sppInit, samples, rng, _scramblingA);
-//        _xPos++;
-//
-//        return _sppInit;
-//    }
-//
-//    // Allocate the "samples buffer" needed for low-discrepancy sampling
-//    if (_samplesBuf == NULL)
-//        _samplesBuf = new float[LDPixelSampleFloatsNeeded(samples, samplesPerPixel)];
-//
-//    // Go over the tile until we get some samples
-//    for ( ; _yPos < _yEndSub; _yPos++) {
-//        for ( ; _xPos < _xEndSub; _xPos++) {
-//            // Get requested sample count for current pixel
-//            int pix = _xPos + _yPos * _xPixelCount;
-//            float req = _samplingMapA[pix];
-//
-//            // Factor in the half-toning error from the previous pixel
-//            req -= _sppErr;
-//
-//            // Convert the float request into an integer sample count, we use the
-//            // residual as the probability of drawing an additional sample
-//            int nSamples = Float2Int(req);
-//            if (rng.RandomFloat() < req-nSamples)
-//                nSamples++;
-//
-//            // Update the rounding error
-//            nSamples = min(samplesPerPixel, nSamples);
-//            _sppErr = nSamples - req;
-//
-//            // Skip this pixel if there's no sample to draw
-//            if (nSamples <= 0)
-//                continue;
-//
-//            // Draw the samples
-//            MyLDPixelSample(_xPos, _yPos, shutterOpen, shutterClose, nSamples, samples, rng, _scramblingA);
-//
-//            // Move to next pixel and return sample count
-//            _xPos++;
-//            return nSamples;
-//        }
-//        _xPos = _xStartSub;
-//    }
-//
-//    return 0;
-//}
+uint32_t DualSampler::LDIndex(uint32_t n, uint32_t seed) const {
+    // Each dimension visits the pixel's samples in its own order, so that
+    // the dimensions aren't correlated with each other. The order is a
+    // nested uniform (Owen) scramble of the index (Burley 2020): the
+    // Laine-Karras hash only lets the low bits of its input change the
+    // higher ones, so applied to the reversed bits it maps each aligned
+    // block of 2^m indices one-to-one onto an aligned block, in general
+    // another one. The first 2^m samples thus take one whole aligned block
+    // of each sequence, and their points are still a (0,m,2)-net, or a
+    // (0,m,1)-net for the 1D ones.
+    n = ReverseBits(n);
+    n += seed;
+    n ^= n * 0x6c50b47cu;
+    n ^= n * 0xb82f1e52u;
+    n ^= n * 0xc7afe638u;
+    n ^= n * 0x8d22f6e6u;
+    return ReverseBits(n);
+}
+
+
+void DualSampler::LDPixelSample(int xPos, int yPos, uint32_t &nGenerated,
+        Sample &sample, RNG &rng) const {
+    // Image (2), lens (2) and time (1) seeds, the arrays hash theirs after
+    uint32_t count1D = sample.n1D.size(), count2D = sample.n2D.size();
+    uint32_t pixelSeed = PixelSeed(xPos, yPos);
+    uint32_t seeds[5];
+    for (int i = 0; i < 5; i++)
+        seeds[i] = DimensionSeed(pixelSeed, i);
+    uint32_t n = nGenerated++;
+
+    // The image samples keep the order of the sequence
+    float image[2], lens[2];
+    Sample02(n, &seeds[0], image);
+    Sample02(LDIndex(n, seeds[2]), &seeds[2], lens);
+    float time = VanDerCorput(LDIndex(n, seeds[4]), seeds[4]);
+    sample.imageX = xPos + image[0];
+    sample.imageY = yPos + image[1];
+    sample.lensU = lens[0];
+    sample.lensV = lens[1];
+    sample.time = Lerp(time, shutterOpen, shutterClose);
+
+    // Arrays take consecutive points of the sequence, shuffled so that
+    // arrays of the same size aren't correlated
+    for (uint32_t j = 0; j < count1D; ++j) {
+        uint32_t seed = DimensionSeed(pixelSeed, 5 + j);
+        uint32_t nj = sample.n1D[j], first = LDIndex(n, seed) * nj;
+        for (uint32_t k = 0; k < nj; ++k)
+            sample.oneD[j][k] = VanDerCorput(first + k, seed);
+        Shuffle(sample.oneD[j], nj, 1, rng);
+    }
+    for (uint32_t j = 0; j < count2D; ++j) {
+        uint32_t dim = 5 + count1D + 2 * j;
+        uint32_t seed[2] = { DimensionSeed(pixelSeed, dim), DimensionSeed(pixelSeed, dim + 1) };
+        uint32_t nj = sample.n2D[j], first = LDIndex(n, seed[0]) * nj;
+        for (uint32_t k = 0; k < nj; ++k)
+            Sample02(first + k, seed, &sample.twoD[j][2*k]);
+        Shuffle(sample.twoD[j], nj, 2, rng);
+    }
+}
+
+
+bool DualSampler::WriteCheckpoint(FILE *f) const {
+    int32_t pixelsToSample = _pixelsToSampleTotal;
+    if (fwrite(&pixelsToSample, sizeof(int32_t), 1, f) != 1)
+        return false;
+    // Sample count of each pixel, the seeds are hashed from the pixel
+    int nPix = (xPixelEnd-xPixelStart) * (yPixelEnd-yPixelStart);
+    return fwrite(_nGeneratedA, sizeof(uint32_t), nPix, f) == size_t(nPix) &&
+           fwrite(_nGeneratedB, sizeof(uint32_t), nPix, f) == size_t(nPix);
+}
+
+
+bool DualSampler::ReadCheckpoint(FILE *f) {
+    int32_t pixelsToSample;
+    if (fread(&pixelsToSample, sizeof(int32_t), 1, f) != 1)
+        return false;
+    _pixelsToSampleTotal = pixelsToSample;
+    int nPix = (xPixelEnd-xPixelStart) * (yPixelEnd-yPixelStart);
+    return fread(_nGeneratedA, sizeof(uint32_t), nPix, f) == size_t(nPix) &&
+           fread(_nGeneratedB, sizeof(uint32_t), nPix, f) == size_t(nPix);
+}
 
 
 Sampler *CreateDualSampler(const ParamSet &params,
                                 const Film *film, const Camera *camera) {
     int spp = params.FindOneInt("pixelsamples", 32);
     int sppInit = params.FindOneInt("pixelsamplesinit", spp/2);
-    float th = params.FindOneFloat("threshold", std::numeric_limits<float>::infinity());
+    // Stop the adaptive iterations once the estimated relative error of the
+    // denoised image falls below this value, 0 always runs all of them. The
+    // error is taken at the given percentile of the pixels.
+    float th = params.FindOneFloat("threshold", 0.f);
+    float errPercentile = Clamp(params.FindOneFloat("errorpercentile", 95.f), 0.f, 100.f);
     // By default we update 5% of the image on each iteration
     int nIterations = params.FindOneInt("niterations", 8);
+    // Samples returned per call in the adaptive phase, spanning as many
+    // pixels as fit. It is at least 'pixelsamples'.
+    int batchSize = params.FindOneInt("batchsize", 64);
+    // Scrambled low-discrepancy values for every dimension of the samples,
+    // false only uses them for the image position
+    bool ldSampling = params.FindOneBool("lowdiscrepancy", true);
 
     int xstart, xend, ystart, yend;
     film->GetSampleExtent(&xstart, &xend, &ystart, &yend);
@@ -539,7 +555,12 @@ Sampler *CreateDualSampler(const ParamSet &params,
     Info("   pixelsamples.....: %d\n", spp);
     Info("   pixelsamplesinit.: %d\n", sppInit);
     Info("   niterations......: %d\n", nIterations);
+    Info("   threshold........: %g\n", th);
+    Info("   errorpercentile..: %g\n", errPercentile);
+    Info("   batchsize........: %d\n", max(batchSize, spp));
+    Info("   lowdiscrepancy...: %s\n", ldSampling ? "true" : "false");
 
     return new DualSampler(xstart, xend, ystart, yend, spp, camera->shutterOpen,
-        camera->shutterClose, th, nIterations, sppInit, dualFilm);
+        camera->shutterClose, th, errPercentile, nIterations, sppInit, batchSize,
+        ldSampling, dualFilm);
 }
\ No newline at end of file
@@ -15,31 +15,20 @@
 #include "montecarlo.h"
 #include "nlmkernel.h"
 
-struct NlmeansScramblingInfo {
-    NlmeansScramblingInfo() { _nGenerated = 0; }
-    uint32_t _nGenerated;
-    vector<uint32_t> _seeds;
-    uint32_t *_image;
-    uint32_t *_lens;
-    uint32_t *_time;
-    uint32_t *_oneD;
-    uint32_t *_twoD;
-};
-
-
 class DualSampler : public Sampler {
 public:
     // DualSampler public methods
     DualSampler(int xstart, int xend, int ystart, int yend, int spp,
-        float sopen, float sclose, float threshold, int nIterations,
-        int sppInit, const DualFilm *film);
+        float sopen, float sclose, float threshold, float errPercentile,
+        int nIterations, int sppInit, int batchSize, bool ldSampling,
+        const DualFilm *film);
     // Constructor for sub-sampler during init phase
     DualSampler(const DualSampler *parent, int xstart, int xend,
         int ystart, int yend, bool firstPass);
     // Constructor for sub-sampler during adaptive phase, uses sampling map
     DualSampler(const DualSampler *parent, int xstart, int xend,
-        int ystart, int yend, float *samplingMap,
-        NlmeansScramblingInfo *scrambling);
+        int ystart, int yend, float *samplingMap, uint32_t *nGenerated,
+        bool firstPass);
     virtual ~DualSampler();
 
     Sampler *GetSubSampler(int num, int count);
@@ -49,7 +38,7 @@ public:
     }
 
     int MaximumSampleCount() {
-        return max(1, samplesPerPixel);
+        return max(1, max(samplesPerPixel, _batchSize));
     }
 
     int RoundSize(int size) const { return size; }
@@ -60,27 +49,74 @@ public:
 
     int GetIterationCount() { return _nIterations; }
 
+    float GetError() const { return _film->GetError(_errPercentile); }
+
+    // Denoise the current image to update the pixel errors. Returns false if
+    // the error estimate is already below the threshold.
+    bool UpdatePixelErrors() {
+        _film->UpdatePixelErrors();
+        return !Converged();
+    }
+
+    // Pipelined version of UpdatePixelErrors(), see DualFilm::BeginPixelErrors()
+    void BeginPixelErrors(vector<Task *> &tasks) { _film->BeginPixelErrors(tasks); }
+    bool EndPixelErrors(vector<Task *> &tasks) {
+        _film->EndPixelErrors(tasks);
+        return !Converged();
+    }
+
+    // Update the sampling maps for the next iteration from the pixel errors
     void GetSamplingMaps(int nPixels) {
         nPixels = min(nPixels, _pixelsToSampleTotal);
         _film->GetSamplingMaps(samplesPerPixel, nPixels*samplesPerPixel, _samplingMapA, _samplingMapB);
         _pixelsToSampleTotal -= nPixels;
+        BuildMapSums(_samplingMapA, _mapSumsA);
+        BuildMapSums(_samplingMapB, _mapSumsB);
+    }
+
+    // Pixels sampled by a sub-sampler. In the adaptive phase, the tiles are
+    // sized to hold the same expected sample count.
+    void GetSubWindow(int *x0, int *x1, int *y0, int *y1) const {
+        *x0 = _xStartSub; *x1 = _xEndSub;
+        *y0 = _yStartSub; *y1 = _yEndSub;
     }
 
+    // Replace the remaining adaptive budget, used for time budgeted rendering
+    void SetPixelsToSampleTotal(int nPixels) { _pixelsToSampleTotal = nPixels; }
+
+    int GetPixelCount() const { return _xPixelCount * _yPixelCount; }
+
+    int GetInitSampleCount() const { return _nSamplesInit; }
+
     void Finalize() const {
         _film->Finalize();
     }
 
+    // Save or restore the remaining adaptive budget and the sample count of
+    // every pixel of both passes, for the checkpoints of the two-stage
+    // renderer. Only meaningful on the main sampler.
+    bool WriteCheckpoint(FILE *f) const;
+    bool ReadCheckpoint(FILE *f);
+
 private:
     bool _isMainSampler;
 
-    // Film attributes
+    // Film attributes, the film may cover a crop window starting at
+    // (_xFilmStart, _yFilmStart)
+    int _xFilmStart, _yFilmStart;
     int _xPixelCount, _yPixelCount;
 
     // DualSampler private attributes
     int _nIterations;
+    // Maximum sample count of an adaptive batch
+    int _batchSize;
+    // Low-discrepancy values for all the dimensions
+    bool _ldSampling;
+    float _threshold, _errPercentile;
     const DualFilm *_film;
     bool _adaptive;
     int _pixelsToSampleTotal;
+    int _nSamplesInit;
 
     // Attributes for initialization phase
     Sampler *_samplerInit;
@@ -91,46 +127,40 @@ private:
     // Attributes for adaptive phase
     float *_samplingMapA, *_samplingMapB;
     float _sppErr;
+    // Summed-area tables of the sampling maps, (_xPixelCount+1) by
+    // (_yPixelCount+1), used to balance the adaptive tiles. Main sampler only.
+    double *_mapSumsA, *_mapSumsB;
 
-    // Per-pixel scrambling info
-    NlmeansScramblingInfo *_scramblingA, *_scramblingB;
+    // Count of low-discrepancy samples drawn in each pixel, per pass. The
+    // scrambling seeds aren't stored, they are hashed from the pixel.
+    uint32_t *_nGeneratedA, *_nGeneratedB;
+    // Pass of a sub-sampler, it selects the seeds of its buffer
+    bool _firstPass;
 
     // Filters used to produce the various scales
     //vector<const Kernel2D*> _filters;
 
     // DualSampler private methods
+    bool Converged() const { return _threshold > 0.f && GetError() < _threshold; }
     void initBase(const DualSampler * parent, bool firstPass = true);
 
-    // The following LD functions were extracted from montecarlo.h and extended
-    // to provide scrambling info on the fly, as well as the number of samples
-    // already generated. This allows our sampler to query iteratively from the
-    // low-discrepancy sequence.
-    void MyLDShuffleScrambled1D(int nSamples, int nPixel, int nGenerated,
-        float *samples, RNG &rng, const uint32_t scramble) {
-        for (int i = 0; i < nSamples * nPixel; ++i)
-            samples[i] = VanDerCorput(i+nGenerated, scramble);
-        for (int i = 0; i < nPixel; ++i)
-            Shuffle(samples + i * nSamples, nSamples, 1, rng);
-        Shuffle(samples, nPixel, nSamples, rng);
-    }
-    void MyLDShuffleScrambled2D(int nSamples, int nPixel, int nGenerated,
-        float *samples, RNG &rng, const uint32_t scramble[2]) {
-        for (int i = 0; i < nSamples * nPixel; ++i)
-            Sample02(i+nGenerated, scramble, &samples[2*i]);
-        for (int i = 0; i < nPixel; ++i)
-            Shuffle(samples + 2 * i * nSamples, nSamples, 2, rng);
-        Shuffle(samples, nPixel, 2 * nSamples, rng);
-    }
-
     int GetMoreSamplesMap(Sample *sample, RNG &rng);
-    int GetMoreSamplesMapLD(Sample *sample, RNG &rng);
-
-    float *_samplesBuf;
-    void MyLDPixelSample(int xPos, int yPos, float shutterOpen,
-        float shutterClose, int nPixelSamples, Sample *samples, RNG &rng,
-        NlmeansScramblingInfo *scramblingArray);
-    void MyLDPixelSampleInterleaved(int xPos, int yPos, float shutterOpen,
-        float shutterClose, int nPixelSamples, Sample *samples, RNG &rng);
+
+    void BuildMapSums(const float *samplingMap, double *mapSums) const;
+    // Tile 'num' of 'count', in film pixels, splitting the film recursively
+    // so that every tile gets the same expected sample count
+    void BalancedSubWindow(const double *mapSums, int num, int count,
+        int *x0, int *x1, int *y0, int *y1) const;
+
+    // Hash of a pixel and of this pass, the scrambling seeds of the pixel's
+    // dimensions derive from it
+    uint32_t PixelSeed(int xPos, int yPos) const;
+    // Index of the pixel's sample 'n' in the sequence of one dimension
+    uint32_t LDIndex(uint32_t n, uint32_t seed) const;
+    // Fill every dimension of the pixel's next sample with its scrambled
+    // low-discrepancy sequences
+    void LDPixelSample(int xPos, int yPos, uint32_t &nGenerated,
+        Sample &sample, RNG &rng) const;
 };
 
 Sampler *CreateDualSampler(const ParamSet &params, const Film *film,
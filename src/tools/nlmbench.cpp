@@ -0,0 +1,247 @@
+
+/*
+    pbrt source code Copyright(c) 1998-2012 Matt Pharr and Greg Humphreys.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// tools/nlmbench.cpp*
+// Runs the DualFilm denoisers on the A/B buffers dumped by a render (film
+// parameter "dumpbuffers"), for every requested engine and parameter set,
+// and reports their timings and their error against a reference image.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pbrt.h"
+#include "api.h"
+#include "imageio.h"
+#include "timer.h"
+#include "parallel.h"
+#include "spectrum.h"
+#include "film/dualfilm.h"
+
+static void usage() {
+    fprintf(stderr, "usage: nlmbench [--ncores n] [--ref reference.exr] "
+        "[--engines list] [--wnd_rad list] [--ptc_rad list] [--k list] "
+        "[--repeat n] <buffers.dual>\n"
+        "  engines: brute, box (every SIMD level), box-scalar, box-sse2,\n"
+        "           box-avx2, nlm-cpu; the default is box,nlm-cpu\n"
+        "  lists are comma separated, the defaults are the DualFilm ones\n");
+    exit(1);
+}
+
+
+static vector<string> SplitList(const char *list) {
+    vector<string> items;
+    string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == string::npos) end = s.size();
+        if (end > start) items.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+
+// One denoiser to benchmark
+struct BenchEngine {
+    BenchEngine(const string &n, NLMeanEngine e, NLMSimdLevel s, bool k)
+        : name(n), engine(e), simd(s), kernel(k) { }
+    string name;
+    NLMeanEngine engine;
+    NLMSimdLevel simd;
+    bool kernel;    // "nlm-cpu" symmetric kernel instead of NLMeanFilter
+};
+
+
+static void AddEngine(const string &name, vector<BenchEngine> &engines) {
+    NLMSimdLevel supported = NLMSimdSupported();
+    if (name == "brute")
+        engines.push_back(BenchEngine(name, NLM_ENGINE_BRUTE, supported, false));
+    else if (name == "nlm-cpu")
+        engines.push_back(BenchEngine(name, NLM_ENGINE_BOX, supported, true));
+    else if (name == "box") {
+        for (int level = NLM_SIMD_SCALAR; level <= supported; ++level) {
+            NLMSimdLevel simd = NLMSimdLevel(level);
+            engines.push_back(BenchEngine(string("box-") + NLMSimdName(simd),
+                NLM_ENGINE_BOX, simd, false));
+        }
+    }
+    else if (name.compare(0, 4, "box-") == 0) {
+        NLMSimdLevel simd = NLMSimdFromString(name.substr(4));
+        engines.push_back(BenchEngine(string("box-") + NLMSimdName(simd),
+            NLM_ENGINE_BOX, simd, false));
+    }
+    else
+        fprintf(stderr, "nlmbench: unknown engine \"%s\" ignored\n", name.c_str());
+}
+
+
+// Squared errors of a pixel channel: relative to the reference, and of the
+// images clamped to [0, 1]
+struct ErrorSums {
+    ErrorSums() : rel(0.), mse(0.) { }
+    double rel, mse;
+};
+
+
+struct AddError {
+    AddError(const float *r, const float *rf) : rgb(r), ref(rf) { }
+    void operator()(int i, ErrorSums &sums) const {
+        double d = rgb[i] - ref[i];
+        sums.rel += d * d / (ref[i] * ref[i] + 1e-2);
+        double dc = Clamp(rgb[i], 0.f, 1.f) - Clamp(ref[i], 0.f, 1.f);
+        sums.mse += dc * dc;
+    }
+    const float *rgb, *ref;
+};
+
+
+struct CombineErrors {
+    ErrorSums operator()(const ErrorSums &a, const ErrorSums &b) const {
+        ErrorSums sums;
+        sums.rel = a.rel + b.rel;
+        sums.mse = a.mse + b.mse;
+        return sums;
+    }
+};
+
+
+// relMSE as in the adaptive sampling papers, and PSNR of the images clamped
+// to [0, 1]
+static void ComputeErrors(const float *rgb, const float *ref, int nPix,
+        double *relMSE, double *psnr) {
+    ErrorSums sums = ParallelReduce(3 * nPix, ErrorSums(), AddError(rgb, ref),
+        CombineErrors(), 4096);
+    *relMSE = sums.rel / (3 * nPix);
+    double mse = sums.mse / (3 * nPix);
+    *psnr = (mse > 0.) ? 10. * log10(1. / mse) : INFINITY;
+}
+
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    const char *refFile = NULL, *buffersFile = NULL;
+    vector<string> engineNames = SplitList("box,nlm-cpu");
+    vector<string> wndList = SplitList("10"), ptcList = SplitList("3");
+    vector<string> kList = SplitList("0.1");
+    int nRepeat = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = (i + 1 < argc);
+        if (!strcmp(argv[i], "--ncores") && hasValue) opt.nCores = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ref") && hasValue) refFile = argv[++i];
+        else if (!strcmp(argv[i], "--engines") && hasValue) engineNames = SplitList(argv[++i]);
+        else if (!strcmp(argv[i], "--wnd_rad") && hasValue) wndList = SplitList(argv[++i]);
+        else if (!strcmp(argv[i], "--ptc_rad") && hasValue) ptcList = SplitList(argv[++i]);
+        else if (!strcmp(argv[i], "--k") && hasValue) kList = SplitList(argv[++i]);
+        else if (!strcmp(argv[i], "--repeat") && hasValue) nRepeat = max(1, atoi(argv[++i]));
+        else if (argv[i][0] == '-' || buffersFile) usage();
+        else buffersFile = argv[i];
+    }
+    if (!buffersFile) usage();
+    opt.quiet = true;
+    pbrtInit(opt);
+
+    PixelBuffer *pixelsA, *pixelsB;
+    if (!ReadDualBuffers(buffersFile, &pixelsA, &pixelsB))
+        return 1;
+    int xRes = pixelsA->xPixelCount, yRes = pixelsA->yPixelCount;
+    int nPix = xRes * yRes;
+
+    vector<float> ref;
+    if (refFile) {
+        int refX, refY;
+        RGBSpectrum *refImage = ReadImage(refFile, &refX, &refY);
+        if (!refImage) return 1;
+        if (refX != xRes || refY != yRes) {
+            fprintf(stderr, "nlmbench: reference is %dx%d, the buffers are %dx%d\n",
+                refX, refY, xRes, yRes);
+            return 1;
+        }
+        ref.resize(3 * nPix);
+        for (int i = 0; i < nPix; ++i)
+            refImage[i].ToRGB(&ref[3*i]);
+        delete[] refImage;
+    }
+
+    vector<BenchEngine> engines;
+    for (uint32_t i = 0; i < engineNames.size(); ++i)
+        AddEngine(engineNames[i], engines);
+
+    printf("%dx%d pixels, %d cores, best of %d runs\n", xRes, yRes,
+        NumSystemCores(), nRepeat);
+    printf("%-12s %7s %7s %6s %9s %8s %10s %8s\n", "engine", "wnd_rad",
+        "ptc_rad", "k", "time (s)", "Mpix/s", "relMSE", "PSNR");
+    for (uint32_t e = 0; e < engines.size(); ++e)
+    for (uint32_t w = 0; w < wndList.size(); ++w)
+    for (uint32_t p = 0; p < ptcList.size(); ++p)
+    for (uint32_t kk = 0; kk < kList.size(); ++kk) {
+        const BenchEngine &engine = engines[e];
+        int wnd_rad = atoi(wndList[w].c_str()), ptc_rad = atoi(ptcList[p].c_str());
+        float k = atof(kList[kk].c_str());
+
+        // Same setup as DualFilm
+        NLMeanFilter nlmean(wnd_rad, ptc_rad, k, 0.45f, engine.engine, engine.simd);
+        nlmean.Reserve(xRes, yRes);
+        NlmeansKernel kernel;
+        if (engine.kernel)
+            kernel.Init(wnd_rad, ptc_rad, k, xRes, yRes);
+
+        double best = INFINITY;
+        float *rgb = NULL;
+        for (int r = 0; r < nRepeat; ++r) {
+            Timer timer;
+            timer.Start();
+            if (engine.kernel)
+                rgb = NlmKernelDenoise(&kernel, &nlmean, pixelsA, pixelsB, NLM_DATA_FINAL);
+            else
+                rgb = nlmean.NLFiltering(pixelsA, pixelsB, xRes, yRes);
+            best = min(best, timer.Time());
+        }
+
+        printf("%-12s %7d %7d %6g %9.3f %8.2f", engine.name.c_str(), wnd_rad,
+            ptc_rad, k, best, nPix / best * 1e-6);
+        if (refFile) {
+            double relMSE, psnr;
+            ComputeErrors(rgb, &ref[0], nPix, &relMSE, &psnr);
+            printf(" %10.5f %8.2f", relMSE, psnr);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    delete pixelsA;
+    delete pixelsB;
+    pbrtCleanup();
+    return 0;
+}